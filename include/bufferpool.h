@@ -0,0 +1,84 @@
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#define CACHE_LINE 64
+
+class BufferPool;
+
+//===--------------------------------------------------===//
+// class PooledBuffer
+//===--------------------------------------------------===//
+
+// Ownership of a buffer taken from a pool, the buffer goes back to the pool when the handle is
+// dropped. An empty handle owns nothing (e.g. the pool was exhausted)
+class PooledBuffer {
+   protected:
+    BufferPool* m_pool = nullptr;
+    uint32_t m_index = 0;
+
+   public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool* pool, uint32_t index) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    PooledBuffer(PooledBuffer&& r) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& r) noexcept;
+    ~PooledBuffer();
+
+    explicit operator bool() const;
+    char* data() const;
+    size_t size() const;
+    // Give up the ownership without returning the buffer, and get its index, which shall be
+    // adopted again (see `BufferPool::adopt`). It lets the buffer pass through where a handle
+    // can not, e.g. a copyable task
+    uint32_t release();
+    // Return the buffer now
+    void reset();
+};
+
+//===--------------------------------------------------===//
+// class BufferPool
+//===--------------------------------------------------===//
+
+// Fixed number of fixed-size buffers allocated at once, each aligned to a cache line so that
+// buffers used by different threads never share one. Taking and returning buffers are lock-free,
+// the free buffers form a stack whose head is tagged against reuse between a read and a swap.
+class BufferPool {
+    friend class PooledBuffer;
+
+   protected:
+    static const uint32_t NONE = UINT32_MAX;
+
+    size_t m_size;
+    uint32_t m_count;
+    char* m_arena;
+    std::unique_ptr<std::atomic<uint32_t>[]> m_next;  // the next free buffer of each free buffer
+    std::atomic<uint64_t> m_head;                     // index of the top, tagged by a counter
+    std::atomic<uint64_t> m_misses{0};
+
+    void put(uint32_t index);
+
+   public:
+    BufferPool(size_t size, uint32_t count) noexcept;
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    ~BufferPool();
+
+    // Returns an empty handle if every buffer is in use
+    PooledBuffer acquire();
+    // Take the ownership given up by `PooledBuffer::release` again
+    PooledBuffer adopt(uint32_t index);
+
+    // Size of each buffer, rounded up to a whole number of cache lines
+    size_t size() const;
+    uint32_t count() const;
+    // Times that `acquire` has found the pool exhausted
+    uint64_t misses() const;
+};
+
+#endif  // __BUFFERPOOL_H__
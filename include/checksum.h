@@ -0,0 +1,22 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <cstddef>
+#include <cstdint>
+
+//===--------------------------------------------------===//
+// CRC32C
+//===--------------------------------------------------===//
+
+// CRC32C (Castagnoli), computed by the CRC instructions of SSE 4.2 or ARMv8 where the CPU has
+// them, or by tables otherwise. Chunks are checked by their own CRCs, and a file by the CRC of
+// each range, combined from those of its chunks as they come.
+
+// The CRC of `len` bytes, following the bytes before of `crc`
+uint32_t crc32c(const char* data, size_t len, uint32_t crc = 0);
+// The CRC of two blocks one after another, of the CRCs of each, `len2` is the length of the second
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+// Returns true if the CRC is computed by CPU instructions
+bool crc32c_accelerated();
+
+#endif  // __CHECKSUM_H__
@@ -0,0 +1,124 @@
+#ifndef __CHUNKINDEX_H__
+#define __CHUNKINDEX_H__
+
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fileio.h"
+
+//===--------------------------------------------------===//
+// Content-defined chunking
+//===--------------------------------------------------===//
+
+// A file is cut where a rolling hash of the last bytes matches a mask, so the cuts move along
+// with the content: data inserted or removed shifts the cuts near it only, and the same data in
+// other files is cut alike. The mask is stricter before the average size and looser after it, to
+// keep the sizes close to the average (FastCDC).
+#define CDC_MIN_SIZE 2048
+#define CDC_AVG_SIZE 8192
+#define CDC_MAX_SIZE 65536
+
+// 128-bit, chunks are told apart by their hashes alone
+struct ChunkHash {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+    bool operator==(const ChunkHash& other) const { return hi == other.hi && lo == other.lo; }
+};
+
+struct ChunkHashHasher {
+    size_t operator()(const ChunkHash& hash) const { return hash.lo; }
+};
+
+struct ContentChunk {
+    uint64_t offset;
+    uint32_t length;
+    ChunkHash hash;
+};
+
+ChunkHash chunk_hash(const char* data, size_t len);
+// Cut a file into chunks, an empty file has none
+// Returns nonzero if failed
+int cdc_split(FileSource& source, std::vector<ContentChunk>& out);
+
+//===--------------------------------------------------===//
+// Recipes
+//===--------------------------------------------------===//
+
+// A recipe assembles a file from chunks, a chunk the server has is referred to by its hash, and
+// the others are sent as data, a chunk each:
+//  'S' hash (16), length (4)  a chunk indexed
+//  'L' length (4), data       see DELTA_LITERAL
+#define RECIPE_STORED 'S'
+#define RECIPE_SUFFIX ".dedup"  // of the recipe beside the file it assembles
+
+// Write the recipe of a file of `chunks`, those `stored` are referred to
+// Returns the size of the recipe, or -1 if failed
+long long make_recipe(FileSource& source, const std::vector<ContentChunk>& chunks,
+                      const std::vector<bool>& stored, const std::string& out_path);
+
+//===--------------------------------------------------===//
+// class ChunkIndex
+//===--------------------------------------------------===//
+
+#define CHUNK_INDEX_NAME ".transf-chunks"  // in the save directory
+
+// Chunks of the files received, addressed by their hashes. A chunk is not copied, the index
+// tells where in a received file it is. It saves the chunks from being sent again, not the disk
+// space they take: every file is still written whole, as it is what users read. A file changed
+// since is told by its identity, its chunks are not found anymore. The index is a few lines of
+// text, appended to as files are received:
+//   transf-chunks 1
+//   file <identity> <path>               (a line for each file indexed, one of a path indexed
+//                                         before replaces it)
+//   chunk <hi> <lo> <offset> <length>    (a line for each chunk of the file above)
+// It is rewritten without the lines replaced and the files changed, once those are the most of it.
+class ChunkIndex {
+   private:
+    struct File {
+        std::string path;
+        uint64_t identity = 0;
+        bool replaced = false;  // by a file indexed at the same path since
+        size_t lines = 0;       // of chunks in the index
+    };
+    struct Location {
+        uint32_t file = 0;  // in `m_files`
+        uint32_t length = 0;
+        uint64_t offset = 0;
+    };
+
+    std::string m_index_path;
+    std::unordered_map<ChunkHash, Location, ChunkHashHasher> m_chunks;
+    // chunks refer to their files by index, so that a path is kept once
+    std::vector<File> m_files;
+    std::unordered_map<std::string, uint32_t> m_file_ids;  // of the files not replaced
+    size_t m_lines = 0;  // of chunks in the index, `m_stale` of which are of files replaced
+    size_t m_stale = 0;
+    std::mutex m_mutex;
+
+    uint32_t add_file(const std::string& path, uint64_t identity);
+    bool take_chunk(const ChunkHash& hash, const Location& location);
+    int compact();
+
+   public:
+    // Load the index at `index_path`, none is an empty index
+    // Returns nonzero if the index is malformed
+    int open(const std::string& index_path);
+    size_t size();
+    // Tell which chunks are in files unchanged since, each file is checked once
+    void has(const std::vector<ChunkHash>& hashes, std::vector<bool>& found);
+    // Assemble a file of `size` bytes at `out_path` from a recipe, `chunks` are those of it
+    // Returns nonzero if failed, e.g. a chunk referred to is gone or the recipe is malformed
+    int assemble(const std::string& recipe_path, const std::string& out_path, uint64_t size,
+                 std::vector<ContentChunk>& chunks);
+    // Index the chunks of a file at `path`, in place of those it had
+    // Returns nonzero if the index can not be saved
+    int add(const std::string& path, const std::vector<ContentChunk>& chunks);
+};
+
+#endif  // __CHUNKINDEX_H__
@@ -0,0 +1,26 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <cstddef>
+#include <cstdint>
+
+//===--------------------------------------------------===//
+// LZ compression
+//===--------------------------------------------------===//
+
+// A chunk is compressed on its own in the block format of LZ4: sequences of literals followed by
+// a match, a copy of earlier data at most 64 KB back. It is fast enough to keep up with the
+// network, and gains most on text such as logs and CSV.
+//  token (1)                   literal length (high 4 bits), match length - 4 (low 4 bits), 15
+//                              means more bytes follow, each added until one is not 255
+//  literals, offset (2, LE)    the last sequence has literals only
+#define LZ_MIN_MATCH 4
+
+// Compress `len` bytes into at most `cap` bytes
+// Returns the size compressed, or 0 if it does not fit in `cap`
+int lz_compress(const char* src, int len, char* dst, int cap);
+// Decompress into exactly `raw_len` bytes
+// Returns `raw_len`, or -1 if the data is malformed or makes another size
+int lz_decompress(const char* src, int len, char* dst, int raw_len);
+
+#endif  // __COMPRESS_H__
@@ -0,0 +1,84 @@
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+#include <chrono>
+#include <cstdint>
+
+//===--------------------------------------------------===//
+// class RttEstimator
+//===--------------------------------------------------===//
+
+// Round-trip time estimation as RFC 6298, all the values are in microseconds
+class RttEstimator {
+   protected:
+    int64_t m_srtt = 0;
+    int64_t m_rttvar = 0;
+    int64_t m_min_rtt = 0;
+    int64_t m_rto;
+    int64_t m_min_rto;
+    int64_t m_max_rto;
+
+   public:
+    RttEstimator(int64_t init_rto, int64_t min_rto, int64_t max_rto) noexcept;
+
+    void sample(int64_t rtt);
+    // Double the timeout after it expires
+    void backoff();
+
+    bool has_sample() const;
+    int64_t srtt() const;
+    int64_t rttvar() const;
+    int64_t min_rtt() const;
+    int64_t rto() const;
+};
+
+//===--------------------------------------------------===//
+// class CongestionControl
+//===--------------------------------------------------===//
+
+enum struct CongestionMode {
+    AIMD,   // additive increase, multiplicative decrease on loss (Reno)
+    DELAY,  // keeps the queuing delay low, backs off before losses happen (Vegas)
+};
+
+// Congestion window is counted in chunks, it never exceeds the window negotiated with server.
+// Datagrams are paced to spread a window over the smoothed round-trip time.
+class CongestionControl {
+   public:
+    typedef std::chrono::steady_clock clock;
+
+   protected:
+    CongestionMode m_mode;
+    double m_cwnd = 2;
+    double m_ssthresh;
+    double m_max_cwnd;
+    // losses of chunks sent before this sequence belong to the reduced episode
+    uint64_t m_recovery_seq = 0;
+    RttEstimator m_rtt;
+    clock::time_point m_next_send;
+
+   public:
+    CongestionControl(CongestionMode mode, unsigned max_window, int64_t max_rto) noexcept;
+
+    // `acked` chunks are newly acknowledged, `rtt` is negative if it is not sampled
+    void on_ack(unsigned acked, int64_t rtt);
+    // A chunk of transmission `seq` is lost, `cur_seq` is the latest transmission
+    void on_loss(uint64_t seq, uint64_t cur_seq);
+    void on_timeout(uint64_t cur_seq);
+    void on_sent();
+
+    // Chunks allowed in flight
+    unsigned window() const;
+    // Microseconds to wait before sending the next datagram
+    int64_t pacing_delay() const;
+    int64_t pacing_interval() const;
+    // Estimated sending rate in bytes per second
+    double rate(int chunk_size) const;
+
+    CongestionMode mode() const;
+    const RttEstimator& rtt() const;
+};
+
+const char* congestion_mode_name(CongestionMode mode);
+
+#endif  // __CONGESTION_H__
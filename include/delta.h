@@ -0,0 +1,67 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fileio.h"
+
+//===--------------------------------------------------===//
+// Signatures
+//===--------------------------------------------------===//
+
+// A file the server has already is split into blocks, and each block is signed by a weak checksum
+// that rolls over the data byte by byte, and a strong hash telling the blocks of the same weak
+// checksum apart. The client looks up every block-sized window of its file, and the windows found
+// are referred to instead of sent.
+struct BlockSignature {
+    uint32_t weak;
+    uint64_t strong;
+};
+
+struct Signatures {
+    uint64_t identity = 0;  // of the file signed, see `file_identity`
+    uint64_t size = 0;
+    uint32_t block_size = 0;
+    std::vector<BlockSignature> blocks;  // the last one may be short
+};
+
+// About the square root of the size, so that both the signatures and the data of a block that
+// does not match grow slowly with the size
+uint32_t delta_block_size(uint64_t size);
+// The weak checksum of rsync, two 16-bit sums
+uint32_t weak_checksum(const char* data, size_t len);
+// MurmurHash64A
+uint64_t strong_hash(const char* data, size_t len, uint64_t seed = 0x5bd1e995ull);
+
+// Sign the blocks [first, first + count) of a file, fewer at the end of the file
+// Returns nonzero if failed
+int sign_blocks(FileSource& source, uint32_t block_size, uint64_t first, size_t count,
+                std::vector<BlockSignature>& out);
+
+//===--------------------------------------------------===//
+// Delta
+//===--------------------------------------------------===//
+
+// A delta rebuilds a file from the blocks of an old one, it is a sequence of instructions:
+//  'C' first (8), count (4)   copy blocks [first, first + count) of the old file
+//  'L' length (4), data       the data itself
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_MAX_LITERAL (1 << 16)
+#define DELTA_SUFFIX ".delta"  // of the delta beside the file it rebuilds
+
+// Write the delta of a file against the signatures of the old one to `out_path`
+// Returns the size of the delta, or -1 if failed
+long long make_delta(FileSource& source, const Signatures& signatures,
+                     const std::string& out_path);
+// Rebuild a file of `size` bytes at `out_path` from a delta and the old file
+// Returns nonzero if failed, e.g. the delta is malformed or does not make `size` bytes
+int apply_delta(const std::string& delta_path, const std::string& old_path, uint32_t block_size,
+                const std::string& out_path, uint64_t size);
+
+#endif  // __DELTA_H__
@@ -0,0 +1,89 @@
+#ifndef __EVENTLOOP_H__
+#define __EVENTLOOP_H__
+
+#include "platform.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+//===--------------------------------------------------===//
+// class EventLoop
+//===--------------------------------------------------===//
+
+#define WATCH_NEXT 0  // keep watching the socket
+#define WATCH_END -1  // stop watching the socket, it is not closed by the loop
+
+typedef std::function<int(SOCKET)> ReadyHandler;
+
+// Readiness-based event loop, on epoll for Linux and WSAPoll elsewhere
+// Sockets are watched for reading, and the handler of a ready socket is called by one of the
+// threads running the loop. A socket is not watched while its handler runs, so that a handler
+// never runs concurrently with itself. One thread waits for events at a time, the others handle
+// the sockets got ready. A handler may pause its socket instead of waiting, it is watched again
+// after a while, the waiting thread wakes up for the earliest of them.
+class EventLoop {
+   public:
+    typedef std::chrono::steady_clock clock;
+
+   protected:
+    struct Watch {
+        ReadyHandler handler;
+        bool busy = false;
+        bool removed = false;
+        int64_t pause = 0;  // microseconds it is not watched for, once its handler returns
+    };
+    typedef std::shared_ptr<Watch> WatchPtr;
+
+    std::map<SOCKET, WatchPtr> m_watches;
+    // sockets got ready, taken in order from `m_ready_pos`, the vectors keep their storage so
+    // that waiting for events allocates nothing
+    std::vector<std::pair<SOCKET, WatchPtr>> m_ready;
+    size_t m_ready_pos = 0;
+    std::vector<SOCKET> m_polled;  // by the polling thread
+    std::multimap<clock::time_point, std::pair<SOCKET, WatchPtr>> m_paused;  // rearmed when due
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_running = true;
+    bool m_polling = false;
+    // a datagram socket on loopback sending to itself, interrupts the waiting thread
+    SOCKET m_wake = INVALID_SOCKET;
+    sockaddr_in m_wake_addr;
+#ifdef __linux__
+    int m_epfd = -1;
+#else
+    std::vector<WSAPOLLFD> m_pollfds;
+#endif
+
+    int init_wake();
+    void wake();
+    void poll(std::unique_lock<std::mutex>& lock);
+    void rearm(SOCKET s, const WatchPtr& watch);
+    void hold(SOCKET s, const WatchPtr& watch);
+    void unwatch(SOCKET s, const WatchPtr& watch);
+
+   public:
+    EventLoop() noexcept;
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    ~EventLoop();
+
+    bool valid() const;
+
+    int add(SOCKET s, const ReadyHandler& handler);
+    int remove(SOCKET s);
+    size_t size();
+    // Stop watching `s` for `delay` microseconds once its handler returns, called by the handler
+    int pause(SOCKET s, int64_t delay);
+
+    // Handle events until `stop`, it can be called by several threads
+    int run();
+    int stop();
+};
+
+#endif  // __EVENTLOOP_H__
@@ -0,0 +1,30 @@
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include <cstddef>
+#include <cstdint>
+
+//===--------------------------------------------------===//
+// Forward error correction
+//===--------------------------------------------------===//
+
+// Chunks of a range are sent in groups of `k`, each group followed by `m` parities, so that any
+// `m` chunks lost of a group are rebuilt by the server from the others, without asking for them
+// again. The parities are a Reed-Solomon code over GF(2^8) by a Cauchy matrix, scaled so that the
+// first parity is the XOR of the chunks, which is all there is if `m` is 1. A chunk shorter than
+// the others counts as padded with zeros.
+#define FEC_MAX_DATA 64
+#define FEC_MAX_PARITY 16
+
+// The coefficient of chunk `i` in parity `j` of a group of `k` chunks
+uint8_t fec_coef(int k, int j, int i);
+// dst ^= c * src, of `len` bytes each
+void fec_mul_add(char* dst, const char* src, size_t len, uint8_t c);
+// Rebuild the `n` chunks `lost` of a group of `k`, from `n` parities `rows`, of which the chunks
+// received have been taken off by `fec_mul_add`. `out` gets the chunks, of `len` bytes each
+void fec_rebuild(int k, const int* lost, const int* rows, int n, const char* const* parities,
+                 char* const* out, size_t len);
+// Returns true if the arithmetic is done by SIMD instructions
+bool fec_accelerated();
+
+#endif  // __FEC_H__
@@ -0,0 +1,152 @@
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include "platform.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+typedef HANDLE native_file;
+#define INVALID_NATIVE_FILE INVALID_HANDLE_VALUE
+#else
+typedef int native_file;
+#define INVALID_NATIVE_FILE -1
+#endif
+
+//===--------------------------------------------------===//
+// class OutputFile
+//===--------------------------------------------------===//
+
+// A file received at known size. It is created at full size up front, so that the filesystem
+// allocates it at once instead of extending it chunk by chunk, then mapped into memory, and data
+// is copied straight to its offset. If it can not be mapped (e.g. empty, or the space could not
+// be reserved), data is written with positional writes instead. Either way the data may be
+// placed in any order. It is closed on destruction.
+class OutputFile {
+   protected:
+    native_file m_file = INVALID_NATIVE_FILE;
+#ifdef _WIN32
+    HANDLE m_mapping = NULL;
+#endif
+    char* m_view = nullptr;
+    uint64_t m_size = 0;
+    bool m_failed = false;
+
+    int map();
+    void unmap();
+
+   public:
+    OutputFile() = default;
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+    ~OutputFile();
+
+    // Create or truncate a file of `size` bytes, returns nonzero if failed
+    // The data of an existing file is kept if `keep` (e.g. a transfer resumed)
+    int open(const std::string& path, uint64_t size, bool keep = false);
+    bool is_open() const;
+    bool mapped() const;
+    uint64_t size() const;
+    // Data beyond the size is not written, returns nonzero if failed
+    int write(const char* data, size_t len, uint64_t offset);
+    // Returns nonzero if any write has failed
+    int close();
+};
+
+//===--------------------------------------------------===//
+// class FileSource
+//===--------------------------------------------------===//
+
+#define READ_AHEAD_BLOCK (1 << 20)  // bytes read ahead at a time
+
+enum struct ReadMode {
+    READ,   // read when the data is requested
+    MAP,    // map the file into memory
+    AHEAD,  // read the following blocks in background
+};
+
+// A file sent at known size, read at any offset. The base reads the requested range from the
+// file directly, the derived sources keep the reads off the caller's way.
+class FileSource {
+   protected:
+    native_file m_file = INVALID_NATIVE_FILE;
+    uint64_t m_size = 0;
+
+   public:
+    FileSource() = default;
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+    virtual ~FileSource();
+
+    // Returns nonzero if failed
+    virtual int open(const std::string& path);
+    bool is_open() const;
+    uint64_t size() const;
+    // Read up to `len` bytes at `offset`, returns the number of bytes read (less only at the end
+    // of the file), or -1 if failed
+    virtual int read(char* out, int len, uint64_t offset);
+    virtual int close();
+};
+
+// The file is mapped into memory, and the kernel reads ahead as the mapping is accessed in order.
+// It reads from the file directly if it can not be mapped.
+class MappedSource : public FileSource {
+   protected:
+#ifdef _WIN32
+    HANDLE m_mapping = NULL;
+#endif
+    const char* m_view = nullptr;
+
+   public:
+    MappedSource() = default;
+    ~MappedSource();
+
+    int open(const std::string& path) override;
+    int read(char* out, int len, uint64_t offset) override;
+    int close() override;
+};
+
+// A thread reads the file in blocks ahead of the caller, which is assumed to go forward, so that
+// reads from slow storage overlap with the sending. Each of the `blocks` buffers holds a block, the
+// one being consumed and the following ones. Data behind them (e.g. resent) is read directly.
+class ReadAheadSource : public FileSource {
+   protected:
+    struct Slot {
+        std::vector<char> data;
+        uint64_t block = UINT64_MAX;  // the block held, UINT64_MAX if none
+        int len = 0;                  // -1 if the read has failed
+        bool loading = false;
+    };
+
+    size_t m_block_size;
+    std::vector<Slot> m_slots;
+    uint64_t m_want = 0;  // the block being consumed
+    bool m_running = false;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_want;   // the caller moves on
+    std::condition_variable m_cv_ready;  // a block is read
+
+    void work();
+
+   public:
+    ReadAheadSource(size_t block_size = READ_AHEAD_BLOCK, unsigned blocks = 2) noexcept;
+    ~ReadAheadSource();
+
+    int open(const std::string& path) override;
+    int read(char* out, int len, uint64_t offset) override;
+    int close() override;
+};
+
+std::unique_ptr<FileSource> make_file_source(ReadMode mode);
+
+const char* read_mode_name(ReadMode mode);
+
+#endif  // __FILEIO_H__
@@ -0,0 +1,132 @@
+#ifndef __IORING_H__
+#define __IORING_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+//===--------------------------------------------------===//
+// class IoRing
+//===--------------------------------------------------===//
+
+// Submission and completion queues shared with the kernel (io_uring), Linux only
+// Operations are queued, then submitted together by one call, and their results are reaped from
+// the completion queue, which is readable by polling `fd`. It is not valid if the kernel lacks
+// support, the callers shall fall back to plain calls then.
+class IoRing {
+   public:
+    typedef std::function<void(uint64_t data, int res)> CompletionHandler;
+
+   protected:
+    int m_fd = -1;
+    unsigned m_entries = 0;
+    // memory mapped rings
+    void* m_sq_ptr = nullptr;
+    size_t m_sq_size = 0;
+    void* m_cq_ptr = nullptr;
+    size_t m_cq_size = 0;
+    void* m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned* m_sq_mask = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned* m_cq_mask = nullptr;
+    void* m_cqes = nullptr;
+    unsigned m_queued = 0;                // prepared, not submitted yet
+    std::atomic<unsigned> m_inflight{0};  // submitted, not reaped yet
+    std::mutex m_sq_mutex;
+    std::mutex m_cq_mutex;
+
+    void release();
+    void* get_sqe();
+    void push_sqe();
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+    int flush();
+
+   public:
+    IoRing(unsigned entries = 256) noexcept;
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+    ~IoRing();
+
+    bool valid() const;
+    int fd() const;
+    unsigned queued();
+    unsigned inflight() const;
+
+#ifdef __linux__
+    // The message shall be kept until completion, `data` is passed to the completion handler
+    int recvmsg(int s, msghdr* msg, uint64_t data);
+#endif
+    // Write at `offset` of the file, from the registered buffer if `buf_index` >= 0
+    int write(int fd, const void* buf, unsigned len, uint64_t offset, uint64_t data,
+              int buf_index = -1);
+    // Register a region as buffer 0 for fixed writes, the kernel keeps it pinned
+    int register_buffer(void* base, size_t len);
+
+    // Submit the queued operations, and wait until `wait` operations complete
+    int submit(unsigned wait = 0);
+    // Handle the completed operations, returns the number of them
+    // The handler may queue operations again
+    int reap(const CompletionHandler& handler);
+};
+
+//===--------------------------------------------------===//
+// class RingWriter
+//===--------------------------------------------------===//
+
+// Positional file writes through a ring, so that writes proceed while the caller goes on
+// receiving. The data is copied into slots of a registered region, the caller's buffer is free
+// once `write` returns. A file shall be closed by `close`, which waits for its writes.
+class RingWriter {
+   protected:
+    struct FileState {
+        unsigned pending = 0;
+        bool failed = false;
+    };
+
+    IoRing m_ring;
+    size_t m_slot_size;
+    std::vector<char> m_arena;
+    std::vector<int> m_free;     // free slots
+    std::vector<int> m_slot_fd;  // file written from each slot
+    std::vector<size_t> m_slot_len;
+    std::map<int, FileState> m_files;
+    bool m_fixed = false;     // the arena is registered
+    std::mutex m_mutex;       // slots and files
+    std::mutex m_wait_mutex;  // completions are reaped by one thread at a time
+
+    void complete(uint64_t slot, int res);
+    void wait_some();
+
+   public:
+    RingWriter(size_t slot_size, unsigned slots = 256) noexcept;
+    RingWriter(const RingWriter&) = delete;
+    RingWriter& operator=(const RingWriter&) = delete;
+    ~RingWriter();
+
+    bool valid() const;
+
+    // Create or truncate a file, `size` bytes are allocated up front if known, returns -1 if failed
+    // The data of an existing file is kept if `keep` (e.g. a transfer resumed)
+    int open(const std::string& path, uint64_t size = 0, bool keep = false);
+    // Returns nonzero if the file has failed, the write itself may fail later
+    int write(int fd, const char* data, size_t len, uint64_t offset);
+    // Wait for the writes of the file, returns nonzero if any of them has failed
+    int flush(int fd);
+    int close(int fd);
+};
+
+#endif  // __IORING_H__
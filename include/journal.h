@@ -0,0 +1,54 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+//===--------------------------------------------------===//
+// struct Journal
+//===--------------------------------------------------===//
+
+#define JOURNAL_SUFFIX ".journal"
+
+// What has been received of a partial file, kept beside it when its transfer stops, so that a
+// later transfer of the same file sends the missing chunks only. It is a few lines of text:
+//   transf-journal 1
+//   size <file size>
+//   chunk <chunk size>
+//   identity <file identity>
+//   received <first> <last>    (a line for each range of chunks received, in order)
+struct Journal {
+    uint64_t size = 0;
+    uint64_t chunk_size = 0;
+    uint64_t identity = 0;
+    std::vector<ChunkRange> received;
+};
+
+// The journal of a file, a sibling named with JOURNAL_SUFFIX
+std::string journal_path(const std::string& path);
+// Write the journal of a file, it replaces the previous one at once, returns nonzero if failed
+int save_journal(const std::string& path, const Journal& journal);
+// Read the journal of a file, returns nonzero if there is none or it is malformed
+int load_journal(const std::string& path, Journal& journal);
+// Returns nonzero if failed, a file without a journal is not a failure
+int remove_journal(const std::string& path);
+
+//===--------------------------------------------------===//
+// Ranges of chunks
+//===--------------------------------------------------===//
+
+// The chunks of 1 to `chunks` out of `ranges`, which are in order and do not overlap
+std::vector<ChunkRange> complement_ranges(const std::vector<ChunkRange>& ranges, uint64_t chunks);
+// Merge the ranges nearest to each other until `max` ranges are left at most, the chunks between
+// them are included
+void merge_ranges(std::vector<ChunkRange>& ranges, size_t max);
+// Split the largest ranges in halves until there are `n` ranges, or every range is a chunk
+void split_ranges(std::vector<ChunkRange>& ranges, size_t n);
+// The number of bytes of the chunks in `ranges` of a file
+uint64_t ranges_size(const std::vector<ChunkRange>& ranges, uint64_t size, uint64_t chunk_size);
+
+#endif  // __JOURNAL_H__
@@ -1,19 +1,28 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
-#include <winsock2.h>
-#include <ws2ipdef.h>
-#include <ws2tcpip.h>
+#include "platform.h"
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "bufferpool.h"
+#include "eventloop.h"
+#include "fileio.h"
+#include "ioring.h"
+#include "ratelimit.h"
+#include "workerpool.h"
+
 typedef uint8_t ip_version;
 typedef int ip_family;
 typedef int sock_type;
@@ -107,14 +116,35 @@ class SocketServer;
 typedef std::function<int(const SocketPeer&)> PeerCloseHandler;
 typedef std::function<int(const SocketServer&)> ServerCloseHandler;
 typedef std::function<int(const SocketPeer&, const BasicSocket&)> StreamHandler;
-typedef std::function<int(const char*, const int, const SocketPeer&, const BasicSocket&)>
-    MessageHandler;
+// A message received, handed to the handlers in turn. A datagram comes in a pooled buffer which
+// owns `data`, a handler may take `buf` to keep the message after it returns, otherwise the buffer
+// is reused once the handlers return. `buf` is empty if the message is not pooled (e.g. of a
+// stream socket), it is valid while handling then
+struct Message {
+    const char* data;
+    int len;
+    PooledBuffer buf;
+};
+typedef std::function<int(Message&, const SocketPeer&, const BasicSocket&)> MessageHandler;
+
+#define ZEROCOPY_THRESHOLD 65536  // smaller messages are copied, pinning them costs more
+
+struct ZeroCopyState;
 
 class BasicSocket {
    protected:
     mutable SOCKET m_sockfd = INVALID_SOCKET;
     mutable bool m_prop_hasbound = false;
     addrcoll m_addrcoll;
+    std::shared_ptr<ZeroCopyState> m_zerocopy;
+    mutable std::atomic<bool> m_framed{false};
+
+    // Refer to the address of `info` without copying, and use an existing socket (or none)
+    BasicSocket(const addrcoll& info, SOCKET s) noexcept;
+
+    bool use_zerocopy(int len) const;
+    // Send a message built in a buffer of `zerocopy_buffer`, the buffer is taken
+    int send_zerocopy(PooledBuffer& buf, int len) const;
 
    public:
     BasicSocket() = default;
@@ -147,6 +177,25 @@ class BasicSocket {
     virtual bool ensure_addr() const;
     virtual bool ensure() const;
 
+    // Wait until there is data to receive, returns 0 if `timeout` (ms) expires
+    int readable(int timeout) const;
+
+    // Messages of a stream socket go as they are, one in each call to send and recv as peers of
+    // the text format expect, until it is framed, then each is prefixed by its length (4). A new
+    // socket is not framed
+    bool framed() const;
+
+    // Let messages of stream sockets with `threshold` bytes or more be sent in place from the
+    // buffers of `zerocopy_buffer` (MSG_ZEROCOPY, Linux only). It is turned off by itself if the
+    // kernel copies the data anyway (e.g. over loopback)
+    // Returns METHOD_NOT_IMPLEMENTED if the platform does not support it
+    int enable_zerocopy(bool enable = true, int threshold = ZEROCOPY_THRESHOLD);
+    // A buffer of `size` bytes to build a message in, which goes back to the socket once the
+    // kernel has sent it. It waits for one if all are in flight, and it is empty if zero copy is
+    // off, `size` is below the threshold, or the caller holds every buffer. Buffers shall be
+    // dropped before the socket is reconnected
+    PooledBuffer zerocopy_buffer(int size) const;
+
     int send_to(const char* buf, int len, const addrcoll* paddr) const;
     int send_to(const std::string str, const addrcoll* paddr) const;
     int send_to(const char* buf, int len, const ConnectInfo& conn) const;
@@ -192,12 +241,18 @@ class SocketPeer : public BasicSocket {
     SocketPeer(BasicSocket* p_bsocket_from, addrcoll* paddr_peer) noexcept;
     // Use a existing socket (i.e. a returned value of `accept` or `connect` for stream socket)
     SocketPeer(BasicSocket* p_bsocket_from, addrcoll* paddr_peer, SOCKET s) noexcept;
+    // Refer to the address of `info` without copying, it must outlive the peer
+    // Servers pass such peers to handlers, they are valid until the handler returns
+    SocketPeer(BasicSocket* p_bsocket_from, const addrcoll& info, SOCKET s) noexcept;
     // TODO: pointer unsafe? shall we write ~SocketPeer() ?
 
     bool ensure() const override;
 
     int send(const char* buf, int len) const;
     int send(const std::string str) const;
+    // Send a message as it is, and frame the stream for the messages after it (see `framed`),
+    // e.g. the reply to a hello, the peer frames its messages once it has got it
+    int send_framing(const char* buf, int len) const;
 
     int recv(char* buf, int maxlen) const;
     int recv(std::string& str, int maxlen) const;
@@ -207,6 +262,29 @@ class SocketPeer : public BasicSocket {
     int close() const override;
 };
 
+//===--------------------------------------------------===//
+// class FileHandle
+//===--------------------------------------------------===//
+
+// A file opened for reading by the system, for the kernel to send it without copying it to user
+// space (see `SocketClient::send_file`). It is closed on destruction
+class FileHandle {
+   protected:
+    native_file m_file = INVALID_NATIVE_FILE;
+
+   public:
+    FileHandle() = default;
+    FileHandle(const std::string& path) noexcept;
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+    ~FileHandle();
+
+    int open(const std::string& path);
+    bool is_open() const;
+    native_file native() const;
+    int close();
+};
+
 //===--------------------------------------------------===//
 // class SocketClient
 //===--------------------------------------------------===//
@@ -214,6 +292,8 @@ class SocketPeer : public BasicSocket {
 class SocketClient : public BasicSocket {
    protected:
     addrcoll m_saddrcoll;
+    mutable bool m_gso = false;
+    mutable int m_gso_size = 0;  // segment size set on the socket, if it is set per socket
 
    public:
     SocketClient() = default;
@@ -226,6 +306,28 @@ class SocketClient : public BasicSocket {
 
     int send(const char* buf, int len) const;
     int send(const std::string str) const;
+    // Send `n` messages at once, the i-th one starts at `bufs + i * stride` and has `lens[i]`
+    // bytes, or is built in `owned[i]` (see `zerocopy_buffer`) if it is not empty, in which case
+    // the buffer is taken. Returns the number of messages sent, or SOCKET_ERROR if none is sent
+    int send_batch(const char* bufs, int stride, const int* lens, int n,
+                   PooledBuffer* owned = nullptr) const;
+    // Send a message of `head` followed by `len` bytes of the file from `offset`, for stream
+    // sockets only. The kernel reads the file (sendfile, TransmitFile), so that the body is not
+    // copied to user space. Returns the length of the message, METHOD_NOT_IMPLEMENTED if the
+    // platform does not support it, or SOCKET_ERROR
+    int send_file(const char* head, int head_len, const FileHandle& file, uint64_t offset,
+                  int len) const;
+    // Let the kernel split batches into datagrams (UDP segmentation offload) for datagram
+    // sockets, returns METHOD_NOT_IMPLEMENTED if the platform does not support it
+    // It is turned off by itself if the device refuses the segments
+    int enable_gso(bool enable = true);
+    // Set the don't fragment flag of datagrams, so that one larger than the path MTU is dropped
+    // on the way, or refused at once by the kernel if it is larger than the MTU of the interface,
+    // for probing the path MTU. Returns METHOD_NOT_IMPLEMENTED if the platform does not support it
+    int set_dont_fragment(bool enable = true) const;
+    // Frame the messages of the stream sent and received from now on (see `framed`), once the
+    // server has agreed to
+    void set_framed(bool enable = true);
 
     int recv(char* buf, int maxlen) const;
     int recv(std::string& str, int maxlen) const;
@@ -244,21 +346,62 @@ class SocketClient : public BasicSocket {
 #define HANDLE_END -1
 #define HANDLE_ERROR 1
 
+struct DatagramBatch;
+struct RecvRing;
+
 class SocketServer : public BasicSocket {
    protected:
+    struct PeerStream;
+
     std::map<u_long, SocketPeer&> m_clients;  // TODO: unused
     mutable std::list<StreamHandler> m_pStreamHandlers;
     mutable std::list<MessageHandler> m_pMessageHandlers;
+    mutable std::list<MessageHandler> m_pDropHandlers;
     mutable std::list<ServerCloseHandler> m_pCloseHandlers;
     int m_max_clients = SOMAXCONN;
+    int m_batch_size = 16;  // datagrams received per call
+    bool m_gro = false;     // datagrams may be coalesced by the kernel
+    bool m_uring = false;   // datagrams are received through a ring
     mutable bool m_serving = false;
-    mutable std::vector<std::thread> m_threads;
+    mutable std::vector<std::thread> m_threads;  // for stream handlers
+    mutable std::set<std::thread::id> m_finished;
     mutable std::mutex m_mutex;
+    // event loop
+    mutable EventLoop* m_loop = nullptr;
+    std::unique_ptr<EventLoop> m_own_loop;
+    mutable std::map<SOCKET, std::shared_ptr<PeerStream>> m_streams;
+    mutable std::shared_ptr<RecvRing> m_ring;
+    std::shared_ptr<WorkerPool> m_pool;
+    std::shared_ptr<BufferPool> m_buffers;  // datagrams received and queued for the workers
+    // rate limits of receiving
+    std::shared_ptr<TokenBucket> m_total_limit;
+    double m_peer_rate = 0;
+    // the address of a peer, looked up for every datagram without allocating
+    struct PeerKey {
+        sockaddr_storage addr = {};
+        socklen_t len = 0;
+        bool operator<(const PeerKey& other) const;
+    };
+    mutable std::map<PeerKey, std::shared_ptr<TokenBucket>> m_peer_limits;
+    mutable std::mutex m_limit_mutex;
 
    private:
-    int stream_serve_thread(const SocketPeer& peer);
-    int message_thread(char* buf, int len, const SocketPeer& peer);
-    int message_stream_thread(int buf_size, const SocketPeer& peer);
+    std::shared_ptr<TokenBucket> peer_limit(const SocketPeer& peer) const;
+    int stream_serve_thread(SocketPeer peer);
+    int dispatch(Message& msg, const SocketPeer& peer);
+    int submit(Message& msg, const SocketPeer& peer, const std::shared_ptr<PeerStream>& stream);
+    int on_accept(int buf_size);
+    int on_stream(const std::shared_ptr<PeerStream>& stream, int buf_size);
+    int on_datagram(DatagramBatch& batch, int i, int buf_size, int64_t& delay);
+    int64_t limit_delay(const std::shared_ptr<TokenBucket>& limit) const;
+    void pause(SOCKET s, int64_t delay) const;
+    int on_datagrams(DatagramBatch& batch, int buf_size);
+    int on_ring(RecvRing& recv_ring, int buf_size);
+    std::shared_ptr<BufferPool> receive_pool(int buf_size) const;
+    int serve_ring(EventLoop& loop, int buf_size);
+    void close_stream(PeerStream& stream) const;
+    void reap_threads() const;
+    void unserve() const;
 
    public:
     SocketServer() = default;
@@ -278,10 +421,43 @@ class SocketServer : public BasicSocket {
 
     // For datagram socket (by order of registration)
     int onmessage(const MessageHandler& pHandler);
+    // Emit when a datagram is dropped because the queue of workers is full, messages of stream
+    // sockets wait for room instead
+    // The handlers are called on the thread receiving messages, they shall be quick
+    int ondrop(const MessageHandler& pHandler);
 
     // If `buf_size` <= 0, serve only for stream socket
     // else serve for message receiving
+    // It blocks until the server is closed
     int serve(int buf_size = -1);
+    // Serve on an event loop, which can be shared by servers and is run by the caller
+    // Messages are handled on the threads running the loop, while each stream socket served by
+    // handlers registered by `use` has a thread of its own
+    int serve(EventLoop& loop, int buf_size = -1);
+
+    // Run handlers on a pool of workers, which can be shared by servers
+    // Otherwise handlers run on the threads receiving messages (i.e. running the event loop)
+    int use_workers(std::shared_ptr<WorkerPool> pool);
+
+    // Let several sockets bind the same address, the kernel spreads peers among them by hashing
+    // the addresses, so a peer always reaches the same socket. It shall be called before binding
+    // Returns METHOD_NOT_IMPLEMENTED if the platform does not support it
+    int reuse_port(bool enable = true);
+    // Receive datagrams through io_uring, the receives of a batch stay queued in the kernel and
+    // are completed and queued again without a call per datagram. It shall be called before
+    // serving. Returns METHOD_NOT_IMPLEMENTED if the platform does not support it
+    int use_uring(bool enable = true);
+    // Set the maximum number of datagrams received per call, 1 disables batching
+    int set_batch_size(int size);
+    // Accept datagrams coalesced by the kernel (UDP receive offload) and split them back
+    // Returns METHOD_NOT_IMPLEMENTED if the platform does not support it
+    int enable_gro(bool enable = true);
+
+    // Limit the bytes received per second from each peer and in total, 0 for unlimited
+    // The total limiter can be shared among servers. A socket in debt is not received from until
+    // it is repaid, a stream over the limit of its peer as well, while a datagram over the limit
+    // of its peer is dropped, as it is resent. Handlers registered by `use` are not limited
+    int limit_rate(double peer_rate, std::shared_ptr<TokenBucket> total = nullptr);
 
     // Emit when the socket is closed
     // each handler will be called synchronously (by its order of registration)
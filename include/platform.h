@@ -0,0 +1,77 @@
+#ifndef __PLATFORM_H__
+#define __PLATFORM_H__
+
+//===--------------------------------------------------===//
+// Platform
+//===--------------------------------------------------===//
+
+// Sockets are written against Winsock. Elsewhere the names of it used here are mapped onto BSD
+// sockets, which it mostly follows, so that the same code builds on Linux.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2ipdef.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+#ifndef _WIN32
+typedef int SOCKET;
+typedef addrinfo ADDRINFO;
+typedef pollfd WSAPOLLFD;
+typedef unsigned short WORD;
+
+struct WSADATA {};
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+#define WSAEADDRINUSE EADDRINUSE
+
+#define MAKEWORD(low, high) ((WORD)(((low) & 0xff) | (((high) & 0xff) << 8)))
+#define ZeroMemory(p, len) memset((p), 0, (len))
+#define _strdup strdup
+#define GetAddrInfo getaddrinfo
+#define FreeAddrInfo freeaddrinfo
+#define WSAPoll poll
+
+// there is nothing to start up or clean up
+inline int WSAStartup(WORD, WSADATA*) { return 0; }
+inline int WSACleanup() { return 0; }
+inline int WSAGetLastError() { return errno; }
+inline int closesocket(SOCKET s) { return ::close(s); }
+// FIONBIO and FIONREAD take an int, of which Winsock makes an u_long
+inline int ioctlsocket(SOCKET s, long cmd, u_long* arg) {
+    int value = (int)*arg;
+    int err = ::ioctl(s, cmd, &value);
+    *arg = (u_long)value;
+    return err;
+}
+#endif
+
+// Set SO_SNDTIMEO or SO_RCVTIMEO of `s` to `ms` milliseconds, Winsock takes them as a DWORD
+// while BSD sockets take a timeval
+inline int set_socket_timeout(SOCKET s, int opt, int ms) {
+#ifdef _WIN32
+    DWORD value = ms;
+#else
+    timeval value = {ms / 1000, ms % 1000 * 1000};
+#endif
+    return setsockopt(s, SOL_SOCKET, opt, (const char*)&value, sizeof(value));
+}
+
+#endif  // __PLATFORM_H__
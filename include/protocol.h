@@ -0,0 +1,171 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//===--------------------------------------------------===//
+// Text format
+//===--------------------------------------------------===//
+
+// Messages of the first version start with a tag, transfers are named by a UUID string
+//  HS        file size (4), file name, then with CAP_WINDOW 0 (1) and the window (4)
+//  OK        the UUID, then the window (4) if the handshake has told one
+//  TRANSFER  the UUID, chunk (4), then the chunk
+//  RECEIVED  the UUID, the next chunk expected (4), then received chunks after it (see SACK)
+//  DONE      the UUID, the next chunk expected (4)
+#define UUID_LEN 36
+
+#define HEAD_HELLO "\013HELLO"
+#define HEAD_HS "\013HS"
+#define HEAD_TRANSFER "\013TRANSFER"
+#define HEAD_OK "\013OK"
+#define HEAD_RECEIVED "\013RECEIVED"
+#define HEAD_DONE "\013DONE"
+#define HEAD_REJECT "\013REJECT"
+#define HEAD_DROP "\013DROP"
+
+#define headcmp(buf, head) (memcmp(buf, head, strlen(head)) == 0)
+
+//===--------------------------------------------------===//
+// Binary format
+//===--------------------------------------------------===//
+
+// A peer tells the capabilities it supports after HELLO, as a 32-bit mask in network byte order,
+// and the other replies the ones both support. A peer of the text format only sends a bare HELLO,
+// so it gets a bare one and the text format is kept as it is: the handshake does not tell the
+// window, and each message over a stream socket is sent by itself. With CAP_FRAMING, messages over
+// a stream socket after the reply to the hello are prefixed by their length (4), the hello and its
+// reply are not. The server follows the capabilities with the largest message it receives (4), and
+// ignores what comes after those of a hello, which is padded by the client to probe the path MTU.
+#define CAP_BINARY 0x1u    // frames of the binary format
+#define CAP_COMPRESS 0x2u  // chunks may be compressed, see PACKED
+#define CAP_CHECKSUM 0x4u  // chunks carry checksums, see TRANSFER
+#define CAP_FEC 0x8u       // groups of chunks are followed by parities, see PARITY
+#define CAP_FRAMING 0x10u  // messages over stream sockets are framed after the hello
+#define CAP_WINDOW 0x20u   // text handshakes tell the window, see HS of the text format
+#define CAPS_SUPPORTED \
+    (CAP_BINARY | CAP_COMPRESS | CAP_CHECKSUM | CAP_FEC | CAP_FRAMING | CAP_WINDOW)
+
+#define WIRE_VERSION 1
+// The first byte of a frame, the high bit tells it from a text tag
+#define FRAME_MAGIC (0x80 | WIRE_VERSION)
+// version (1), opcode (1), session (8), offset (8), length (4), all in network byte order
+#define FRAME_HEAD_LEN 22
+// a frame fits in a UDP datagram, e.g. the signatures replied
+#define MAX_FRAME_LEN 65507
+
+// Fields of each frame are:
+//  HS        offset: file size; body: window (4), chunk size (4), streams (4), identity (8),
+//            file name, then 0 (1) and the capabilities the transfer uses (4) if it uses any,
+//            with CAP_FEC followed by the chunks (4) and the parities (4) of a group
+//  OK        session: the transfer; body: window (4), streams (4), then the chunks to send as
+//            first (8), last (8) of each range
+//  TRANSFER  offset: of the chunk; body: the chunk
+//            with CAP_CHECKSUM, the body starts with the CRC32C (4) of the chunk, and the one (4)
+//            of its range up to the chunk, the chunks of the range before and itself
+//  RECEIVED  offset: of the next chunk expected; body: received chunks after it (see SACK)
+//  DONE      offset: of the next chunk expected
+//  DROP      offset: of the chunk dropped by the overloaded server, or corrupt, to be resent
+//  REJECT    the request is refused, e.g. unknown session
+//  ABORT     the transfer is given up
+//  SIGNATURES  (request) offset: the first block; body: reply size (4), file name
+//              (reply) offset: the first block; body: identity (8), file size (8), block size (4),
+//              then weak (4), strong (8) of each block, of the file the server has
+//  DELTA     a handshake as HS, a delta of the file against the one the server has is sent instead
+//            offset: delta size; body: window (4), chunk size (4), streams (4), identity of the
+//            server's file (8), file size (8), file name as HS
+//  CHUNKS    (request) offset: the first chunk queried; body: hashes (16 each) of chunks
+//            (reply) offset: the first chunk queried; body: a bit for each, set if the server has
+//            the chunk, from the high bit of the first byte
+//  DEDUP     a handshake as DELTA, a recipe of the file is sent instead, see `make_recipe`
+//            offset: recipe size; body: window (4), chunk size (4), streams (4), 0 (8), file
+//            size (8), file name as HS
+//  PACKED    as TRANSFER, the chunk compressed, see `lz_compress`; a chunk that does not shrink is
+//            sent as TRANSFER
+//            offset: of the chunk; body: chunk size (4), then the chunk compressed, after the
+//            checksums of the chunk as it is
+//  PARITY    parity of a group of chunks, see `fec_coef`, chunks are grouped from the first one
+//            by the number told on handshake, and each range is cut into groups of its own
+//            offset: of the first chunk of the group in the range; body: index of the parity (4),
+//            with CAP_CHECKSUM the CRC32C (4) of the parity, and the one (4) of its range up to
+//            the last chunk of the group, then the parity, as long as the longest chunk of it
+enum struct Opcode : uint8_t {
+    HS = 1,
+    OK,
+    TRANSFER,
+    RECEIVED,
+    DONE,
+    DROP,
+    REJECT,
+    ABORT,
+    SIGNATURES,
+    DELTA,
+    CHUNKS,
+    DEDUP,
+    PACKED,
+    PARITY,
+};
+
+struct FrameHead {
+    Opcode op;
+    uint64_t session;
+    uint64_t offset;
+    uint32_t length;  // of the body following the head
+};
+
+// Returns true if the message is a frame of the binary format
+bool is_frame(const char* buf, int len);
+// Write the head to `out`, which holds at least FRAME_HEAD_LEN bytes, returns FRAME_HEAD_LEN
+int encode_head(char* out, Opcode op, uint64_t session, uint64_t offset, uint32_t length);
+// Returns false if the message is not a frame of this version, or the body is cut off
+bool decode_head(const char* buf, int len, FrameHead& head);
+
+void put_u32(char* out, uint32_t v);
+uint32_t get_u32(const char* buf);
+void put_u64(char* out, uint64_t v);
+uint64_t get_u64(const char* buf);
+
+//===--------------------------------------------------===//
+// Streams
+//===--------------------------------------------------===//
+
+// A transfer of the binary format may be sent by several streams, each on a socket of its own.
+// The chunks are split into as many ranges of consecutive chunks, one for each stream, and every
+// range is acknowledged on its own. The server agrees on the number of streams on handshake.
+#define MAX_STREAMS 16
+// The server lists the ranges to send on handshake, a resumed transfer may have more ranges than
+// streams, then each stream sends every `streams`-th range in turn
+#define MAX_RANGES 64
+
+// Chunks [first, last], numbered from 1
+struct ChunkRange {
+    uint64_t first;
+    uint64_t last;
+};
+
+// The first chunk of the range of stream `i`, of `chunks` chunks numbered from 1 split into
+// `streams` ranges. The range of the last stream ends before `range_first(chunks, streams,
+// streams)`
+uint64_t range_first(uint64_t chunks, unsigned streams, unsigned i);
+
+//===--------------------------------------------------===//
+// Resuming
+//===--------------------------------------------------===//
+
+// A file is identified by its size and its modification time, the client tells the identity on
+// handshake and the server resumes the transfer of a partial file of the same identity. An
+// identity of 0 is never resumed
+uint64_t file_identity(uint64_t size, int64_t mtime);
+
+//===--------------------------------------------------===//
+// Sessions
+//===--------------------------------------------------===//
+
+// A transfer is named by a session id in frames, and by a UUID in text messages. The session is
+// carried by the random tail of the UUID (clock sequence and node), so either finds the transfer.
+// Returns 0 if the UUID is malformed, which is never a session
+uint64_t session_of_uuid(const char* uuid);
+
+#endif  // __PROTOCOL_H__
@@ -0,0 +1,44 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+//===--------------------------------------------------===//
+// class TokenBucket
+//===--------------------------------------------------===//
+
+// Token bucket limiting bytes per second. Tokens may go into debt by one message, so messages
+// larger than the bucket pass as well, and the following ones wait for the debt to be repaid.
+// The bucket holds `burst` seconds of tokens at most, which keeps the limit at sub-second
+// granularity. It is thread-safe.
+class TokenBucket {
+   public:
+    typedef std::chrono::steady_clock clock;
+
+   protected:
+    double m_rate;  // bytes per second, unlimited if not positive
+    double m_capacity;
+    double m_tokens;
+    clock::time_point m_last;
+    mutable std::mutex m_mutex;
+
+    void refill();
+
+   public:
+    TokenBucket(double rate, double burst = 0.05) noexcept;
+
+    // Microseconds to wait before the next message can pass, 0 if it can pass now
+    int64_t delay();
+    void consume(size_t bytes);
+    // Take `bytes` unless the bucket is in debt
+    // Returns false if it is, nothing is taken then
+    bool try_consume(size_t bytes);
+
+    bool limited() const;
+    double rate() const;
+};
+
+#endif  // __RATELIMIT_H__
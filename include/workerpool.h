@@ -0,0 +1,86 @@
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//===--------------------------------------------------===//
+// class WorkerPool
+//===--------------------------------------------------===//
+
+// What to do when a task is submitted to a full queue
+enum struct QueuePolicy {
+    DROP,   // reject the task
+    BLOCK,  // wait until there is room
+};
+
+struct WorkerStats {
+    size_t depth = 0;      // tasks waiting in the queue
+    size_t max_depth = 0;  // since the last reset
+    uint64_t submitted = 0;
+    uint64_t dropped = 0;
+    int64_t avg_wait = 0;  // microseconds from submission to execution
+    int64_t max_wait = 0;
+};
+
+// Fixed number of threads running tasks from a bounded queue
+class WorkerPool {
+   public:
+    typedef std::function<void()> Task;
+    typedef std::chrono::steady_clock clock;
+
+   protected:
+    struct Item {
+        Task task;
+        clock::time_point time;
+    };
+
+    size_t m_capacity;
+    QueuePolicy m_policy;
+    // the queue is a ring of `m_capacity` items allocated up front, so that submitting never
+    // allocates
+    std::vector<Item> m_queue;
+    size_t m_front = 0;
+    size_t m_depth = 0;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_task;   // a task is submitted
+    std::condition_variable m_cv_space;  // a task is taken
+    bool m_running = true;
+    // counters
+    WorkerStats m_stats;
+    uint64_t m_waited = 0;
+    int64_t m_tot_wait = 0;
+
+    void work();
+
+   public:
+    WorkerPool(int workers, size_t capacity, QueuePolicy policy) noexcept;
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    ~WorkerPool();
+
+    // Returns false if the task is rejected, either the queue is full and the policy is DROP, or
+    // the pool is stopped
+    bool submit(Task task);
+    // Submit with a policy other than the pool's
+    bool submit(Task task, QueuePolicy policy);
+    // Tasks in the queue are still run before the workers exit
+    int stop();
+
+    size_t workers() const;
+    size_t capacity() const;
+    QueuePolicy policy() const;
+    // Counters, the maximums and the average wait are reset by `reset` (e.g. for periodic reports)
+    WorkerStats stats(bool reset = false);
+};
+
+const char* queue_policy_name(QueuePolicy policy);
+
+#endif  // __WORKERPOOL_H__
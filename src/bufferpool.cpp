@@ -0,0 +1,100 @@
+#include "bufferpool.h"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#define TAGGED(index, tag) ((uint64_t)(tag) << 32 | (index))
+#define TAG_INDEX(head) ((uint32_t)(head))
+#define TAG_COUNT(head) ((uint32_t)((head) >> 32))
+
+//===--------------------------------------------------===//
+// class PooledBuffer
+//===--------------------------------------------------===//
+
+PooledBuffer::PooledBuffer(BufferPool* pool, uint32_t index) noexcept
+    : m_pool(pool), m_index(index) {}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& r) noexcept : m_pool(r.m_pool), m_index(r.m_index) {
+    r.m_pool = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& r) noexcept {
+    if (this != &r) {
+        reset();
+        m_pool = r.m_pool;
+        m_index = r.m_index;
+        r.m_pool = nullptr;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() { reset(); }
+
+PooledBuffer::operator bool() const { return m_pool != nullptr; }
+
+char* PooledBuffer::data() const {
+    return m_pool != nullptr ? m_pool->m_arena + m_index * m_pool->m_size : nullptr;
+}
+
+size_t PooledBuffer::size() const { return m_pool != nullptr ? m_pool->m_size : 0; }
+
+uint32_t PooledBuffer::release() {
+    m_pool = nullptr;
+    return m_index;
+}
+
+void PooledBuffer::reset() {
+    if (m_pool != nullptr) m_pool->put(m_index);
+    m_pool = nullptr;
+}
+
+//===--------------------------------------------------===//
+// class BufferPool
+//===--------------------------------------------------===//
+
+BufferPool::BufferPool(size_t size, uint32_t count) noexcept
+    : m_size((std::max(size, (size_t)1) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE),
+      m_count(count),
+      m_arena((char*)::operator new[](m_size * count, std::align_val_t(CACHE_LINE))),
+      m_next(new std::atomic<uint32_t>[count]),
+      m_head(TAGGED(count > 0 ? 0 : NONE, 0)) {
+    for (uint32_t i = 0; i < count; ++i) m_next[i] = i + 1 < count ? i + 1 : NONE;
+}
+
+BufferPool::~BufferPool() { ::operator delete[](m_arena, std::align_val_t(CACHE_LINE)); }
+
+PooledBuffer BufferPool::acquire() {
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    while (true) {
+        uint32_t index = TAG_INDEX(head);
+        if (index == NONE) {
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return PooledBuffer();
+        }
+        // the buffer may be taken and returned meanwhile, then the tag tells
+        uint64_t next = TAGGED(m_next[index].load(std::memory_order_relaxed), TAG_COUNT(head) + 1);
+        if (m_head.compare_exchange_weak(head, next, std::memory_order_acquire,
+                                         std::memory_order_acquire))
+            return PooledBuffer(this, index);
+    }
+}
+
+void BufferPool::put(uint32_t index) {
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    while (true) {
+        m_next[index].store(TAG_INDEX(head), std::memory_order_relaxed);
+        uint64_t top = TAGGED(index, TAG_COUNT(head) + 1);
+        if (m_head.compare_exchange_weak(head, top, std::memory_order_release,
+                                         std::memory_order_relaxed))
+            return;
+    }
+}
+
+PooledBuffer BufferPool::adopt(uint32_t index) {
+    return index < m_count ? PooledBuffer(this, index) : PooledBuffer();
+}
+
+size_t BufferPool::size() const { return m_size; }
+uint32_t BufferPool::count() const { return m_count; }
+uint64_t BufferPool::misses() const { return m_misses.load(std::memory_order_relaxed); }
@@ -0,0 +1,191 @@
+#include "checksum.h"
+
+#include <cstring>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define CRC32C_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARMV8
+#endif
+
+// instructions of SSE 4.2 are allowed in a function only, the CPU is checked before it is called
+#if defined(CRC32C_SSE42) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define TARGET_SSE42
+#endif
+
+#define CRC32C_POLY 0x82f63b78u  // reflected
+
+//===--------------------------------------------------===//
+// CRC32C
+//===--------------------------------------------------===//
+
+// Tables of slicing by 8, table[k][b] is the CRC of byte b followed by k zero bytes
+static const uint32_t (*crc_tables())[256] {
+    static uint32_t table[8][256];
+    static std::once_flag once;
+    std::call_once(once, []() {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t crc = b;
+            for (int i = 0; i < 8; ++i) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; ++b) {
+            for (int k = 1; k < 8; ++k)
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    });
+    return table;
+}
+
+static uint32_t crc32c_sw(const uint8_t* p, size_t len, uint32_t crc) {
+    auto table = crc_tables();
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^
+              table[4][lo >> 24] ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; len > 0; ++p, --len) crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+    return crc;
+}
+
+// Multiply two polynomials modulo the CRC polynomial, bit 31 is x^0 as the CRC is reflected
+static uint32_t multiply_mod(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0 && a != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+            a ^= m;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(8n) modulo the CRC polynomial, appending n zero bytes to a block multiplies its CRC by it
+static uint32_t zeros_mod(uint64_t n) {
+    // x^(2^k) of each k
+    static uint32_t powers[64];
+    static std::once_flag once;
+    std::call_once(once, []() {
+        powers[0] = 1u << 30;  // x^1
+        for (int k = 1; k < 64; ++k) powers[k] = multiply_mod(powers[k - 1], powers[k - 1]);
+    });
+    uint32_t product = 1u << 31;  // x^0
+    uint64_t bits = n << 3;
+    for (int k = 0; bits != 0; ++k, bits >>= 1) {
+        if (bits & 1) product = multiply_mod(powers[k], product);
+    }
+    return product;
+}
+
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+// A CRC instruction takes a few cycles before the next one may use its result, so three lanes
+// of a block each are computed at once, and the CRCs of the lanes are combined
+#define CRC32C_LANE 512
+
+// Tables multiplying a CRC by x^(8 * CRC32C_LANE), a byte of it each
+static const uint32_t (*lane_tables())[256] {
+    static uint32_t table[4][256];
+    static std::once_flag once;
+    std::call_once(once, []() {
+        uint32_t shift = zeros_mod(CRC32C_LANE);
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t b = 0; b < 256; ++b) table[k][b] = multiply_mod(shift, b << (8 * k));
+        }
+    });
+    return table;
+}
+
+static inline uint32_t shift_lane(const uint32_t (*table)[256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^
+           table[3][crc >> 24];
+}
+
+#if defined(CRC32C_SSE42)
+TARGET_SSE42 static inline uint32_t crc_u64(uint32_t crc, uint64_t v) {
+    return (uint32_t)_mm_crc32_u64(crc, v);
+}
+TARGET_SSE42 static inline uint32_t crc_u8(uint32_t crc, uint8_t v) {
+    return _mm_crc32_u8(crc, v);
+}
+
+static bool cpu_has_crc32c() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#else
+static inline uint32_t crc_u64(uint32_t crc, uint64_t v) { return __crc32cd(crc, v); }
+static inline uint32_t crc_u8(uint32_t crc, uint8_t v) { return __crc32cb(crc, v); }
+
+static bool cpu_has_crc32c() { return true; }
+#endif
+
+TARGET_SSE42 static uint32_t crc32c_hw(const uint8_t* p, size_t len, uint32_t crc) {
+    auto table = lane_tables();
+    for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE, len -= 3 * CRC32C_LANE) {
+        uint32_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, sizeof(v0));
+            memcpy(&v1, p + CRC32C_LANE + i, sizeof(v1));
+            memcpy(&v2, p + 2 * CRC32C_LANE + i, sizeof(v2));
+            crc = crc_u64(crc, v0);
+            crc1 = crc_u64(crc1, v1);
+            crc2 = crc_u64(crc2, v2);
+        }
+        crc = shift_lane(table, shift_lane(table, crc) ^ crc1) ^ crc2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = crc_u64(crc, v);
+    }
+    for (; len > 0; ++p, --len) crc = crc_u8(crc, *p);
+    return crc;
+}
+#endif
+
+bool crc32c_accelerated() {
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+    static const bool has = cpu_has_crc32c();
+    return has;
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32c(const char* data, size_t len, uint32_t crc) {
+    const uint8_t* p = (const uint8_t*)data;
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+    if (crc32c_accelerated()) return ~crc32c_hw(p, len, ~crc);
+#endif
+    return ~crc32c_sw(p, len, ~crc);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    // blocks combined are mostly chunks of one size
+    thread_local uint64_t last_len = 0;
+    thread_local uint32_t last_shift = 1u << 31;  // x^0
+    if (len2 != last_len) {
+        last_shift = zeros_mod(len2);
+        last_len = len2;
+    }
+    return multiply_mod(last_shift, crc1) ^ crc2;
+}
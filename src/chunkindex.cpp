@@ -0,0 +1,384 @@
+#include "chunkindex.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <system_error>
+
+#include "delta.h"
+#include "protocol.h"
+
+typedef std::lock_guard<std::mutex> LockGuard;
+
+#define CHUNK_INDEX_MAGIC "transf-chunks"
+#define CHUNK_INDEX_VERSION 1
+
+// the top bits of the rolling hash, which depend on the last 64 bytes
+#define CDC_MASK_S 0xfffe000000000000ull  // 15 bits, before the average size
+#define CDC_MASK_L 0xffe0000000000000ull  // 11 bits, after it
+
+static_assert(CDC_MAX_SIZE <= DELTA_MAX_LITERAL, "a chunk is sent as a literal of its own");
+
+//===--------------------------------------------------===//
+// Content-defined chunking
+//===--------------------------------------------------===//
+
+ChunkHash chunk_hash(const char* data, size_t len) {
+    // two seeds of the same hash
+    return {strong_hash(data, len, 0x9e3779b97f4a7c15ull), strong_hash(data, len)};
+}
+
+// A random number for each byte value, the same on every host
+static const uint64_t* gear_table() {
+    static uint64_t table[256];
+    static std::once_flag once;
+    std::call_once(once, []() {
+        // splitmix64
+        uint64_t state = 0x2545f4914f6cdd1dull;
+        for (auto& v : table) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            v = z ^ (z >> 31);
+        }
+    });
+    return table;
+}
+
+// The length of the chunk at the start of `n` bytes, the last chunk if `n` < CDC_MAX_SIZE
+static size_t cdc_cut(const uint8_t* p, size_t n, const uint64_t* gear) {
+    if (n <= CDC_MIN_SIZE) return n;
+    size_t normal = std::min<size_t>(n, CDC_AVG_SIZE);
+    size_t end = std::min<size_t>(n, CDC_MAX_SIZE);
+    uint64_t fp = 0;
+    size_t i = CDC_MIN_SIZE;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + gear[p[i]];
+        if ((fp & CDC_MASK_S) == 0) return i + 1;
+    }
+    for (; i < end; ++i) {
+        fp = (fp << 1) + gear[p[i]];
+        if ((fp & CDC_MASK_L) == 0) return i + 1;
+    }
+    return end;
+}
+
+int cdc_split(FileSource& source, std::vector<ContentChunk>& out) {
+    const uint64_t size = source.size();
+    const uint64_t* gear = gear_table();
+    std::vector<char> buf(1 << 22);
+    uint64_t buf_off = 0;
+    size_t buf_len = 0;
+    for (uint64_t pos = 0; pos < size;) {
+        // a whole chunk is in the buffer, unless the file ends before
+        if (pos + CDC_MAX_SIZE > buf_off + buf_len && buf_off + buf_len < size) {
+            size_t keep = buf_off + buf_len - pos;
+            memmove(buf.data(), buf.data() + (pos - buf_off), keep);
+            buf_off = pos;
+            buf_len = keep;
+            while (buf_len < buf.size() && buf_off + buf_len < size) {
+                int n = source.read(buf.data() + buf_len,
+                                    std::min<size_t>(buf.size() - buf_len, INT_MAX),
+                                    buf_off + buf_len);
+                if (n <= 0) return 1;
+                buf_len += n;
+            }
+        }
+        const char* p = buf.data() + (pos - buf_off);
+        size_t len = cdc_cut((const uint8_t*)p, buf_off + buf_len - pos, gear);
+        out.push_back({pos, (uint32_t)len, chunk_hash(p, len)});
+        pos += len;
+    }
+    return 0;
+}
+
+//===--------------------------------------------------===//
+// Recipes
+//===--------------------------------------------------===//
+
+long long make_recipe(FileSource& source, const std::vector<ContentChunk>& chunks,
+                      const std::vector<bool>& stored, const std::string& out_path) {
+    std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+    if (!out) return -1;
+    std::vector<char> data(CDC_MAX_SIZE);
+    long long size = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        auto& chunk = chunks[i];
+        char head[1 + 2 * sizeof(uint64_t) + sizeof(uint32_t)];
+        if (i < stored.size() && stored[i]) {
+            head[0] = RECIPE_STORED;
+            put_u64(head + 1, chunk.hash.hi);
+            put_u64(head + 9, chunk.hash.lo);
+            put_u32(head + 17, chunk.length);
+            out.write(head, 21);
+            size += 21;
+        } else {
+            if (source.read(data.data(), chunk.length, chunk.offset) != (int)chunk.length)
+                return -1;
+            head[0] = DELTA_LITERAL;
+            put_u32(head + 1, chunk.length);
+            out.write(head, 5);
+            out.write(data.data(), chunk.length);
+            size += 5 + chunk.length;
+        }
+    }
+    out.close();
+    return out ? size : -1;
+}
+
+//===--------------------------------------------------===//
+// class ChunkIndex
+//===--------------------------------------------------===//
+
+// The identity of a file as it is now, 0 if there is none
+static uint64_t current_identity(const std::string& path) {
+    std::error_code ec1, ec2;
+    uint64_t size = std::filesystem::file_size(path, ec1);
+    auto mtime = std::filesystem::last_write_time(path, ec2);
+    return ec1 || ec2 ? 0 : file_identity(size, mtime.time_since_epoch().count());
+}
+
+// The following are called with `m_mutex` locked
+
+uint32_t ChunkIndex::add_file(const std::string& path, uint64_t identity) {
+    // the chunks of the file replaced are found no more
+    auto it = m_file_ids.find(path);
+    if (it != m_file_ids.end()) {
+        m_files[it->second].replaced = true;
+        m_stale += m_files[it->second].lines;
+    }
+    m_files.push_back({path, identity});
+    return m_file_ids[path] = m_files.size() - 1;
+}
+
+// Returns true if the chunk is taken at `location`, a chunk indexed already is kept where it is
+bool ChunkIndex::take_chunk(const ChunkHash& hash, const Location& location) {
+    auto [it, inserted] = m_chunks.try_emplace(hash, location);
+    if (!inserted) {
+        if (!m_files[it->second.file].replaced) return false;
+        it->second = location;
+    }
+    m_files[location.file].lines++;
+    m_lines++;
+    return true;
+}
+
+// Rewrite the index without the files replaced or changed since, each file is checked here only
+int ChunkIndex::compact() {
+    std::vector<uint32_t> ids(m_files.size(), UINT32_MAX);
+    std::vector<File> files;
+    for (uint32_t i = 0; i < m_files.size(); ++i) {
+        File& file = m_files[i];
+        if (file.replaced || current_identity(file.path) != file.identity) continue;
+        ids[i] = files.size();
+        files.push_back({std::move(file.path), file.identity});
+    }
+    std::vector<std::vector<std::pair<ChunkHash, Location>>> chunks(files.size());
+    for (auto it = m_chunks.begin(); it != m_chunks.end();) {
+        uint32_t id = ids[it->second.file];
+        if (id == UINT32_MAX) {
+            it = m_chunks.erase(it);
+            continue;
+        }
+        it->second.file = id;
+        files[id].lines++;
+        chunks[id].emplace_back(it->first, it->second);
+        ++it;
+    }
+    m_files = std::move(files);
+    m_file_ids.clear();
+    for (uint32_t i = 0; i < m_files.size(); ++i) m_file_ids[m_files[i].path] = i;
+    m_lines = m_chunks.size();
+    m_stale = 0;
+
+    // written aside and renamed over the previous one, as a journal is
+    std::string tmp_path = m_index_path + ".tmp";
+    auto dir = std::filesystem::path(m_index_path).parent_path();
+    {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        if (!out) return 1;
+        out << CHUNK_INDEX_MAGIC << ' ' << CHUNK_INDEX_VERSION << '\n';
+        for (uint32_t i = 0; i < m_files.size(); ++i) {
+            out << "file " << m_files[i].identity << ' '
+                << std::filesystem::path(m_files[i].path).lexically_relative(dir).string() << '\n';
+            for (auto& [hash, location] : chunks[i]) {
+                out << "chunk " << hash.hi << ' ' << hash.lo << ' ' << location.offset << ' '
+                    << location.length << '\n';
+            }
+        }
+        out.flush();
+        if (!out) return out.close(), std::filesystem::remove(tmp_path), 1;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, m_index_path, ec);
+    if (ec) return std::filesystem::remove(tmp_path, ec), 1;
+    return 0;
+}
+
+int ChunkIndex::open(const std::string& index_path) {
+    LockGuard lock(m_mutex);
+    m_index_path = index_path;
+    m_chunks.clear();
+    m_files.clear();
+    m_file_ids.clear();
+    m_lines = m_stale = 0;
+    std::ifstream in(index_path);
+    if (!in) return 0;
+    auto dir = std::filesystem::path(index_path).parent_path();
+    std::string line, magic, key, path;
+    int version = 0;
+    if (!std::getline(in, line) || !(std::istringstream(line) >> magic >> version) ||
+        magic != CHUNK_INDEX_MAGIC || version != CHUNK_INDEX_VERSION)
+        return 1;
+    uint32_t file = UINT32_MAX;
+    bool cut = false;
+    while (!cut && std::getline(in, line)) {
+        // a line cut off, e.g. while appended, ends the index, which is rewritten then
+        cut = in.eof();
+        std::istringstream fields(line);
+        fields >> key;
+        if (!cut && key == "file") {
+            // paths are relative to the index, and may have spaces
+            uint64_t identity = 0;
+            fields >> identity;
+            fields.get();
+            std::getline(fields, path);
+            cut = !fields || path.empty();
+            if (!cut) file = add_file((dir / path).string(), identity);
+        } else if (!cut && key == "chunk" && file != UINT32_MAX) {
+            ChunkHash hash;
+            Location location;
+            location.file = file;
+            cut = !(fields >> hash.hi >> hash.lo >> location.offset >> location.length);
+            if (!cut && !take_chunk(hash, location)) m_stale++, m_lines++;
+        } else {
+            cut = true;
+        }
+    }
+    if (cut || m_stale > m_lines / 2) compact();
+    return 0;
+}
+
+size_t ChunkIndex::size() {
+    LockGuard lock(m_mutex);
+    return m_chunks.size();
+}
+
+void ChunkIndex::has(const std::vector<ChunkHash>& hashes, std::vector<bool>& found) {
+    // the files the chunks are in, checked out of the lock
+    std::vector<uint32_t> files(hashes.size(), UINT32_MAX);
+    std::map<uint32_t, std::pair<std::string, uint64_t>> identities;
+    {
+        LockGuard lock(m_mutex);
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            auto it = m_chunks.find(hashes[i]);
+            if (it == m_chunks.end() || m_files[it->second.file].replaced) continue;
+            const File& file = m_files[files[i] = it->second.file];
+            identities.try_emplace(files[i], file.path, file.identity);
+        }
+    }
+    std::map<uint32_t, bool> valid;
+    for (auto& [id, identity] : identities)
+        valid[id] = current_identity(identity.first) == identity.second;
+    found.assign(hashes.size(), false);
+    for (size_t i = 0; i < hashes.size(); ++i) found[i] = files[i] != UINT32_MAX && valid[files[i]];
+}
+
+int ChunkIndex::assemble(const std::string& recipe_path, const std::string& out_path,
+                         uint64_t size, std::vector<ContentChunk>& chunks) {
+    FileSource recipe;
+    OutputFile out;
+    if (recipe.open(recipe_path) != 0 || out.open(out_path, size) != 0) return 1;
+    // the files chunks are read from, most recipes refer to a few, each is checked once
+    std::map<std::string, std::unique_ptr<FileSource>> sources;
+    std::vector<char> buf(CDC_MAX_SIZE);
+    uint64_t in = 0, written = 0;
+    auto take = [&](char* dst, size_t len) {
+        if (recipe.read(dst, len, in) != (int)len) return false;
+        in += len;
+        return true;
+    };
+    // a chunk is read from where the index tells it is, and checked against its hash
+    auto read_stored = [&](const ChunkHash& hash, uint32_t len) {
+        std::string path;
+        uint64_t identity = 0, offset = 0;
+        {
+            LockGuard lock(m_mutex);
+            auto it = m_chunks.find(hash);
+            if (it == m_chunks.end() || it->second.length != len ||
+                m_files[it->second.file].replaced)
+                return false;
+            path = m_files[it->second.file].path;
+            identity = m_files[it->second.file].identity;
+            offset = it->second.offset;
+        }
+        auto& source = sources[path];
+        if (source == nullptr) {
+            if (current_identity(path) != identity) return false;
+            source = std::make_unique<FileSource>();
+            if (source->open(path) != 0) return false;
+        }
+        if (source->read(buf.data(), len, offset) != (int)len) return false;
+        return chunk_hash(buf.data(), len) == hash;
+    };
+
+    bool ok = true;
+    while (ok && in < recipe.size()) {
+        char head[1 + 2 * sizeof(uint64_t) + sizeof(uint32_t)];
+        ChunkHash hash;
+        uint32_t len = 0;
+        if (!take(head, 1)) {
+            ok = false;
+        } else if (head[0] == RECIPE_STORED) {
+            ok = take(head + 1, 20);
+            hash = {get_u64(head + 1), get_u64(head + 9)};
+            len = ok ? get_u32(head + 17) : 0;
+            ok = ok && len <= buf.size() && read_stored(hash, len);
+        } else if (head[0] == DELTA_LITERAL) {
+            ok = take(head + 1, 4);
+            len = ok ? get_u32(head + 1) : 0;
+            ok = ok && len <= buf.size() && take(buf.data(), len);
+            if (ok) hash = chunk_hash(buf.data(), len);
+        } else {
+            ok = false;
+        }
+        if (ok && (len > size - written || out.write(buf.data(), len, written) != 0)) ok = false;
+        if (ok) {
+            chunks.push_back({written, len, hash});
+            written += len;
+        }
+    }
+    // a recipe cut off makes a shorter file
+    ok = ok && written == size;
+    if (out.close() != 0) ok = false;
+    for (auto& [_, source] : sources) source->close();
+    recipe.close();
+    return ok ? 0 : 1;
+}
+
+int ChunkIndex::add(const std::string& path, const std::vector<ContentChunk>& chunks) {
+    LockGuard lock(m_mutex);
+    uint64_t identity = current_identity(path);
+    uint32_t file = add_file(path, identity);
+    auto dir = std::filesystem::path(m_index_path).parent_path();
+    std::ostringstream lines;
+    lines << "file " << identity << ' '
+          << std::filesystem::path(path).lexically_relative(dir).string() << '\n';
+    for (auto& chunk : chunks) {
+        if (!take_chunk(chunk.hash, {file, chunk.length, chunk.offset})) continue;
+        lines << "chunk " << chunk.hash.hi << ' ' << chunk.hash.lo << ' ' << chunk.offset << ' '
+              << chunk.length << '\n';
+    }
+    // the lines replaced are dropped once they are the most of the index
+    std::error_code ec;
+    if (m_stale > m_lines / 2 || !std::filesystem::exists(m_index_path, ec)) return compact();
+    std::ofstream out(m_index_path, std::ios::app);
+    out << lines.str();
+    out.flush();
+    return out ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include "compress.h"
+
+#include <cstring>
+
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+// the last match starts this far from the end at least, and the last bytes are literals
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+//===--------------------------------------------------===//
+// LZ compression
+//===--------------------------------------------------===//
+
+static inline uint32_t read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) { return (v * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+// Write a length beyond the 4 bits of the token, returns false if it does not fit
+static inline bool put_length(char* dst, int& op, int cap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= cap) return false;
+        dst[op++] = (char)255;
+    }
+    if (op >= cap) return false;
+    dst[op++] = (char)len;
+    return true;
+}
+
+// Write a sequence of literals [anchor, anchor + lit_len), then a match of `match_len` at
+// `offset` back unless it is the last sequence
+static bool put_sequence(const char* src, int anchor, int lit_len, int offset, int match_len,
+                         char* dst, int& op, int cap) {
+    if (op >= cap) return false;
+    int token = op++;
+    int ml = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    dst[token] = (char)((lit_len >= 15 ? 15 : lit_len) << 4 | (ml >= 15 ? 15 : ml));
+    if (lit_len >= 15 && !put_length(dst, op, cap, lit_len - 15)) return false;
+    if (lit_len > cap - op) return false;
+    memcpy(dst + op, src + anchor, lit_len);
+    op += lit_len;
+    if (match_len == 0) return true;
+    if (cap - op < 2) return false;
+    dst[op++] = (char)(offset & 0xff);
+    dst[op++] = (char)(offset >> 8);
+    return ml < 15 || put_length(dst, op, cap, ml - 15);
+}
+
+int lz_compress(const char* src, int len, char* dst, int cap) {
+    // positions of the last 4 bytes seen of each hash, off by one so that 0 is none
+    int table[1 << LZ_HASH_BITS] = {};
+    int ip = 0, anchor = 0, op = 0;
+    while (ip < len - LZ_MF_LIMIT) {
+        uint32_t v = read32(src + ip);
+        uint32_t h = hash32(v);
+        int ref = table[h] - 1;
+        table[h] = ip + 1;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != v) {
+            // data without matches is skipped faster the longer it goes
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        int match_len = LZ_MIN_MATCH;
+        int max_len = len - LZ_LAST_LITERALS - ip;
+        while (match_len < max_len && src[ref + match_len] == src[ip + match_len]) ++match_len;
+        if (!put_sequence(src, anchor, ip - anchor, ip - ref, match_len, dst, op, cap)) return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+    if (!put_sequence(src, anchor, len - anchor, 0, 0, dst, op, cap)) return 0;
+    return op;
+}
+
+int lz_decompress(const char* src, int len, char* dst, int raw_len) {
+    int ip = 0, op = 0;
+    // a length beyond the 4 bits of the token, -1 if the data ends
+    auto get_length = [&](int base) -> int {
+        int n = base;
+        while (true) {
+            if (ip >= len || n > raw_len) return -1;
+            uint8_t b = src[ip++];
+            n += b;
+            if (b != 255) return n;
+        }
+    };
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        int lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = get_length(15)) < 0) return -1;
+        if (lit_len > len - ip || lit_len > raw_len - op) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        // the last sequence
+        if (ip == len) break;
+        if (len - ip < 2) return -1;
+        int offset = (uint8_t)src[ip] | (uint8_t)src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        int match_len = token & 15;
+        if (match_len == 15 && (match_len = get_length(15)) < 0) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > raw_len - op) return -1;
+        // the copy may overlap what it writes, e.g. a run of a byte
+        for (int i = 0; i < match_len; ++i, ++op) dst[op] = dst[op - offset];
+    }
+    return op == raw_len ? op : -1;
+}
@@ -0,0 +1,122 @@
+#include "congestion.h"
+
+#include <algorithm>
+
+// A datagram may leave earlier than its paced time by this (us), since timers of the system
+// can be coarse, e.g. 1 ~ 15 ms on Windows
+#define PACING_BURST 2000
+// Pace slightly faster than `cwnd / srtt`, so that the window is the actual limit
+#define PACING_GAIN 1.25
+// Expected chunks queued in the network for delay-based mode (Vegas alpha and beta)
+#define DELAY_ALPHA 2
+#define DELAY_BETA 4
+
+//===--------------------------------------------------===//
+// class RttEstimator
+//===--------------------------------------------------===//
+
+RttEstimator::RttEstimator(int64_t init_rto, int64_t min_rto, int64_t max_rto) noexcept
+    : m_rto(init_rto), m_min_rto(min_rto), m_max_rto(max_rto) {}
+
+void RttEstimator::sample(int64_t rtt) {
+    if (rtt <= 0) rtt = 1;
+    if (m_srtt == 0) {
+        m_srtt = rtt;
+        m_rttvar = rtt / 2;
+        m_min_rtt = rtt;
+    } else {
+        m_rttvar = (3 * m_rttvar + std::abs(m_srtt - rtt)) / 4;
+        m_srtt = (7 * m_srtt + rtt) / 8;
+        m_min_rtt = std::min(m_min_rtt, rtt);
+    }
+    m_rto = std::clamp(m_srtt + 4 * m_rttvar, m_min_rto, m_max_rto);
+}
+
+void RttEstimator::backoff() { m_rto = std::min(m_rto * 2, m_max_rto); }
+
+bool RttEstimator::has_sample() const { return m_srtt != 0; }
+int64_t RttEstimator::srtt() const { return m_srtt; }
+int64_t RttEstimator::rttvar() const { return m_rttvar; }
+int64_t RttEstimator::min_rtt() const { return m_min_rtt; }
+int64_t RttEstimator::rto() const { return m_rto; }
+
+//===--------------------------------------------------===//
+// class CongestionControl
+//===--------------------------------------------------===//
+
+CongestionControl::CongestionControl(CongestionMode mode, unsigned max_window,
+                                     int64_t max_rto) noexcept
+    : m_mode(mode),
+      m_ssthresh(max_window),
+      m_max_cwnd(max_window),
+      m_rtt(1000000, 100000, max_rto),
+      m_next_send(clock::now()) {
+    m_cwnd = std::min(m_cwnd, m_max_cwnd);
+}
+
+void CongestionControl::on_ack(unsigned acked, int64_t rtt) {
+    if (rtt >= 0) m_rtt.sample(rtt);
+    if (m_mode == CongestionMode::DELAY && m_rtt.has_sample()) {
+        // chunks queued in the network, i.e. the expected rate minus the actual rate
+        double queued = m_cwnd * (1 - (double)m_rtt.min_rtt() / m_rtt.srtt());
+        if (m_cwnd < m_ssthresh && queued < 1) {
+            m_cwnd += acked;
+        } else if (queued < DELAY_ALPHA) {
+            m_cwnd += acked / m_cwnd;
+        } else if (queued > DELAY_BETA) {
+            m_cwnd -= acked / m_cwnd;
+            m_ssthresh = std::min(m_ssthresh, m_cwnd);
+        }
+    } else {
+        // slow start, then one more chunk per round trip
+        m_cwnd += m_cwnd < m_ssthresh ? acked : acked / m_cwnd;
+    }
+    m_cwnd = std::clamp(m_cwnd, 1.0, m_max_cwnd);
+}
+
+void CongestionControl::on_loss(uint64_t seq, uint64_t cur_seq) {
+    // reduce once per window, the other losses of the window are caused by the same congestion
+    if (seq <= m_recovery_seq) return;
+    m_recovery_seq = cur_seq;
+    m_ssthresh = std::max(m_cwnd / 2, 2.0);
+    m_cwnd = std::min(m_ssthresh, m_max_cwnd);
+}
+
+void CongestionControl::on_timeout(uint64_t cur_seq) {
+    m_recovery_seq = cur_seq;
+    m_ssthresh = std::max(m_cwnd / 2, 2.0);
+    m_cwnd = 1;
+    m_rtt.backoff();
+}
+
+void CongestionControl::on_sent() {
+    if (!m_rtt.has_sample()) return;
+    auto earliest = clock::now() - std::chrono::microseconds(PACING_BURST);
+    if (m_next_send < earliest) m_next_send = earliest;
+    m_next_send += std::chrono::microseconds(pacing_interval());
+}
+
+unsigned CongestionControl::window() const { return (unsigned)m_cwnd; }
+
+int64_t CongestionControl::pacing_delay() const {
+    if (!m_rtt.has_sample()) return 0;
+    auto delay = std::chrono::duration_cast<std::chrono::microseconds>(m_next_send - clock::now());
+    return std::max<int64_t>(delay.count(), 0);
+}
+
+int64_t CongestionControl::pacing_interval() const {
+    if (!m_rtt.has_sample()) return 0;
+    return (int64_t)(m_rtt.srtt() / (m_cwnd * PACING_GAIN));
+}
+
+double CongestionControl::rate(int chunk_size) const {
+    if (!m_rtt.has_sample()) return 0;
+    return m_cwnd * chunk_size * 1000000 / m_rtt.srtt();
+}
+
+CongestionMode CongestionControl::mode() const { return m_mode; }
+const RttEstimator& CongestionControl::rtt() const { return m_rtt; }
+
+const char* congestion_mode_name(CongestionMode mode) {
+    return mode == CongestionMode::AIMD ? "AIMD" : mode == CongestionMode::DELAY ? "Delay" : "";
+}
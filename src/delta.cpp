@@ -0,0 +1,278 @@
+#include "delta.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include "protocol.h"
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE (128 * 1024)
+
+//===--------------------------------------------------===//
+// Signatures
+//===--------------------------------------------------===//
+
+uint32_t delta_block_size(uint64_t size) {
+    uint64_t block = MIN_BLOCK_SIZE;
+    while (block * block < size && block < MAX_BLOCK_SIZE) block <<= 1;
+    return (uint32_t)block;
+}
+
+uint32_t weak_checksum(const char* data, size_t len) {
+    // a: the sum of the bytes, b: the sum of the prefix sums, both modulo 2^16
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a += (uint8_t)data[i];
+        b += (uint32_t)(len - i) * (uint8_t)data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+uint64_t strong_hash(const char* data, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    // words are read little-endian, so that every host signs alike
+    auto word = [data](size_t i, size_t n) {
+        uint64_t k = 0;
+        for (size_t j = 0; j < n; ++j) k |= (uint64_t)(uint8_t)data[i + j] << (8 * j);
+        return k;
+    };
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t k = word(i, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (i < len) {
+        h ^= word(i, len - i);
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+int sign_blocks(FileSource& source, uint32_t block_size, uint64_t first, size_t count,
+                std::vector<BlockSignature>& out) {
+    std::vector<char> buf(block_size);
+    for (uint64_t block = first; block < first + count; ++block) {
+        if (block * block_size >= source.size()) break;
+        int len = source.read(buf.data(), block_size, block * block_size);
+        if (len <= 0) return 1;
+        out.push_back({weak_checksum(buf.data(), len), strong_hash(buf.data(), len)});
+    }
+    return 0;
+}
+
+//===--------------------------------------------------===//
+// Delta
+//===--------------------------------------------------===//
+
+// Instructions are written as they are found, consecutive blocks are copied at once and data is
+// gathered up to DELTA_MAX_LITERAL bytes
+struct DeltaWriter {
+    std::ofstream out;
+    uint64_t copy_first = 0;
+    uint32_t copy_count = 0;
+    std::string literal;
+    long long size = 0;
+
+    void flush_copy() {
+        if (copy_count == 0) return;
+        char head[13];
+        head[0] = DELTA_COPY;
+        put_u64(head + 1, copy_first);
+        put_u32(head + 9, copy_count);
+        out.write(head, sizeof(head));
+        size += sizeof(head);
+        copy_count = 0;
+    }
+    void flush_literal() {
+        if (literal.empty()) return;
+        char head[5];
+        head[0] = DELTA_LITERAL;
+        put_u32(head + 1, literal.size());
+        out.write(head, sizeof(head));
+        out.write(literal.data(), literal.size());
+        size += sizeof(head) + literal.size();
+        literal.clear();
+    }
+    void copy(uint64_t block) {
+        flush_literal();
+        if (copy_count > 0 && copy_first + copy_count == block && copy_count < UINT32_MAX) {
+            ++copy_count;
+            return;
+        }
+        flush_copy();
+        copy_first = block;
+        copy_count = 1;
+    }
+    void data(const char* p, size_t len) {
+        flush_copy();
+        while (len > 0) {
+            size_t n = std::min(len, DELTA_MAX_LITERAL - literal.size());
+            literal.append(p, n);
+            p += n;
+            len -= n;
+            if (literal.size() == DELTA_MAX_LITERAL) flush_literal();
+        }
+    }
+    long long close() {
+        flush_copy();
+        flush_literal();
+        out.close();
+        return out ? size : -1;
+    }
+};
+
+long long make_delta(FileSource& source, const Signatures& signatures,
+                     const std::string& out_path) {
+    const uint64_t size = source.size();
+    const uint64_t B = signatures.block_size;
+    if (B == 0) return -1;
+    // full blocks by weak checksum, a short last block only matches the end of the file
+    std::unordered_map<uint32_t, std::vector<uint64_t>> index;
+    uint64_t full_blocks = std::min<uint64_t>(signatures.size / B, signatures.blocks.size());
+    for (uint64_t i = 0; i < full_blocks; ++i) index[signatures.blocks[i].weak].push_back(i);
+
+    DeltaWriter out;
+    out.out.open(out_path, std::ios::binary | std::ios::trunc);
+    if (!out.out) return -1;
+
+    // a window of the file, which moves on with the lookup
+    std::vector<char> win(std::max<size_t>(4 * B, 1 << 22));
+    uint64_t win_off = 0;
+    size_t win_len = 0;
+    // make [pos, end) available, returns where `pos` is, or nullptr if the read has failed
+    auto fill = [&](uint64_t pos, uint64_t end) -> const char* {
+        if (end > win_off + win_len) {
+            size_t keep = pos < win_off + win_len ? win_off + win_len - pos : 0;
+            if (keep > 0) memmove(win.data(), win.data() + (pos - win_off), keep);
+            win_off = pos;
+            win_len = keep;
+            while (win_len < win.size() && win_off + win_len < size) {
+                int n = source.read(win.data() + win_len,
+                                    std::min<size_t>(win.size() - win_len, INT_MAX),
+                                    win_off + win_len);
+                if (n <= 0) return nullptr;
+                win_len += n;
+            }
+            if (end > win_off + win_len) return nullptr;
+        }
+        return win.data() + (pos - win_off);
+    };
+
+    // the checksum of the window is rolled byte by byte, and computed again after a match
+    uint64_t pos = 0;
+    uint32_t a = 0, b = 0;
+    bool summed = false;
+    while (pos + B <= size) {
+        const char* p = fill(pos, std::min(pos + B + 1, size));
+        if (p == nullptr) return -1;
+        if (!summed) {
+            a = b = 0;
+            for (uint64_t i = 0; i < B; ++i) {
+                a += (uint8_t)p[i];
+                b += (uint32_t)(B - i) * (uint8_t)p[i];
+            }
+            summed = true;
+        }
+        if (auto it = index.find((a & 0xffff) | (b << 16)); it != index.end()) {
+            uint64_t strong = strong_hash(p, B);
+            auto match = std::find_if(it->second.begin(), it->second.end(), [&](uint64_t block) {
+                return signatures.blocks[block].strong == strong;
+            });
+            if (match != it->second.end()) {
+                out.copy(*match);
+                pos += B;
+                summed = false;
+                continue;
+            }
+        }
+        // no block starts here, the byte is sent as data
+        out.data(p, 1);
+        if (pos + B < size) {
+            uint8_t gone = p[0], come = p[B];
+            a = a - gone + come;
+            b = b - (uint32_t)B * gone + a;
+        } else {
+            summed = false;
+        }
+        ++pos;
+    }
+    // the end of the file, shorter than a block, may be the short last block of the old file
+    if (pos < size) {
+        const char* p = fill(pos, size);
+        if (p == nullptr) return -1;
+        uint64_t tail = size - pos;
+        uint64_t last = signatures.blocks.size() - 1;
+        if (!signatures.blocks.empty() && last == full_blocks && signatures.size % B == tail &&
+            signatures.blocks[last].weak == weak_checksum(p, tail) &&
+            signatures.blocks[last].strong == strong_hash(p, tail)) {
+            out.copy(last);
+        } else {
+            out.data(p, tail);
+        }
+    }
+    return out.close();
+}
+
+int apply_delta(const std::string& delta_path, const std::string& old_path, uint32_t block_size,
+                const std::string& out_path, uint64_t size) {
+    FileSource delta, old;
+    OutputFile out;
+    if (block_size == 0 || delta.open(delta_path) != 0 || old.open(old_path) != 0 ||
+        out.open(out_path, size) != 0)
+        return 1;
+    const uint64_t old_blocks = (old.size() + block_size - 1) / block_size;
+
+    std::vector<char> buf(std::max<size_t>(block_size, DELTA_MAX_LITERAL));
+    uint64_t in = 0, written = 0;
+    auto take = [&](char* dst, size_t len) {
+        if (delta.read(dst, len, in) != (int)len) return false;
+        in += len;
+        return true;
+    };
+    auto put = [&](const char* data, size_t len) {
+        if (len > size - written || out.write(data, len, written) != 0) return false;
+        written += len;
+        return true;
+    };
+
+    bool ok = true;
+    while (ok && in < delta.size()) {
+        char head[13];
+        if (!take(head, 1)) {
+            ok = false;
+        } else if (head[0] == DELTA_COPY) {
+            ok = take(head + 1, 12);
+            uint64_t first = ok ? get_u64(head + 1) : 0;
+            uint32_t count = ok ? get_u32(head + 9) : 0;
+            if (first >= old_blocks || count > old_blocks - first) ok = false;
+            for (uint64_t block = first; ok && block < first + count; ++block) {
+                int n = old.read(buf.data(), block_size, block * block_size);
+                ok = n > 0 && put(buf.data(), n);
+            }
+        } else if (head[0] == DELTA_LITERAL) {
+            ok = take(head + 1, 4);
+            uint32_t len = ok ? get_u32(head + 1) : 0;
+            ok = ok && len <= buf.size() && take(buf.data(), len) && put(buf.data(), len);
+        } else {
+            ok = false;
+        }
+    }
+    // a delta cut off makes a shorter file
+    ok = ok && written == size;
+    if (out.close() != 0) ok = false;
+    delta.close();
+    old.close();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+#include "eventloop.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#define MAX_EVENTS 64
+
+typedef std::unique_lock<std::mutex> UniqueLock;
+
+//===--------------------------------------------------===//
+// class EventLoop
+//===--------------------------------------------------===//
+
+EventLoop::EventLoop() noexcept {
+#ifdef __linux__
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    init_wake();
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    if (m_wake != INVALID_SOCKET) closesocket(m_wake);
+#ifdef __linux__
+    if (m_epfd >= 0) ::close(m_epfd);
+#endif
+}
+
+int EventLoop::init_wake() {
+    m_wake = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_wake == INVALID_SOCKET) return SOCKET_ERROR;
+    ZeroMemory(&m_wake_addr, sizeof(m_wake_addr));
+    m_wake_addr.sin_family = AF_INET;
+    m_wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    m_wake_addr.sin_port = 0;
+    socklen_t addrlen = sizeof(m_wake_addr);
+    if (::bind(m_wake, (sockaddr*)&m_wake_addr, sizeof(m_wake_addr)) != 0 ||
+        getsockname(m_wake, (sockaddr*)&m_wake_addr, &addrlen) != 0) {
+        closesocket(m_wake);
+        m_wake = INVALID_SOCKET;
+        return SOCKET_ERROR;
+    }
+#ifdef __linux__
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wake;
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wake, &ev);
+#endif
+    return 0;
+}
+
+void EventLoop::wake() {
+    if (m_wake == INVALID_SOCKET) return;
+    char c = 0;
+    ::sendto(m_wake, &c, 1, 0, (sockaddr*)&m_wake_addr, sizeof(m_wake_addr));
+}
+
+bool EventLoop::valid() const {
+#ifdef __linux__
+    if (m_epfd < 0) return false;
+#endif
+    return m_wake != INVALID_SOCKET;
+}
+
+int EventLoop::add(SOCKET s, const ReadyHandler& handler) {
+    if (!valid() || s == INVALID_SOCKET) return SOCKET_ERROR;
+    UniqueLock lock(m_mutex);
+    if (m_watches.count(s)) return SOCKET_ERROR;
+    auto watch = std::make_shared<Watch>();
+    watch->handler = handler;
+    m_watches[s] = watch;
+#ifdef __linux__
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = s;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, s, &ev) != 0) {
+        m_watches.erase(s);
+        return SOCKET_ERROR;
+    }
+#else
+    if (m_polling) wake();
+#endif
+    return 0;
+}
+
+int EventLoop::remove(SOCKET s) {
+    UniqueLock lock(m_mutex);
+    auto it = m_watches.find(s);
+    if (it == m_watches.end()) return SOCKET_ERROR;
+    unwatch(s, it->second);
+    return 0;
+}
+
+size_t EventLoop::size() {
+    UniqueLock lock(m_mutex);
+    return m_watches.size();
+}
+
+int EventLoop::pause(SOCKET s, int64_t delay) {
+    UniqueLock lock(m_mutex);
+    auto it = m_watches.find(s);
+    if (it == m_watches.end() || !it->second->busy) return SOCKET_ERROR;
+    it->second->pause = std::max(it->second->pause, delay);
+    return 0;
+}
+
+// The followings are called with `m_mutex` locked
+
+void EventLoop::unwatch(SOCKET s, const WatchPtr& watch) {
+    if (watch->removed) return;
+    watch->removed = true;
+    auto it = m_watches.find(s);
+    if (it != m_watches.end() && it->second == watch) m_watches.erase(it);
+#ifdef __linux__
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, s, nullptr);
+#else
+    if (m_polling) wake();
+#endif
+}
+
+void EventLoop::rearm(SOCKET s, const WatchPtr& watch) {
+    watch->busy = false;
+    if (watch->removed) return;
+#ifdef __linux__
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = s;
+    epoll_ctl(m_epfd, EPOLL_CTL_MOD, s, &ev);
+#else
+    if (m_polling) wake();
+#endif
+}
+
+// rearmed once paused for long enough
+void EventLoop::hold(SOCKET s, const WatchPtr& watch) {
+    auto it = m_paused.emplace(clock::now() + std::chrono::microseconds(watch->pause),
+                               std::make_pair(s, watch));
+    watch->pause = 0;
+    // the waiting thread waits for the earliest of them
+    if (m_polling && it == m_paused.begin()) wake();
+}
+
+// Wait for events, `lock` is released while waiting
+void EventLoop::poll(UniqueLock& lock) {
+    std::vector<SOCKET>& ready = m_polled;
+    ready.clear();
+    bool woken = false;
+    // milliseconds until the earliest socket paused is due, rounded up
+    int timeout = -1;
+    if (!m_paused.empty()) {
+        auto wait = m_paused.begin()->first - clock::now();
+        timeout = std::max<int64_t>(std::chrono::ceil<std::chrono::milliseconds>(wait).count(), 0);
+    }
+#ifdef __linux__
+    lock.unlock();
+    epoll_event evs[MAX_EVENTS];
+    int n = epoll_wait(m_epfd, evs, MAX_EVENTS, timeout);
+    for (int i = 0; i < n; ++i) {
+        if (evs[i].data.fd == m_wake) woken = true;
+        else ready.push_back(evs[i].data.fd);
+    }
+#else
+    std::vector<WSAPOLLFD>& fds = m_pollfds;
+    fds.clear();
+    fds.push_back({m_wake, POLLRDNORM, 0});
+    for (auto& [s, watch] : m_watches) {
+        if (!watch->busy) fds.push_back({s, POLLRDNORM, 0});
+    }
+    lock.unlock();
+    int n = WSAPoll(fds.data(), fds.size(), timeout);
+    for (size_t i = 0; n > 0 && i < fds.size(); ++i) {
+        if (fds[i].revents == 0) continue;
+        if (fds[i].fd == m_wake) woken = true;
+        else ready.push_back(fds[i].fd);
+    }
+#endif
+    if (woken) {
+        char buf[64];
+        u_long pending = 0;
+        do {
+            ::recv(m_wake, buf, sizeof(buf), 0);
+        } while (ioctlsocket(m_wake, FIONREAD, &pending) == 0 && pending > 0);
+    }
+    lock.lock();
+    auto now = clock::now();
+    while (!m_paused.empty() && m_paused.begin()->first <= now) {
+        auto [s, watch] = std::move(m_paused.begin()->second);
+        m_paused.erase(m_paused.begin());
+        rearm(s, watch);
+    }
+    if (m_ready_pos == m_ready.size()) m_ready.clear(), m_ready_pos = 0;
+    for (SOCKET s : ready) {
+        auto it = m_watches.find(s);
+        if (it == m_watches.end() || it->second->busy) continue;
+        it->second->busy = true;
+        m_ready.emplace_back(s, it->second);
+    }
+}
+
+int EventLoop::run() {
+    if (!valid()) return SOCKET_ERROR;
+    UniqueLock lock(m_mutex);
+    while (m_running) {
+        if (m_ready_pos < m_ready.size()) {
+            auto [s, watch] = std::move(m_ready[m_ready_pos++]);
+            if (watch->removed) continue;
+            lock.unlock();
+            int err = watch->handler(s);
+            lock.lock();
+            if (err != WATCH_NEXT) unwatch(s, watch);
+            else if (watch->pause > 0) hold(s, watch);
+            else rearm(s, watch);
+            continue;
+        }
+        if (m_polling) {
+            m_cv.wait(lock);
+            continue;
+        }
+        m_polling = true;
+        poll(lock);
+        m_polling = false;
+        m_cv.notify_all();
+    }
+    return 0;
+}
+
+int EventLoop::stop() {
+    UniqueLock lock(m_mutex);
+    if (!m_running) return 0;
+    m_running = false;
+    wake();
+    m_cv.notify_all();
+    return 0;
+}
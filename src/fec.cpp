@@ -0,0 +1,227 @@
+#include "fec.h"
+
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define FEC_SSSE3
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define FEC_NEON
+#endif
+
+// instructions of SSSE3 are allowed in a function only, the CPU is checked before it is called
+#if defined(FEC_SSSE3) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define TARGET_SSSE3
+#endif
+
+#define GF_POLY 0x11d  // x^8 + x^4 + x^3 + x^2 + 1
+
+//===--------------------------------------------------===//
+// GF(2^8)
+//===--------------------------------------------------===//
+
+struct GfTables {
+    uint8_t exp[512];  // doubled, so that a sum of two logs needs no modulo
+    uint8_t log[256];
+};
+
+static const GfTables& gf_tables() {
+    static GfTables t;
+    static std::once_flag once;
+    std::call_once(once, []() {
+        int x = 1;
+        for (int i = 0; i < 255; ++i) {
+            t.exp[i] = t.exp[i + 255] = (uint8_t)x;
+            t.log[x] = (uint8_t)i;
+            x <<= 1;
+            if (x & 0x100) x ^= GF_POLY;
+        }
+        t.exp[510] = t.exp[511] = 0;
+    });
+    return t;
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    auto& t = gf_tables();
+    return t.exp[t.log[a] + t.log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+    auto& t = gf_tables();
+    return t.exp[255 - t.log[a]];
+}
+
+uint8_t fec_coef(int k, int j, int i) {
+    // 1 / (x_j + y_i) of x_j = k + j and y_i = i, all of them distinct, so every square part of
+    // the matrix is invertible; the columns are scaled by x_0 + y_i, making the first row ones
+    return gf_mul((uint8_t)(k ^ i), gf_inv((uint8_t)((k + j) ^ i)));
+}
+
+//===--------------------------------------------------===//
+// Multiply and add
+//===--------------------------------------------------===//
+
+// A product by `c` is looked up by the low and the high 4 bits of a byte, each in a table of 16,
+// which is a byte shuffle of a SIMD register
+static void nibble_tables(uint8_t c, uint8_t* lo, uint8_t* hi) {
+    for (int x = 0; x < 16; ++x) {
+        lo[x] = gf_mul(c, (uint8_t)x);
+        hi[x] = gf_mul(c, (uint8_t)(x << 4));
+    }
+}
+
+static void xor_sw(uint8_t* dst, const uint8_t* src, size_t len) {
+    for (; len >= 8; dst += 8, src += 8, len -= 8) {
+        uint64_t a, b;
+        memcpy(&a, dst, sizeof(a));
+        memcpy(&b, src, sizeof(b));
+        a ^= b;
+        memcpy(dst, &a, sizeof(a));
+    }
+    for (; len > 0; ++dst, ++src, --len) *dst ^= *src;
+}
+
+static void mul_add_sw(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* lo,
+                       const uint8_t* hi) {
+    for (size_t i = 0; i < len; ++i) dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+}
+
+#if defined(FEC_SSSE3)
+static void xor_simd(uint8_t* dst, const uint8_t* src, size_t len) {
+    for (; len >= 16; dst += 16, src += 16, len -= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)dst);
+        __m128i b = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, _mm_xor_si128(a, b));
+    }
+    xor_sw(dst, src, len);
+}
+
+TARGET_SSSE3 static void mul_add_simd(uint8_t* dst, const uint8_t* src, size_t len,
+                                      const uint8_t* lo, const uint8_t* hi) {
+    const __m128i table_lo = _mm_loadu_si128((const __m128i*)lo);
+    const __m128i table_hi = _mm_loadu_si128((const __m128i*)hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for (size_t i = 0; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i p_lo = _mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask));
+        __m128i p_hi = _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(p_lo, p_hi)));
+    }
+    size_t done = len & ~(size_t)15;
+    mul_add_sw(dst + done, src + done, len - done, lo, hi);
+}
+
+static bool cpu_has_simd() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#elif defined(FEC_NEON)
+static void xor_simd(uint8_t* dst, const uint8_t* src, size_t len) {
+    for (; len >= 16; dst += 16, src += 16, len -= 16)
+        vst1q_u8(dst, veorq_u8(vld1q_u8(dst), vld1q_u8(src)));
+    xor_sw(dst, src, len);
+}
+
+static void mul_add_simd(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* lo,
+                         const uint8_t* hi) {
+    const uint8x16_t table_lo = vld1q_u8(lo), table_hi = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    for (size_t i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(table_lo, vandq_u8(s, mask)),
+                                vqtbl1q_u8(table_hi, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+    size_t done = len & ~(size_t)15;
+    mul_add_sw(dst + done, src + done, len - done, lo, hi);
+}
+
+static bool cpu_has_simd() { return true; }
+#endif
+
+bool fec_accelerated() {
+#if defined(FEC_SSSE3) || defined(FEC_NEON)
+    static const bool has = cpu_has_simd();
+    return has;
+#else
+    return false;
+#endif
+}
+
+void fec_mul_add(char* dst, const char* src, size_t len, uint8_t c) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    if (c == 0) return;
+    if (c == 1) {
+#if defined(FEC_SSSE3) || defined(FEC_NEON)
+        // SSE2 is there on every x86-64, and so is NEON on ARMv8
+        return xor_simd(d, s, len);
+#else
+        return xor_sw(d, s, len);
+#endif
+    }
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+#if defined(FEC_SSSE3) || defined(FEC_NEON)
+    if (fec_accelerated()) return mul_add_simd(d, s, len, lo, hi);
+#endif
+    mul_add_sw(d, s, len, lo, hi);
+}
+
+//===--------------------------------------------------===//
+// Rebuilding
+//===--------------------------------------------------===//
+
+void fec_rebuild(int k, const int* lost, const int* rows, int n, const char* const* parities,
+                 char* const* out, size_t len) {
+    // the parities are the lost chunks multiplied by the coefficients of their columns, which are
+    // inverted by Gauss-Jordan elimination
+    uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY], inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    for (int r = 0; r < n; ++r) {
+        for (int c = 0; c < n; ++c) {
+            m[r][c] = fec_coef(k, rows[r], lost[c]);
+            inv[r][c] = r == c;
+        }
+    }
+    for (int c = 0; c < n; ++c) {
+        // a pivot is always found, as the matrix is invertible
+        int p = c;
+        while (m[p][c] == 0) ++p;
+        if (p != c) {
+            std::swap(m[p], m[c]);
+            std::swap(inv[p], inv[c]);
+        }
+        uint8_t scale = gf_inv(m[c][c]);
+        for (int i = 0; i < n; ++i) {
+            m[c][i] = gf_mul(m[c][i], scale);
+            inv[c][i] = gf_mul(inv[c][i], scale);
+        }
+        for (int r = 0; r < n; ++r) {
+            uint8_t f = m[r][c];
+            if (r == c || f == 0) continue;
+            for (int i = 0; i < n; ++i) {
+                m[r][i] ^= gf_mul(f, m[c][i]);
+                inv[r][i] ^= gf_mul(f, inv[c][i]);
+            }
+        }
+    }
+    for (int c = 0; c < n; ++c) {
+        memset(out[c], 0, len);
+        for (int r = 0; r < n; ++r) fec_mul_add(out[c], parities[r], len, inv[c][r]);
+    }
+}
@@ -0,0 +1,357 @@
+#include "fileio.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+typedef std::unique_lock<std::mutex> UniqueLock;
+
+//===--------------------------------------------------===//
+// class OutputFile
+//===--------------------------------------------------===//
+
+OutputFile::~OutputFile() { close(); }
+
+int OutputFile::open(const std::string& path, uint64_t size, bool keep) {
+    close();
+    m_size = size;
+    m_failed = false;
+#if defined(_WIN32)
+    m_file = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                        keep ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (!is_open()) return 1;
+    LARGE_INTEGER end;
+    end.QuadPart = size;
+    if (!SetFilePointerEx(m_file, end, NULL, FILE_BEGIN) || !SetEndOfFile(m_file))
+        return close(), 1;
+    map();
+    return 0;
+#elif defined(__linux__)
+    m_file = ::open(path.c_str(), O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+    if (!is_open()) return 1;
+    if (size == 0) return 0;
+    // without the blocks reserved, a write through the mapping may fault when the disk is full,
+    // so the file is only mapped if they are
+    if (posix_fallocate(m_file, 0, size) == 0) {
+        map();
+    } else if (ftruncate(m_file, size) != 0) {
+        return close(), 1;
+    }
+    return 0;
+#else
+    (void)path;
+    return 1;
+#endif
+}
+
+int OutputFile::map() {
+    if (m_size == 0) return 1;
+#if defined(_WIN32)
+    m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE, (DWORD)(m_size >> 32),
+                                  (DWORD)m_size, NULL);
+    if (m_mapping == NULL) return 1;
+    m_view = (char*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (m_view == nullptr) return unmap(), 1;
+    return 0;
+#elif defined(__linux__)
+    void* p = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+    if (p == MAP_FAILED) return 1;
+    m_view = (char*)p;
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+void OutputFile::unmap() {
+#if defined(_WIN32)
+    if (m_view != nullptr) UnmapViewOfFile(m_view);
+    if (m_mapping != NULL) CloseHandle(m_mapping);
+    m_mapping = NULL;
+#elif defined(__linux__)
+    if (m_view != nullptr) munmap(m_view, m_size);
+#endif
+    m_view = nullptr;
+}
+
+bool OutputFile::is_open() const { return m_file != INVALID_NATIVE_FILE; }
+
+bool OutputFile::mapped() const { return m_view != nullptr; }
+
+uint64_t OutputFile::size() const { return m_size; }
+
+int OutputFile::write(const char* data, size_t len, uint64_t offset) {
+    if (!is_open() || m_failed) return 1;
+    if (offset >= m_size) return 0;
+    if (len > m_size - offset) len = m_size - offset;
+    if (m_view != nullptr) {
+        memcpy(m_view + offset, data, len);
+        return 0;
+    }
+    for (size_t done = 0; done < len;) {
+#if defined(_WIN32)
+        OVERLAPPED ov;
+        ZeroMemory(&ov, sizeof(ov));
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD n = 0;
+        if (!WriteFile(m_file, data + done, (DWORD)(len - done), &n, &ov)) n = 0;
+#elif defined(__linux__)
+        ssize_t n = pwrite(m_file, data + done, len - done, offset + done);
+#else
+        int n = 0;
+#endif
+        if (n <= 0) return m_failed = true, 1;
+        done += n;
+    }
+    return 0;
+}
+
+int OutputFile::close() {
+    if (!is_open()) return 0;
+    unmap();
+#if defined(_WIN32)
+    int err = CloseHandle(m_file) ? 0 : 1;
+#elif defined(__linux__)
+    int err = ::close(m_file);
+#else
+    int err = 0;
+#endif
+    m_file = INVALID_NATIVE_FILE;
+    return m_failed || err != 0 ? 1 : 0;
+}
+
+//===--------------------------------------------------===//
+// class FileSource
+//===--------------------------------------------------===//
+
+FileSource::~FileSource() { FileSource::close(); }
+
+int FileSource::open(const std::string& path) {
+    close();
+#if defined(_WIN32)
+    m_file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER size;
+    if (!is_open() || !GetFileSizeEx(m_file, &size)) return FileSource::close(), 1;
+    m_size = size.QuadPart;
+#elif defined(__linux__)
+    m_file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (!is_open() || fstat(m_file, &st) != 0) return FileSource::close(), 1;
+    m_size = st.st_size;
+#else
+    (void)path;
+    return 1;
+#endif
+    return 0;
+}
+
+bool FileSource::is_open() const { return m_file != INVALID_NATIVE_FILE; }
+
+uint64_t FileSource::size() const { return m_size; }
+
+int FileSource::read(char* out, int len, uint64_t offset) {
+    if (!is_open()) return -1;
+    int done = 0;
+    while (done < len && offset + done < m_size) {
+#if defined(_WIN32)
+        OVERLAPPED ov;
+        ZeroMemory(&ov, sizeof(ov));
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD n = 0;
+        if (!ReadFile(m_file, out + done, len - done, &n, &ov))
+            return GetLastError() == ERROR_HANDLE_EOF ? done : -1;
+#elif defined(__linux__)
+        ssize_t n = pread(m_file, out + done, len - done, offset + done);
+        if (n < 0) return -1;
+#else
+        int n = 0;
+#endif
+        if (n == 0) break;  // truncated meanwhile
+        done += n;
+    }
+    return done;
+}
+
+int FileSource::close() {
+    if (!is_open()) return 0;
+#if defined(_WIN32)
+    int err = CloseHandle(m_file) ? 0 : 1;
+#elif defined(__linux__)
+    int err = ::close(m_file);
+#else
+    int err = 0;
+#endif
+    m_file = INVALID_NATIVE_FILE;
+    m_size = 0;
+    return err;
+}
+
+//===--------------------------------------------------===//
+// class MappedSource
+//===--------------------------------------------------===//
+
+MappedSource::~MappedSource() { MappedSource::close(); }
+
+int MappedSource::open(const std::string& path) {
+    close();
+    if (FileSource::open(path) != 0) return 1;
+    if (m_size == 0) return 0;
+#if defined(_WIN32)
+    m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_mapping != NULL) m_view = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#elif defined(__linux__)
+    void* p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_file, 0);
+    if (p != MAP_FAILED) {
+        madvise(p, m_size, MADV_SEQUENTIAL);
+        m_view = (const char*)p;
+    }
+#endif
+    return 0;
+}
+
+int MappedSource::read(char* out, int len, uint64_t offset) {
+    if (m_view == nullptr) return FileSource::read(out, len, offset);
+    if (offset >= m_size) return 0;
+    if ((uint64_t)len > m_size - offset) len = m_size - offset;
+    memcpy(out, m_view + offset, len);
+    return len;
+}
+
+int MappedSource::close() {
+#if defined(_WIN32)
+    if (m_view != nullptr) UnmapViewOfFile(m_view);
+    if (m_mapping != NULL) CloseHandle(m_mapping);
+    m_mapping = NULL;
+#elif defined(__linux__)
+    if (m_view != nullptr) munmap((void*)m_view, m_size);
+#endif
+    m_view = nullptr;
+    return FileSource::close();
+}
+
+//===--------------------------------------------------===//
+// class ReadAheadSource
+//===--------------------------------------------------===//
+
+ReadAheadSource::ReadAheadSource(size_t block_size, unsigned blocks) noexcept
+    : m_block_size(std::max(block_size, (size_t)1)), m_slots(std::max(blocks, 2u)) {}
+
+ReadAheadSource::~ReadAheadSource() { ReadAheadSource::close(); }
+
+int ReadAheadSource::open(const std::string& path) {
+    close();
+    if (FileSource::open(path) != 0) return 1;
+    for (auto& slot : m_slots) slot = Slot();
+    m_want = 0;
+    m_running = true;
+    m_thread = std::thread(&ReadAheadSource::work, this);
+    return 0;
+}
+
+void ReadAheadSource::work() {
+    UniqueLock lock(m_mutex);
+    uint64_t blocks = (m_size + m_block_size - 1) / m_block_size;
+    while (m_running) {
+        // the first block of the window not read yet, its slot holds a block behind the window
+        Slot* slot = nullptr;
+        uint64_t block = m_want;
+        for (; block < m_want + m_slots.size() && block < blocks; ++block) {
+            Slot& s = m_slots[block % m_slots.size()];
+            if (s.block != block && !s.loading) {
+                slot = &s;
+                break;
+            }
+        }
+        if (slot == nullptr) {
+            m_cv_want.wait(lock);
+            continue;
+        }
+        slot->block = UINT64_MAX;
+        slot->loading = true;
+        lock.unlock();
+        slot->data.resize(m_block_size);
+        int len = FileSource::read(slot->data.data(), m_block_size, block * m_block_size);
+        lock.lock();
+        slot->block = block;
+        slot->len = len;
+        slot->loading = false;
+        m_cv_ready.notify_all();
+    }
+}
+
+int ReadAheadSource::read(char* out, int len, uint64_t offset) {
+    if (!is_open()) return -1;
+    int done = 0;
+    while (done < len && offset + done < m_size) {
+        uint64_t pos = offset + done;
+        uint64_t block = pos / m_block_size;
+        int skip = pos - block * m_block_size;
+        int n = std::min<uint64_t>(len - done, m_block_size - skip);
+        UniqueLock lock(m_mutex);
+        Slot& slot = m_slots[block % m_slots.size()];
+        if (block > m_want) {
+            m_want = block;
+            m_cv_want.notify_one();
+        }
+        if (block == m_want) {
+            m_cv_ready.wait(lock, [&] { return slot.block == block || !m_running; });
+            if (!m_running) return -1;
+        }
+        if (slot.block == block && slot.len >= 0) {
+            n = std::max(std::min(n, slot.len - skip), 0);
+            memcpy(out + done, slot.data.data() + skip, n);
+        } else {
+            // behind the window, or the read has failed
+            lock.unlock();
+            n = FileSource::read(out + done, n, pos);
+            if (n < 0) return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+int ReadAheadSource::close() {
+    {
+        UniqueLock lock(m_mutex);
+        m_running = false;
+    }
+    m_cv_want.notify_all();
+    m_cv_ready.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+    return FileSource::close();
+}
+
+std::unique_ptr<FileSource> make_file_source(ReadMode mode) {
+    switch (mode) {
+        case ReadMode::MAP:
+            return std::make_unique<MappedSource>();
+        case ReadMode::AHEAD:
+            return std::make_unique<ReadAheadSource>();
+        default:
+            return std::make_unique<FileSource>();
+    }
+}
+
+const char* read_mode_name(ReadMode mode) {
+    switch (mode) {
+        case ReadMode::READ:
+            return "read";
+        case ReadMode::MAP:
+            return "mmap";
+        case ReadMode::AHEAD:
+            return "ahead";
+        default:
+            return "unknown";
+    }
+}
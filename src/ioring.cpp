@@ -0,0 +1,349 @@
+#include "ioring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+#define SUBMIT_BATCH 8  // writes queued before they are submitted
+#define REAP_BATCH 64   // completions taken at a time
+
+typedef std::lock_guard<std::mutex> LockGuard;
+
+//===--------------------------------------------------===//
+// class IoRing
+//===--------------------------------------------------===//
+
+#ifdef __linux__
+
+IoRing::IoRing(unsigned entries) noexcept {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_fd = syscall(__NR_io_uring_setup, std::max(entries, 1u), &p);
+    if (m_fd < 0) {
+        m_fd = -1;
+        return;
+    }
+    m_entries = p.sq_entries;
+
+    // map the rings, they are in one mapping since Linux 5.4
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                    IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) {
+        m_sq_ptr = nullptr;
+        release();
+        return;
+    }
+    if (single) {
+        m_cq_ptr = m_sq_ptr;
+    } else {
+        m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED) {
+            m_cq_ptr = nullptr;
+            release();
+        return;
+        }
+    }
+    m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                  IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        m_sqes = nullptr;
+        release();
+        return;
+    }
+
+    char* sq = (char*)m_sq_ptr;
+    m_sq_head = (unsigned*)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    m_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    m_sq_array = (unsigned*)(sq + p.sq_off.array);
+    char* cq = (char*)m_cq_ptr;
+    m_cq_head = (unsigned*)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    m_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = cq + p.cq_off.cqes;
+}
+
+IoRing::~IoRing() { release(); }
+
+void IoRing::release() {
+    if (m_sqes != nullptr) munmap(m_sqes, m_sqes_size);
+    if (m_cq_ptr != nullptr && m_cq_ptr != m_sq_ptr) munmap(m_cq_ptr, m_cq_size);
+    if (m_sq_ptr != nullptr) munmap(m_sq_ptr, m_sq_size);
+    if (m_fd >= 0) ::close(m_fd);
+    m_sqes = m_cq_ptr = m_sq_ptr = nullptr;
+    m_fd = -1;
+}
+
+bool IoRing::valid() const { return m_fd >= 0; }
+
+int IoRing::enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int n;
+    do {
+        n = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// The followings are called with `m_sq_mutex` locked
+
+int IoRing::flush() {
+    if (m_queued == 0) return 0;
+    int n = enter(m_queued, 0, 0);
+    if (n < 0) return -1;
+    m_queued -= n;
+    m_inflight += n;
+    return 0;
+}
+
+void* IoRing::get_sqe() {
+    if (!valid()) return nullptr;
+    unsigned tail = *m_sq_tail;
+    if (tail - LOAD_ACQUIRE(m_sq_head) >= m_entries) {
+        flush();
+        if (tail - LOAD_ACQUIRE(m_sq_head) >= m_entries) return nullptr;
+    }
+    io_uring_sqe* sqe = (io_uring_sqe*)m_sqes + (tail & *m_sq_mask);
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    return sqe;
+}
+
+void IoRing::push_sqe() {
+    unsigned tail = *m_sq_tail;
+    m_sq_array[tail & *m_sq_mask] = tail & *m_sq_mask;
+    STORE_RELEASE(m_sq_tail, tail + 1);
+    ++m_queued;
+}
+
+int IoRing::recvmsg(int s, msghdr* msg, uint64_t data) {
+    LockGuard lock(m_sq_mutex);
+    io_uring_sqe* sqe = (io_uring_sqe*)get_sqe();
+    if (sqe == nullptr) return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = s;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    sqe->user_data = data;
+    push_sqe();
+    return 0;
+}
+
+int IoRing::write(int fd, const void* buf, unsigned len, uint64_t offset, uint64_t data,
+                  int buf_index) {
+    LockGuard lock(m_sq_mutex);
+    io_uring_sqe* sqe = (io_uring_sqe*)get_sqe();
+    if (sqe == nullptr) return -1;
+    sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+    sqe->user_data = data;
+    push_sqe();
+    return 0;
+}
+
+int IoRing::register_buffer(void* base, size_t len) {
+    if (!valid()) return -1;
+    iovec iov = {base, len};
+    return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0 ? 0 : -1;
+}
+
+int IoRing::submit(unsigned wait) {
+    if (!valid()) return -1;
+    {
+        LockGuard lock(m_sq_mutex);
+        if (flush() != 0) return -1;
+    }
+    if (wait > 0 && enter(0, wait, IORING_ENTER_GETEVENTS) < 0) return -1;
+    return 0;
+}
+
+int IoRing::reap(const CompletionHandler& handler) {
+    if (!valid()) return 0;
+    int total = 0;
+    while (true) {
+        // taken in batches on the stack, so that reaping allocates nothing
+        std::pair<uint64_t, int> done[REAP_BATCH];
+        int n = 0;
+        {
+            LockGuard lock(m_cq_mutex);
+            unsigned head = *m_cq_head;
+            unsigned tail = LOAD_ACQUIRE(m_cq_tail);
+            for (; head != tail && n < REAP_BATCH; ++head, ++n) {
+                io_uring_cqe* cqe = (io_uring_cqe*)m_cqes + (head & *m_cq_mask);
+                done[n] = {cqe->user_data, cqe->res};
+            }
+            STORE_RELEASE(m_cq_head, head);
+        }
+        m_inflight -= n;
+        // handled with the queues unlocked, the handler may queue operations again
+        for (int i = 0; i < n; ++i) handler(done[i].first, done[i].second);
+        total += n;
+        if (n < REAP_BATCH) return total;
+    }
+}
+
+#else
+
+IoRing::IoRing(unsigned entries) noexcept {}
+IoRing::~IoRing() {}
+void IoRing::release() {}
+bool IoRing::valid() const { return false; }
+int IoRing::enter(unsigned to_submit, unsigned min_complete, unsigned flags) { return -1; }
+int IoRing::flush() { return -1; }
+void* IoRing::get_sqe() { return nullptr; }
+void IoRing::push_sqe() {}
+int IoRing::write(int fd, const void* buf, unsigned len, uint64_t offset, uint64_t data,
+                  int buf_index) {
+    return -1;
+}
+int IoRing::register_buffer(void* base, size_t len) { return -1; }
+int IoRing::submit(unsigned wait) { return -1; }
+int IoRing::reap(const CompletionHandler& handler) { return 0; }
+
+#endif
+
+int IoRing::fd() const { return m_fd; }
+
+unsigned IoRing::queued() {
+    LockGuard lock(m_sq_mutex);
+    return m_queued;
+}
+
+unsigned IoRing::inflight() const { return m_inflight; }
+
+//===--------------------------------------------------===//
+// class RingWriter
+//===--------------------------------------------------===//
+
+RingWriter::RingWriter(size_t slot_size, unsigned slots) noexcept
+    : m_ring(slots), m_slot_size(std::max(slot_size, (size_t)1)) {
+    if (!m_ring.valid()) return;
+    slots = std::max(slots, 1u);
+    m_arena.resize(m_slot_size * slots);
+    m_slot_fd.resize(slots, -1);
+    m_slot_len.resize(slots, 0);
+    for (int i = slots - 1; i >= 0; --i) m_free.push_back(i);
+    // plain writes if the region cannot be pinned (e.g. RLIMIT_MEMLOCK)
+    m_fixed = m_ring.register_buffer(m_arena.data(), m_arena.size()) == 0;
+}
+
+RingWriter::~RingWriter() {
+    while (m_ring.valid() && (m_ring.inflight() > 0 || m_ring.queued() > 0)) wait_some();
+}
+
+bool RingWriter::valid() const { return m_ring.valid(); }
+
+void RingWriter::complete(uint64_t slot, int res) {
+    LockGuard lock(m_mutex);
+    auto it = m_files.find(m_slot_fd[slot]);
+    if (it != m_files.end()) {
+        --it->second.pending;
+        if (res < 0 || (size_t)res != m_slot_len[slot]) it->second.failed = true;
+    }
+    m_slot_fd[slot] = -1;
+    m_free.push_back(slot);
+}
+
+// Reap completions, waiting for one if none is there
+void RingWriter::wait_some() {
+    LockGuard lock(m_wait_mutex);
+    auto handler = [this](uint64_t slot, int res) { complete(slot, res); };
+    m_ring.submit();
+    if (m_ring.reap(handler) > 0) return;
+    // a completion is on the way, otherwise the slots taken are not queued yet
+    if (m_ring.inflight() > 0) m_ring.submit(1);
+    else std::this_thread::yield();
+    m_ring.reap(handler);
+}
+
+int RingWriter::open(const std::string& path, uint64_t size, bool keep) {
+#ifdef __linux__
+    if (!valid()) return -1;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    // not fatal, the file is then extended by the writes
+    if (size > 0) posix_fallocate(fd, 0, size);
+    LockGuard lock(m_mutex);
+    m_files[fd] = FileState();
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+int RingWriter::write(int fd, const char* data, size_t len, uint64_t offset) {
+    for (size_t done = 0; done < len;) {
+        // take a free slot
+        int slot = -1;
+        while (slot < 0) {
+            {
+                LockGuard lock(m_mutex);
+                auto it = m_files.find(fd);
+                if (it == m_files.end() || it->second.failed) return 1;
+                if (!m_free.empty()) {
+                    slot = m_free.back();
+                    m_free.pop_back();
+                    m_slot_fd[slot] = fd;
+                    ++it->second.pending;
+                }
+            }
+            if (slot < 0) wait_some();
+        }
+        size_t n = std::min(m_slot_size, len - done);
+        char* p = m_arena.data() + slot * m_slot_size;
+        memcpy(p, data + done, n);
+        m_slot_len[slot] = n;
+        if (m_ring.write(fd, p, n, offset + done, slot, m_fixed ? 0 : -1) != 0)
+            return complete(slot, -1), 1;
+        done += n;
+    }
+    // submitted in batches, the rest goes with a later write or the flush
+    if (m_ring.queued() >= SUBMIT_BATCH) m_ring.submit();
+    return 0;
+}
+
+int RingWriter::flush(int fd) {
+    while (true) {
+        {
+            LockGuard lock(m_mutex);
+            auto it = m_files.find(fd);
+            if (it == m_files.end()) return 1;
+            if (it->second.pending == 0) return it->second.failed ? 1 : 0;
+        }
+        wait_some();
+    }
+}
+
+int RingWriter::close(int fd) {
+    int err = flush(fd);
+    {
+        LockGuard lock(m_mutex);
+        m_files.erase(fd);
+    }
+#ifdef __linux__
+    if (::close(fd) != 0) err = 1;
+#endif
+    return err;
+}
@@ -0,0 +1,125 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+
+#define JOURNAL_MAGIC "transf-journal"
+#define JOURNAL_VERSION 1
+
+//===--------------------------------------------------===//
+// struct Journal
+//===--------------------------------------------------===//
+
+std::string journal_path(const std::string& path) { return path + JOURNAL_SUFFIX; }
+
+int save_journal(const std::string& path, const Journal& journal) {
+    // written aside and renamed over the previous one, a journal is never seen half written
+    std::string fp = journal_path(path), tmp_fp = fp + ".tmp";
+    {
+        std::ofstream out(tmp_fp, std::ios::trunc);
+        if (!out) return 1;
+        out << JOURNAL_MAGIC << ' ' << JOURNAL_VERSION << '\n';
+        out << "size " << journal.size << '\n';
+        out << "chunk " << journal.chunk_size << '\n';
+        out << "identity " << journal.identity << '\n';
+        for (auto& r : journal.received) out << "received " << r.first << ' ' << r.last << '\n';
+        out.flush();
+        if (!out) return out.close(), std::filesystem::remove(tmp_fp), 1;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_fp, fp, ec);
+    if (ec) return std::filesystem::remove(tmp_fp, ec), 1;
+    return 0;
+}
+
+int load_journal(const std::string& path, Journal& journal) {
+    std::ifstream in(journal_path(path));
+    if (!in) return 1;
+    std::string magic, key;
+    int version = 0;
+    if (!(in >> magic >> version) || magic != JOURNAL_MAGIC || version != JOURNAL_VERSION)
+        return 1;
+    journal = Journal();
+    while (in >> key) {
+        if (key == "size") {
+            in >> journal.size;
+        } else if (key == "chunk") {
+            in >> journal.chunk_size;
+        } else if (key == "identity") {
+            in >> journal.identity;
+        } else if (key == "received") {
+            ChunkRange r;
+            in >> r.first >> r.last;
+            // in order and not overlapping
+            uint64_t after = journal.received.empty() ? 1 : journal.received.back().last + 1;
+            if (in && (r.first < after || r.last < r.first)) return 1;
+            journal.received.push_back(r);
+        } else {
+            return 1;
+        }
+        if (!in) return 1;
+    }
+    return journal.chunk_size == 0 ? 1 : 0;
+}
+
+int remove_journal(const std::string& path) {
+    std::error_code ec;
+    std::filesystem::remove(journal_path(path), ec);
+    return ec ? 1 : 0;
+}
+
+//===--------------------------------------------------===//
+// Ranges of chunks
+//===--------------------------------------------------===//
+
+std::vector<ChunkRange> complement_ranges(const std::vector<ChunkRange>& ranges, uint64_t chunks) {
+    std::vector<ChunkRange> result;
+    uint64_t next = 1;
+    for (auto& r : ranges) {
+        if (r.first > chunks) break;
+        if (r.first > next) result.push_back({next, r.first - 1});
+        next = std::max(next, r.last + 1);
+    }
+    if (next <= chunks) result.push_back({next, chunks});
+    return result;
+}
+
+void merge_ranges(std::vector<ChunkRange>& ranges, size_t max) {
+    max = std::max<size_t>(max, 1);
+    while (ranges.size() > max) {
+        // the smallest gap goes
+        size_t nearest = 0;
+        for (size_t i = 1; i + 1 < ranges.size(); ++i) {
+            if (ranges[i + 1].first - ranges[i].last <
+                ranges[nearest + 1].first - ranges[nearest].last)
+                nearest = i;
+        }
+        ranges[nearest].last = ranges[nearest + 1].last;
+        ranges.erase(ranges.begin() + nearest + 1);
+    }
+}
+
+void split_ranges(std::vector<ChunkRange>& ranges, size_t n) {
+    while (ranges.size() < n) {
+        auto largest = std::max_element(ranges.begin(), ranges.end(), [](auto& a, auto& b) {
+            return a.last - a.first < b.last - b.first;
+        });
+        if (largest == ranges.end() || largest->first == largest->last) return;
+        uint64_t mid = largest->first + (largest->last - largest->first) / 2;
+        ChunkRange upper{mid + 1, largest->last};
+        largest->last = mid;
+        ranges.insert(largest + 1, upper);
+    }
+}
+
+uint64_t ranges_size(const std::vector<ChunkRange>& ranges, uint64_t size, uint64_t chunk_size) {
+    uint64_t total = 0;
+    for (auto& r : ranges) {
+        uint64_t begin = std::min((r.first - 1) * chunk_size, size);
+        uint64_t end = std::min(r.last * chunk_size, size);
+        total += end - begin;
+    }
+    return total;
+}
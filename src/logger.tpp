@@ -40,8 +40,9 @@ class Logger {
     Level level;
     std::string identifier;
 
+    // arguments are taken by reference, nothing is copied for a message filtered out
     template <typename... Args>
-    void _level_out(std::ostream& os, Level lv, Args... args) const {
+    void _level_out(std::ostream& os, Level lv, const Args&... args) const {
         if (lv < level) return;
         os << join_string(get_colored_prefix(lv), args...) << std::endl;
     }
@@ -109,29 +110,29 @@ class Logger {
      */
    public:
     template <typename... Args>
-    void level_print(Level lv, Args... args) const {
+    void level_print(Level lv, const Args&... args) const {
         if (lv < level) return;
         auto& os = lv == Level::ERROR || lv == Level::WARN ? std::cerr : std::cout;
         os << join_string(args...) << std::endl;
     }
 
     template <typename... Args>
-    void info(Args... args) const {
+    void info(const Args&... args) const {
         return _level_out(std::cout, Level::INFO, args...);
     }
 
     template <typename... Args>
-    void warn(Args... args) const {
+    void warn(const Args&... args) const {
         return _level_out(std::cerr, Level::WARN, args...);
     }
 
     template <typename... Args>
-    void error(Args... args) const {
+    void error(const Args&... args) const {
         return _level_out(std::cerr, Level::ERROR, args...);
     }
 
     template <typename... Args>
-    void debug(Args... args) const {
+    void debug(const Args&... args) const {
         return _level_out(std::cout, Level::DEBUG, args...);
     }
 
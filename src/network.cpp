@@ -1,5 +1,53 @@
 #include "network.h"
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
+#ifdef _WIN32
+#include <mswsock.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+// Limits of a datagram sent with segmentation offload (UDP_MAX_SEGMENTS on Linux)
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_SIZE 65000
+#define GRO_BUF_SIZE 65535
+
+#define ZEROCOPY_MAX_PENDING (8 << 20)  // bytes of the buffers to send from in place
+#define ZEROCOPY_MIN_BUFFERS 64
+
 inline ip_family to_addr_family(ip_version ip_ver) {
     return (ip_ver & IPv4) && (ip_ver & IPv6) ? AF_UNSPEC
            : (ip_ver & IPv4)                  ? AF_INET
@@ -28,6 +76,239 @@ inline int to_addr_protocol(SockType type, ip_version ip_ver) {
                                   : IPPROTO_IPV6;
 }
 
+// Stream sockets do not preserve message boundaries, so each message sent over a stream socket
+// is prefixed with its length (4 bytes, network byte order). Then handlers receive the same
+// messages as on datagram sockets, even if the sender does not wait for replies.
+
+inline int send_all(SOCKET s, const char* buf, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int err = ::send(s, buf + sent, len - sent, 0);
+        if (err == SOCKET_ERROR) return SOCKET_ERROR;
+        sent += err;
+    }
+    return sent;
+}
+
+inline int recv_all(SOCKET s, char* buf, int len) {
+    int received = 0;
+    while (received < len) {
+        int size = ::recv(s, buf + received, len - received, 0);
+        if (size <= 0) return size;
+        received += size;
+    }
+    return received;
+}
+
+// A message of a stream socket, prefixed by its length if the stream is framed
+inline int send_frame(SOCKET s, const char* buf, int len, bool framed) {
+    if (!framed) return send_all(s, buf, len);
+    uint32_t len_net = htonl(len);
+    std::string frame((const char*)&len_net, sizeof(len_net));
+    frame.append(buf, len);
+    int err = send_all(s, frame.data(), frame.size());
+    return err == SOCKET_ERROR ? SOCKET_ERROR : len;
+}
+
+// The part of message exceeding `maxlen` is discarded, a stream not framed has what a call
+// receives as a message, peers of the text format send one at a time
+inline int recv_frame(SOCKET s, char* buf, int maxlen, bool framed) {
+    if (!framed) return ::recv(s, buf, maxlen, 0);
+    uint32_t len_net;
+    int size = recv_all(s, (char*)&len_net, sizeof(len_net));
+    if (size <= 0) return size;
+    int len = ntohl(len_net);
+    int keep = len < maxlen ? len : maxlen;
+    size = recv_all(s, buf, keep);
+    if (size <= 0) return size;
+    char discard[256];
+    for (int rest = len - keep; rest > 0;) {
+        int n = recv_all(s, discard, rest < (int)sizeof(discard) ? rest : sizeof(discard));
+        if (n <= 0) return n;
+        rest -= n;
+    }
+    return keep;
+}
+
+// A datagram in a pooled buffer follows this head, which tells its peer to the workers
+struct MessageHead {
+    addrcoll info;
+    sockaddr_storage addr;
+    int len;
+};
+
+// Datagrams are received in batches: up to `size` of them are read per call into a ring of
+// buffers. On Linux it takes a single `recvmmsg`, elsewhere the socket is drained with `recvfrom`
+// as long as `FIONREAD` reports more data. Only the first datagram is waited for.
+// With receive offload (GRO), a buffer may hold several datagrams from the same peer coalesced
+// by the kernel, each `segs[i]` bytes except the last one.
+// Given a pool, each slot receives into a pooled buffer after the room of a `MessageHead`, which
+// may be handed over with the datagram, the slot takes another one then. A slot falls back to a
+// buffer of the batch while the pool is exhausted.
+
+struct DatagramBatch {
+    int size;
+    int buf_size;
+    int count = 0;
+    std::shared_ptr<BufferPool> pool;
+    std::vector<PooledBuffer> owned;
+    std::vector<char> bufs;
+    std::vector<sockaddr_storage> addrs;
+    std::vector<socklen_t> addrlens;
+    std::vector<int> lens;
+    std::vector<int> segs;
+#ifdef __linux__
+    std::vector<mmsghdr> msgs;
+    std::vector<iovec> iovs;
+    std::vector<char> ctrls;
+    static constexpr size_t CTRL_SIZE = CMSG_SPACE(sizeof(int));
+#endif
+
+    DatagramBatch(int size, int buf_size, std::shared_ptr<BufferPool> pool = nullptr)
+        : size(size),
+          buf_size(buf_size),
+          pool(pool),
+          owned(size),
+          bufs((size_t)size * buf_size),
+          addrs(size),
+          addrlens(size),
+          lens(size),
+          segs(size) {
+#ifdef __linux__
+        msgs.resize(size);
+        iovs.resize(size);
+        ctrls.resize(size * CTRL_SIZE);
+        for (int i = 0; i < size; ++i) {
+            iovs[i].iov_base = buf(i);
+            iovs[i].iov_len = buf_size;
+            msgs[i].msg_hdr = {};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+        }
+#endif
+    }
+
+    char* buf(int i) {
+        if (owned[i]) return owned[i].data() + sizeof(MessageHead);
+        return bufs.data() + (size_t)i * buf_size;
+    }
+    // take a pooled buffer for slot i if it has none
+    void refill(int i) {
+        if (pool && !owned[i]) owned[i] = pool->acquire();
+#ifdef __linux__
+        iovs[i].iov_base = buf(i);
+#endif
+    }
+
+#ifdef __linux__
+    // prepare slot i for receiving
+    void arm(int i) {
+        refill(i);
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        msgs[i].msg_hdr.msg_control = ctrls.data() + i * CTRL_SIZE;
+        msgs[i].msg_hdr.msg_controllen = CTRL_SIZE;
+    }
+    // slot i has received `len` bytes
+    void received(int i, int len) {
+        lens[i] = len;
+        addrlens[i] = msgs[i].msg_hdr.msg_namelen;
+        segs[i] = 0;
+        for (cmsghdr* c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c != nullptr;
+             c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+            if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+                memcpy(&segs[i], CMSG_DATA(c), sizeof(int));
+        }
+    }
+#endif
+
+    // Returns the number of datagrams received, or SOCKET_ERROR
+    int recv(SOCKET s) {
+#ifdef __linux__
+        for (int i = 0; i < size; ++i) arm(i);
+        count = ::recvmmsg(s, msgs.data(), size, MSG_WAITFORONE, nullptr);
+        if (count <= 0) return count = 0, SOCKET_ERROR;
+        for (int i = 0; i < count; ++i) received(i, msgs[i].msg_len);
+        return count;
+#else
+        count = 0;
+        u_long pending = 0;
+        do {
+            refill(count);
+            addrlens[count] = sizeof(sockaddr_storage);
+            int len = ::recvfrom(s, buf(count), buf_size, 0, (sockaddr*)&addrs[count],
+                                 &addrlens[count]);
+            if (len == SOCKET_ERROR) break;
+            segs[count] = 0;
+            lens[count++] = len;
+        } while (count < size && ioctlsocket(s, FIONREAD, &pending) == 0 && pending > 0);
+        return count > 0 ? count : SOCKET_ERROR;
+#endif
+    }
+};
+
+// Messages sent with MSG_ZEROCOPY from buffers of the pool, each buffer is held until the
+// kernel releases it. Each successful send takes a sequence number, and the kernel reports ranges
+// of sequence numbers completed on the error queue of the socket, in order for TCP
+struct ZeroCopyState {
+    struct Pending {
+        uint32_t seq;      // the last sequence number of the message
+        uint32_t len_net;  // the length prefix, sent from here as well
+        PooledBuffer buf;
+    };
+
+    int threshold;
+    std::atomic<bool> active{true};  // turned off once the kernel has copied
+    uint32_t next_seq = 0;
+    uint32_t completed = 0;  // sequence numbers before it are completed
+    std::unique_ptr<BufferPool> pool;
+    std::deque<Pending> pending;  // dropped before the pool
+    std::mutex mutex;
+
+    ZeroCopyState(int threshold) : threshold(threshold) {}
+
+#ifdef __linux__
+    // Read the notifications and return the buffers released to the pool, `mutex` is locked
+    // If `wait`, wait a while for a notification first
+    void reap(SOCKET s, bool wait) {
+        if (wait) {
+            pollfd pfd = {s, 0, 0};  // errors are always reported
+            ::poll(&pfd, 1, 1000);
+        }
+        char ctrl[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+        while (true) {
+            msghdr msg = {};
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            if (::recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+            for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+                if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) &&
+                    !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+                    continue;
+                sock_extended_err err;
+                memcpy(&err, CMSG_DATA(c), sizeof(err));
+                if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) active = false;
+                completed = err.ee_data + 1;  // the range is [ee_info, ee_data]
+            }
+        }
+        while (!pending.empty() && (int32_t)(pending.front().seq - completed) < 0)
+            pending.pop_front();
+    }
+#endif
+};
+
+// Datagrams received through a ring, every slot of the batch has a receive queued, which is
+// queued again once the slot is handled. The batch shall outlive the ring.
+struct RecvRing {
+    DatagramBatch batch;
+    IoRing ring;
+    std::vector<int> done;  // slots completed, kept for reuse
+
+    RecvRing(int size, int buf_size, std::shared_ptr<BufferPool> pool)
+        : batch(size, buf_size, pool), ring(size) {}
+};
+
 //===--------------------------------------------------===//
 // struct ConnectInfo
 //===--------------------------------------------------===//
@@ -120,9 +401,11 @@ bool ServiceInfo::operator==(const ServiceInfo& s) {
 // constructors
 
 BasicSocket::BasicSocket(const BasicSocket& r) noexcept  // copy constructor
-    : m_sockfd(r.m_sockfd), m_addrcoll(r.m_addrcoll) {}
+    : m_sockfd(r.m_sockfd), m_addrcoll(r.m_addrcoll), m_zerocopy(r.m_zerocopy),
+      m_framed(r.m_framed.load()) {}
 BasicSocket::BasicSocket(BasicSocket&& r) noexcept  // move constructor
-    : m_sockfd(r.m_sockfd), m_addrcoll(r.m_addrcoll) {
+    : m_sockfd(r.m_sockfd), m_addrcoll(r.m_addrcoll), m_zerocopy(r.m_zerocopy),
+      m_framed(r.m_framed.load()) {
     ::closesocket(r.m_sockfd);
 }
 
@@ -146,6 +429,9 @@ BasicSocket::BasicSocket(std::string ip, int port,
     FreeAddrInfo(result);
 }
 
+BasicSocket::BasicSocket(const addrcoll& info, SOCKET s) noexcept
+    : m_sockfd(s), m_addrcoll(info) {}
+
 // Note that the `paddr` is copied, it can be freed safely
 BasicSocket::BasicSocket(addrcoll* paddr) noexcept  // constructor from addrcoll
     : m_addrcoll(copy_addrinfo(paddr)) {
@@ -166,8 +452,20 @@ bool BasicSocket::ensure_socket() const { return m_sockfd != INVALID_SOCKET; }
 bool BasicSocket::ensure_addr() const { return m_addrcoll.ai_addr != nullptr; }
 bool BasicSocket::ensure() const { return ensure_socket() && ensure_addr() && m_prop_hasbound; }
 
+int BasicSocket::readable(int timeout) const {
+    if (!ensure_socket()) return SOCKET_ERROR;
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(m_sockfd, &fds);
+    timeval tv = {timeout / 1000, timeout % 1000 * 1000};
+    return ::select(m_sockfd + 1, &fds, nullptr, nullptr, &tv);
+}
+
+bool BasicSocket::framed() const { return m_framed; }
+
 int BasicSocket::init_socket() {
     m_sockfd = ::socket(m_addrcoll.ai_family, m_addrcoll.ai_socktype, m_addrcoll.ai_protocol);
+    m_framed = false;
     return m_sockfd == INVALID_SOCKET ? 1 : 0;
 }
 
@@ -193,6 +491,101 @@ int BasicSocket::destroy() const {
     return err;
 }
 
+int BasicSocket::enable_zerocopy(bool enable, int threshold) {
+    if (!enable) return m_zerocopy = nullptr, 0;
+    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+    if (m_addrcoll.ai_socktype != SOCK_STREAM) return METHOD_NOT_IMPLEMENTED;
+#ifdef __linux__
+    int flag = 1;
+    int err = setsockopt(m_sockfd, SOL_SOCKET, SO_ZEROCOPY, (const char*)&flag, sizeof(flag));
+    if (err != 0) return METHOD_NOT_IMPLEMENTED;
+    m_zerocopy = std::make_shared<ZeroCopyState>(threshold);
+    return 0;
+#else
+    return METHOD_NOT_IMPLEMENTED;
+#endif
+}
+
+bool BasicSocket::use_zerocopy(int len) const {
+    return m_zerocopy != nullptr && len >= m_zerocopy->threshold;
+}
+
+PooledBuffer BasicSocket::zerocopy_buffer(int size) const {
+#ifdef __linux__
+    // the kernel copies anyway, the data may as well be sent from anywhere
+    if (!use_zerocopy(size) || !m_zerocopy->active) return PooledBuffer();
+    ZeroCopyState& zc = *m_zerocopy;
+    LockGuard lock(zc.mutex);
+    zc.reap(m_sockfd, false);
+    if (zc.pool == nullptr) {
+        uint32_t count = std::max<uint32_t>(ZEROCOPY_MAX_PENDING / size, ZEROCOPY_MIN_BUFFERS);
+        zc.pool = std::make_unique<BufferPool>(size, count);
+    }
+    if ((int)zc.pool->size() < size) return PooledBuffer();
+    PooledBuffer buf = zc.pool->acquire();
+    // wait for the kernel to release one, unless the caller holds them all
+    while (!buf && !zc.pending.empty()) {
+        zc.reap(m_sockfd, true);
+        buf = zc.pool->acquire();
+    }
+    return buf;
+#else
+    return PooledBuffer();
+#endif
+}
+
+// Framed as `send_frame` does, the length prefix if any and the message go out of where they are,
+// and the buffer is held until the kernel releases it
+int BasicSocket::send_zerocopy(PooledBuffer& buf, int len) const {
+#ifdef __linux__
+    ZeroCopyState& zc = *m_zerocopy;
+    LockGuard lock(zc.mutex);
+    zc.reap(m_sockfd, false);
+    zc.pending.push_back({0, htonl(len), std::move(buf)});
+    ZeroCopyState::Pending& p = zc.pending.back();
+    iovec iov[2] = {{&p.len_net, sizeof(p.len_net)}, {p.buf.data(), (size_t)len}};
+    const bool FRAMED = m_framed;
+    msghdr msg = {};
+    msg.msg_iov = FRAMED ? iov : iov + 1;
+    msg.msg_iovlen = FRAMED ? 2 : 1;
+    bool pinned = false;  // some part is sent in place, the kernel will release it
+    int err = len;
+    for (size_t left = (FRAMED ? sizeof(p.len_net) : 0) + len; left > 0;) {
+        int flags = zc.active ? MSG_ZEROCOPY : 0;
+        ssize_t n = ::sendmsg(m_sockfd, &msg, flags);
+        if (n < 0 && errno == ENOBUFS && flags != 0) {
+            // too much memory pinned (net.core.optmem_max), copy this part
+            flags = 0;
+            n = ::sendmsg(m_sockfd, &msg, flags);
+        }
+        if (n <= 0) {
+            err = SOCKET_ERROR;
+            break;
+        }
+        if (flags & MSG_ZEROCOPY) ++zc.next_seq, pinned = true;
+        left -= n;
+        while (n > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov, --msg.msg_iovlen;
+        }
+        if (n > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    if (pinned) {
+        p.seq = zc.next_seq - 1;
+    } else {
+        zc.pending.pop_back();  // copied by the kernel, the buffer is free now
+    }
+    return err;
+#else
+    int err = send_frame(m_sockfd, buf.data(), len, m_framed);
+    buf.reset();
+    return err;
+#endif
+}
+
 // Cleanup WSA is a breaking action, it will make all sockets invalid
 int BasicSocket::terminate() { return WSACleanup(); }
 
@@ -242,10 +635,9 @@ int BasicSocket::recv_from(char* buf, int maxlen, const addrcoll* paddr) const {
 }
 int BasicSocket::recv_from(std::string& str, int maxlen, const addrcoll* paddr) const {
     if (!ensure()) return -1;
-    char* _buf = new char[maxlen];
-    int size = recv_from(_buf, maxlen, paddr);
-    str = std::string(_buf);
-    delete[] _buf;
+    str.resize(maxlen);
+    int size = recv_from(str.data(), maxlen, paddr);
+    str.resize(size > 0 ? size : 0);
     return size;
 }
 int BasicSocket::recv_from(char* buf, int maxlen, const ConnectInfo& conn) const {
@@ -259,11 +651,9 @@ int BasicSocket::recv_from(char* buf, int maxlen, const ConnectInfo& conn) const
 }
 int BasicSocket::recv_from(std::string& str, int maxlen, const ConnectInfo& conn) const {
     if (!ensure()) return -1;
-    char* _buf = new char[maxlen];
-    int size = recv_from(_buf, maxlen, conn);
-    str.clear();
-    if (size >= 0) str.append(_buf, size);
-    delete[] _buf;
+    str.resize(maxlen);
+    int size = recv_from(str.data(), maxlen, conn);
+    str.resize(size > 0 ? size : 0);
     return size;
 }
 int BasicSocket::recv_from(char* buf, int maxlen, const BasicSocket& r) const {
@@ -274,11 +664,9 @@ int BasicSocket::recv_from(char* buf, int maxlen, const BasicSocket& r) const {
 }
 int BasicSocket::recv_from(std::string& str, int maxlen, const BasicSocket& r) const {
     if (!ensure()) return -1;
-    char* _buf = new char[maxlen];
-    int size = recv_from(_buf, maxlen, r);
-    str.clear();
-    if (size >= 0) str.append(_buf, size);
-    delete[] _buf;
+    str.resize(maxlen);
+    int size = recv_from(str.data(), maxlen, r);
+    str.resize(size > 0 ? size : 0);
     return size;
 }
 
@@ -320,11 +708,15 @@ SocketPeer::SocketPeer(BasicSocket* p_bsocket_from, addrcoll* paddr_peer) noexce
     : BasicSocket(paddr_peer), m_p_bsock_from(p_bsocket_from) {}
 
 SocketPeer::SocketPeer(BasicSocket* p_bsocket_from, addrcoll* paddr_peer, SOCKET s_peer) noexcept
-    : BasicSocket(paddr_peer), m_p_bsock_from(p_bsocket_from) {
-    m_sockfd = s_peer;
+    : BasicSocket(copy_addrinfo(paddr_peer), s_peer), m_p_bsock_from(p_bsocket_from) {
     m_prop_hasbound = is_peer_bound(s_peer);
 }
 
+SocketPeer::SocketPeer(BasicSocket* p_bsocket_from, const addrcoll& info, SOCKET s_peer) noexcept
+    : BasicSocket(info, s_peer), m_p_bsock_from(p_bsocket_from) {
+    m_prop_hasbound = s_peer != INVALID_SOCKET && is_peer_bound(s_peer);
+}
+
 bool SocketPeer::ensure() const {
     return ::BasicSocket::ensure_socket() && m_p_bsock_from->ensure_addr();
 }
@@ -334,7 +726,7 @@ int SocketPeer::send(const char* buf, int totlen) const {
                           m_p_bsock_from->addr_info().ai_socktype == SOCK_STREAM;
     if (is_both_stream) {
         if (!ensure_socket() || !ensure_addr()) return SOCKET_NOT_PREPARED;
-        int err = ::send(m_sockfd, buf, totlen, 0);
+        int err = send_frame(m_sockfd, buf, totlen, m_framed);
         return err;
     } else {
         if (!ensure_addr()) return ADDR_NOT_INIT;
@@ -346,12 +738,22 @@ int SocketPeer::send(const char* buf, int totlen) const {
 
 int SocketPeer::send(const std::string str) const { return send(str.c_str(), str.size()); }
 
+int SocketPeer::send_framing(const char* buf, int totlen) const {
+    bool is_both_stream = m_addrcoll.ai_socktype == SOCK_STREAM &&
+                          m_p_bsock_from->addr_info().ai_socktype == SOCK_STREAM;
+    if (!is_both_stream) return send(buf, totlen);
+    if (!ensure_socket() || !ensure_addr()) return SOCKET_NOT_PREPARED;
+    // framed before it is sent, the messages after it may be received on another thread at once
+    m_framed = true;
+    return send_frame(m_sockfd, buf, totlen, false);
+}
+
 int SocketPeer::recv(char* buf, int maxlen) const {
     bool is_both_stream = m_addrcoll.ai_socktype == SOCK_STREAM &&
                           m_p_bsock_from->addr_info().ai_socktype == SOCK_STREAM;
     if (is_both_stream) {
         if (!ensure()) return SOCKET_NOT_PREPARED;
-        int size = ::recv(m_sockfd, buf, maxlen, 0);
+        int size = recv_frame(m_sockfd, buf, maxlen, m_framed);
         return size;
     } else {
         if (!ensure_addr()) return ADDR_NOT_INIT;
@@ -362,11 +764,10 @@ int SocketPeer::recv(char* buf, int maxlen) const {
 }
 
 int SocketPeer::recv(std::string& str, int maxlen) const {
-    char* _buf = new char[maxlen];
-    int size = recv(_buf, maxlen);
-    str.clear();
-    if (size >= 0) str.append(_buf);
-    delete[] _buf;
+    // received into the string, whose storage is reused if it is large enough
+    str.resize(maxlen);
+    int size = recv(str.data(), maxlen);
+    str.resize(size > 0 ? size : 0);
     return size;
 }
 
@@ -403,14 +804,50 @@ int SocketPeer::close() const {
     return err;
 }
 
+//===--------------------------------------------------===//
+// FileHandle
+//===--------------------------------------------------===//
+
+FileHandle::FileHandle(const std::string& path) noexcept { open(path); }
+
+FileHandle::~FileHandle() { close(); }
+
+int FileHandle::open(const std::string& path) {
+    close();
+#if defined(_WIN32)
+    m_file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#elif defined(__linux__)
+    m_file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    return is_open() ? 0 : 1;
+}
+
+bool FileHandle::is_open() const { return m_file != INVALID_NATIVE_FILE; }
+
+native_file FileHandle::native() const { return m_file; }
+
+int FileHandle::close() {
+    if (!is_open()) return 0;
+#if defined(_WIN32)
+    int err = CloseHandle(m_file) ? 0 : 1;
+#elif defined(__linux__)
+    int err = ::close(m_file);
+#else
+    int err = 0;
+#endif
+    m_file = INVALID_NATIVE_FILE;
+    return err;
+}
+
 //===--------------------------------------------------===//
 // SocketClient
 //===--------------------------------------------------===//
 
 SocketClient::SocketClient(const SocketClient& r) noexcept
-    : BasicSocket(r), m_saddrcoll(r.m_saddrcoll) {}
+    : BasicSocket(r), m_saddrcoll(r.m_saddrcoll), m_gso(r.m_gso) {}
 SocketClient::SocketClient(SocketClient&& r) noexcept
-    : BasicSocket(std::move(r)), m_saddrcoll(r.m_saddrcoll) {}
+    : BasicSocket(std::move(r)), m_saddrcoll(r.m_saddrcoll), m_gso(r.m_gso) {}
 SocketClient::SocketClient(const BasicSocket& bs) noexcept : BasicSocket(bs) {
     m_saddrcoll = copy_addrinfo(&m_addrcoll, false);
 }
@@ -437,7 +874,7 @@ int SocketClient::send(const char* buf, int totlen) const {
         m_addrcoll.ai_socktype == SOCK_STREAM && m_saddrcoll.ai_socktype == SOCK_STREAM;
     if (is_both_stream) {
         if (!ensure_addr()) return ADDR_NOT_INIT;
-        int err = ::send(m_sockfd, buf, totlen, 0);
+        int err = send_frame(m_sockfd, buf, totlen, m_framed);
         return err;
     } else {
         if (!ensure_addr()) return ADDR_NOT_INIT;
@@ -448,12 +885,188 @@ int SocketClient::send(const char* buf, int totlen) const {
 }
 
 int SocketClient::send(const std::string str) const { return send(str.c_str(), str.size()); }
+
+int SocketClient::send_file(const char* head, int head_len, const FileHandle& file,
+                            uint64_t offset, int len) const {
+    if (!ensure_addr()) return ADDR_NOT_INIT;
+    if (m_addrcoll.ai_socktype != SOCK_STREAM) return METHOD_NOT_IMPLEMENTED;
+    if (!file.is_open()) return SOCKET_ERROR;
+    // framed as `send_frame` does, the length covers the head and the body
+    uint32_t len_net = htonl(head_len + len);
+    std::string frame;
+    if (m_framed) frame.assign((const char*)&len_net, sizeof(len_net));
+    frame.append(head, head_len);
+#if defined(_WIN32)
+    // the head goes in the same call, from the position of the file
+    LARGE_INTEGER pos;
+    pos.QuadPart = offset;
+    if (!SetFilePointerEx(file.native(), pos, NULL, FILE_BEGIN)) return SOCKET_ERROR;
+    TRANSMIT_FILE_BUFFERS buffers = {(PVOID)frame.data(), (DWORD)frame.size(), NULL, 0};
+    if (!TransmitFile(m_sockfd, file.native(), len, 0, NULL, &buffers, 0)) return SOCKET_ERROR;
+    return head_len + len;
+#elif defined(__linux__)
+    // the head is held back (MSG_MORE) to leave in the same segment as the body
+    for (size_t sent = 0; sent < frame.size();) {
+        int n = ::send(m_sockfd, frame.data() + sent, frame.size() - sent, MSG_MORE);
+        if (n <= 0) return SOCKET_ERROR;
+        sent += n;
+    }
+    off_t pos = offset;
+    for (int rest = len; rest > 0;) {
+        ssize_t n = ::sendfile(m_sockfd, file.native(), &pos, rest);
+        if (n <= 0) return SOCKET_ERROR;  // the file is shorter than expected
+        rest -= n;
+    }
+    return head_len + len;
+#else
+    return METHOD_NOT_IMPLEMENTED;
+#endif
+}
+
+int SocketClient::enable_gso(bool enable) {
+    if (!enable) return m_gso = false, 0;
+    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+    if (m_saddrcoll.ai_socktype != SOCK_DGRAM) return METHOD_NOT_IMPLEMENTED;
+#if defined(__linux__)
+    // probe, the size is given per message afterwards
+    int size = 0;
+    int err = setsockopt(m_sockfd, SOL_UDP, UDP_SEGMENT, (const char*)&size, sizeof(size));
+#elif defined(UDP_SEND_MSG_SIZE)
+    DWORD size = 0;
+    int err = setsockopt(m_sockfd, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (const char*)&size,
+                         sizeof(size));
+    m_gso_size = 0;
+#else
+    int err = SOCKET_ERROR;
+#endif
+    if (err != 0) return METHOD_NOT_IMPLEMENTED;
+    m_gso = true;
+    return 0;
+}
+
+int SocketClient::set_dont_fragment(bool enable) const {
+    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+    if (m_saddrcoll.ai_socktype != SOCK_DGRAM) return METHOD_NOT_IMPLEMENTED;
+    bool is_v6 = m_addrcoll.ai_family == AF_INET6;
+#if defined(__linux__)
+    // probing ignores the path MTU the kernel has learned, and the default fragments by it
+    int value = is_v6 ? (enable ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT)
+                      : (enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT);
+    int err = is_v6 ? setsockopt(m_sockfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (const char*)&value,
+                                 sizeof(value))
+                    : setsockopt(m_sockfd, IPPROTO_IP, IP_MTU_DISCOVER, (const char*)&value,
+                                 sizeof(value));
+#elif defined(IP_DONTFRAGMENT) && defined(IPV6_DONTFRAG)
+    DWORD value = enable ? 1 : 0;
+    int err = is_v6 ? setsockopt(m_sockfd, IPPROTO_IPV6, IPV6_DONTFRAG, (const char*)&value,
+                                 sizeof(value))
+                    : setsockopt(m_sockfd, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&value,
+                                 sizeof(value));
+#else
+    int err = SOCKET_ERROR;
+#endif
+    return err != 0 ? METHOD_NOT_IMPLEMENTED : 0;
+}
+
+void SocketClient::set_framed(bool enable) {
+    m_framed = enable && m_saddrcoll.ai_socktype == SOCK_STREAM;
+}
+
+int SocketClient::send_batch(const char* bufs, int stride, const int* lens, int n,
+                             PooledBuffer* owned) const {
+    if (!ensure_addr()) return ADDR_NOT_INIT;
+    bool is_both_stream =
+        m_addrcoll.ai_socktype == SOCK_STREAM && m_saddrcoll.ai_socktype == SOCK_STREAM;
+    if (is_both_stream) {
+        for (int i = 0; i < n; ++i) {
+            const char* buf = bufs + (size_t)i * stride;
+            int err = owned != nullptr && owned[i] ? send_zerocopy(owned[i], lens[i])
+                                                   : send_frame(m_sockfd, buf, lens[i], m_framed);
+            if (err == SOCKET_ERROR) return i > 0 ? i : SOCKET_ERROR;
+        }
+        return n;
+    }
+
+    // With segmentation offload, full-sized messages next to each other are sent as one buffer
+    // and split by the kernel, the last one of such a run may be shorter
+    auto run_of = [&](int i, int& total) -> int {
+        int j = i + 1;
+        total = lens[i];
+        if (!m_gso) return 1;
+        while (j < n && j - i < GSO_MAX_SEGMENTS && lens[j - 1] == stride &&
+               total + lens[j] <= GSO_MAX_SIZE)
+            total += lens[j++];
+        return j - i;
+    };
+
+#ifdef __linux__
+    const size_t CTRL_SIZE = CMSG_SPACE(sizeof(uint16_t));
+    std::vector<mmsghdr> msgs(n);
+    std::vector<iovec> iovs(n);
+    std::vector<char> ctrls(n * CTRL_SIZE);
+    std::vector<int> counts(n);  // messages in each buffer
+    int m = 0;
+    for (int i = 0, total; i < n; i += counts[m++]) {
+        counts[m] = run_of(i, total);
+        iovs[m].iov_base = (void*)(bufs + (size_t)i * stride);
+        iovs[m].iov_len = total;
+        msgs[m].msg_hdr = {};
+        msgs[m].msg_hdr.msg_iov = &iovs[m];
+        msgs[m].msg_hdr.msg_iovlen = 1;
+        msgs[m].msg_hdr.msg_name = m_saddrcoll.ai_addr;
+        msgs[m].msg_hdr.msg_namelen = m_saddrcoll.ai_addrlen;
+        if (counts[m] == 1) continue;
+        msgs[m].msg_hdr.msg_control = ctrls.data() + m * CTRL_SIZE;
+        msgs[m].msg_hdr.msg_controllen = CTRL_SIZE;
+        cmsghdr* c = CMSG_FIRSTHDR(&msgs[m].msg_hdr);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t seg = stride;
+        memcpy(CMSG_DATA(c), &seg, sizeof(seg));
+    }
+    int sent = 0;
+    for (int done = 0; done < m;) {
+        int err = ::sendmmsg(m_sockfd, msgs.data() + done, m - done, 0);
+        if (err == SOCKET_ERROR) {
+            // the device may not take the segments (e.g. larger than its MTU), go without it
+            if (m_gso && counts[done] > 1 && (errno == EINVAL || errno == EIO)) {
+                m_gso = false;
+                err = send_batch(bufs + (size_t)sent * stride, stride, lens + sent, n - sent);
+                return err == SOCKET_ERROR ? (sent > 0 ? sent : SOCKET_ERROR) : sent + err;
+            }
+            return sent > 0 ? sent : SOCKET_ERROR;
+        }
+        for (int k = done; k < done + err; ++k) sent += counts[k];
+        done += err;
+    }
+    return sent;
+#else
+    int sent = 0;
+    for (int i = 0, k, total; i < n; i += k) {
+        k = run_of(i, total);
+#ifdef UDP_SEND_MSG_SIZE
+        if (k > 1 && m_gso_size != stride) {
+            DWORD size = stride;
+            setsockopt(m_sockfd, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (const char*)&size,
+                       sizeof(size));
+            m_gso_size = stride;
+        }
+#endif
+        int err = ::sendto(m_sockfd, bufs + (size_t)i * stride, total, 0, m_saddrcoll.ai_addr,
+                           (socklen_t)m_saddrcoll.ai_addrlen);
+        if (err == SOCKET_ERROR) return sent > 0 ? sent : SOCKET_ERROR;
+        sent += k;
+    }
+    return sent;
+#endif
+}
 int SocketClient::recv(char* buf, int maxlen) const {
     bool is_both_stream =
         m_addrcoll.ai_socktype == SOCK_STREAM && m_saddrcoll.ai_socktype == SOCK_STREAM;
     if (is_both_stream) {
         if (!ensure_addr()) return SOCKET_NOT_PREPARED;
-        int size = ::recv(m_sockfd, buf, maxlen, 0);
+        int size = recv_frame(m_sockfd, buf, maxlen, m_framed);
         return size;
     } else {
         if (!ensure_addr()) return ADDR_NOT_INIT;
@@ -495,15 +1108,17 @@ int SocketClient::connect() const {
 int SocketClient::reconnect(bool force) {
     if (force) close();
     init_socket();
+    m_gso_size = 0;
+    // the new socket starts over
+    if (m_zerocopy) enable_zerocopy(true, m_zerocopy->threshold);
     return connect();
 }
 
 int SocketClient::recv(std::string& str, int maxlen) const {
-    char* _buf = new char[maxlen];
-    int size = recv(_buf, maxlen);
-    str.clear();
-    if (size >= 0) str.append(_buf);
-    delete[] _buf;
+    // received into the string, whose storage is reused if it is large enough
+    str.resize(maxlen);
+    int size = recv(str.data(), maxlen);
+    str.resize(size > 0 ? size : 0);
     return size;
 }
 
@@ -515,12 +1130,22 @@ SocketServer::SocketServer(const SocketServer& r) noexcept
     : BasicSocket(r),
       m_clients(r.m_clients),
       m_pStreamHandlers(r.m_pStreamHandlers),
-      m_max_clients(r.m_max_clients) {}
+      m_max_clients(r.m_max_clients),
+      m_batch_size(r.m_batch_size),
+      m_gro(r.m_gro),
+      m_uring(r.m_uring),
+      m_total_limit(r.m_total_limit),
+      m_peer_rate(r.m_peer_rate) {}
 SocketServer::SocketServer(SocketServer&& r) noexcept
     : BasicSocket(std::move(r)),
       m_clients(std::move(r.m_clients)),
       m_pStreamHandlers(std::move(r.m_pStreamHandlers)),
-      m_max_clients(std::move(r.m_max_clients)) {}
+      m_max_clients(std::move(r.m_max_clients)),
+      m_batch_size(r.m_batch_size),
+      m_gro(r.m_gro),
+      m_uring(r.m_uring),
+      m_total_limit(std::move(r.m_total_limit)),
+      m_peer_rate(r.m_peer_rate) {}
 SocketServer::SocketServer(const BasicSocket& bs) noexcept : BasicSocket(bs) {}
 SocketServer::SocketServer(BasicSocket&& bs) noexcept : BasicSocket(std::move(bs)) {}
 SocketServer::SocketServer(const BasicSocket& bs, int max_clients) noexcept
@@ -529,7 +1154,7 @@ SocketServer::SocketServer(BasicSocket&& r, int max_clients) noexcept
     : BasicSocket(std::move(r)), m_max_clients(max_clients) {}
 
 SocketServer::~SocketServer() {
-    m_serving = false;
+    unserve();
     wait();
 }
 
@@ -555,16 +1180,95 @@ int SocketServer::listen() const {
     }
 }
 
-int SocketServer::stream_serve_thread(const SocketPeer& peer) {
+int SocketServer::enable_gro(bool enable) {
+    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+    if (m_addrcoll.ai_socktype != SOCK_DGRAM) return METHOD_NOT_IMPLEMENTED;
+#ifdef __linux__
+    int flag = enable;
+    int err = setsockopt(m_sockfd, SOL_UDP, UDP_GRO, (const char*)&flag, sizeof(flag));
+    if (err != 0) return METHOD_NOT_IMPLEMENTED;
+    m_gro = enable;
+    return 0;
+#else
+    return enable ? METHOD_NOT_IMPLEMENTED : (m_gro = false, 0);
+#endif
+}
+
+int SocketServer::reuse_port(bool enable) {
+    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+#ifdef SO_REUSEPORT
+    int flag = enable;
+    int err = setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEPORT, (const char*)&flag, sizeof(flag));
+    return err != 0 ? METHOD_NOT_IMPLEMENTED : 0;
+#else
+    // SO_REUSEADDR of Winsock lets a socket take over the port rather than share it
+    return enable ? METHOD_NOT_IMPLEMENTED : 0;
+#endif
+}
+
+int SocketServer::use_uring(bool enable) {
+    if (!enable) return m_uring = false, 0;
+    if (m_addrcoll.ai_socktype != SOCK_DGRAM) return METHOD_NOT_IMPLEMENTED;
+    // probe, the kernel may lack support or forbid it (e.g. kernel.io_uring_disabled)
+    IoRing probe(1);
+    if (!probe.valid()) return METHOD_NOT_IMPLEMENTED;
+    m_uring = true;
+    return 0;
+}
+
+int SocketServer::set_batch_size(int size) {
+    if (size <= 0) return 1;
+    m_batch_size = size;
+    return 0;
+}
+
+int SocketServer::limit_rate(double peer_rate, std::shared_ptr<TokenBucket> total) {
+    LockGuard lock(m_limit_mutex);
+    m_peer_rate = peer_rate;
+    m_total_limit = total;
+    m_peer_limits.clear();
+    return 0;
+}
+
+bool SocketServer::PeerKey::operator<(const PeerKey& other) const {
+    if (len != other.len) return len < other.len;
+    return memcmp(&addr, &other.addr, len) < 0;
+}
+
+std::shared_ptr<TokenBucket> SocketServer::peer_limit(const SocketPeer& peer) const {
+    LockGuard lock(m_limit_mutex);
+    if (m_peer_rate <= 0) return nullptr;
+    auto info = peer.addr_info();
+    if (info.ai_addr == nullptr || info.ai_addrlen > sizeof(sockaddr_storage)) return nullptr;
+    PeerKey key;
+    key.len = info.ai_addrlen;
+    memcpy(&key.addr, info.ai_addr, key.len);
+    auto it = m_peer_limits.find(key);
+    if (it != m_peer_limits.end()) return it->second;
+    if (m_peer_limits.size() >= 1024) {
+        // forget the peers not in debt, they will start again with a full bucket
+        for (auto i = m_peer_limits.begin(); i != m_peer_limits.end();) {
+            if (i->second->delay() == 0) i = m_peer_limits.erase(i);
+            else ++i;
+        }
+    }
+    // datagrams over it are dropped, a window of them in flight shall fit in, or the sender
+    // backs off for losses below the limit
+    auto limit = std::make_shared<TokenBucket>(m_peer_rate, 0.1);
+    m_peer_limits.emplace(key, limit);
+    return limit;
+}
+
+int SocketServer::stream_serve_thread(SocketPeer peer) {
     int err = 0;
     for (auto pHandler : m_pStreamHandlers) {
-        int err = pHandler(peer, *(BasicSocket*)this);
+        err = pHandler(peer, *(BasicSocket*)this);
         if (err == HANDLE_NEXT) continue;
         if (err == HANDLE_END) break;
         // TODO: Shall we just break if error occurs? Or to use promise?
         // Note that this TODO influences:
         // - stream_serve_thread
-        // - message_thread
+        // - dispatch
         if (err == HANDLE_ERROR) break;
         // default break
         break;
@@ -572,154 +1276,425 @@ int SocketServer::stream_serve_thread(const SocketPeer& peer) {
     return err;
 };
 
-int SocketServer::message_thread(char* buf, int len, const SocketPeer& peer) {
+int SocketServer::dispatch(Message& msg, const SocketPeer& peer) {
     int err = 0;
-    for (auto pHandler : m_pMessageHandlers) {
-        int err = pHandler(buf, len, peer, *(BasicSocket*)this);
+    for (auto& pHandler : m_pMessageHandlers) {
+        err = pHandler(msg, peer, *(BasicSocket*)this);
         if (err == HANDLE_NEXT) continue;
         if (err == HANDLE_END) break;
         if (err == HANDLE_ERROR) break;
         break;
     }
-    delete[] buf;
     return err;
 }
 
-int SocketServer::message_stream_thread(int buf_size, const SocketPeer& peer) {
-    int err = 0;
-
-    char* buf_cache = new char[buf_size];
-    // ZeroMemory(buf_cache, buf_size);
+// Messages over a framed stream socket (see `send_frame`) are reassembled from what the socket
+// has whenever it is readable, and until it is framed each receive is a message
+struct SocketServer::PeerStream {
+    sockaddr_storage addr;
+    SocketPeer peer;
+    std::shared_ptr<TokenBucket> limit;
+    std::vector<char> buf;
+    size_t skip = 0;  // the rest of a message exceeding the buffer size, discarded
+
+    PeerStream(SocketServer* server, addrcoll info, SOCKET s) noexcept
+        : addr(), peer(server, keep_addr(info, &addr), s) {}
+
+    // let `info` refer to a copy of its address in `st`
+    static addrcoll& keep_addr(addrcoll& info, sockaddr_storage* st) {
+        memcpy(st, info.ai_addr, info.ai_addrlen);
+        info.ai_addr = (sockaddr*)st;
+        return info;
+    }
+};
 
-    bool is_alive = true;
-    while (is_alive) {
-        int size = peer.recv(buf_cache, buf_size);
-        if (size <= 0) {
-            is_alive = false;
-            continue;
+// Run the handlers of a message on the workers if any
+// A datagram goes to the workers in its pooled buffer, or is copied to one, and the task holds
+// only the index of the buffer, so that nothing is allocated per datagram
+int SocketServer::submit(Message& msg, const SocketPeer& peer,
+                         const std::shared_ptr<PeerStream>& stream) {
+    if (!m_pool) return dispatch(msg, peer);
+
+    bool ok = false;
+    if (!stream && !msg.buf && m_buffers) {
+        PooledBuffer pooled = m_buffers->acquire();
+        if (pooled && sizeof(MessageHead) + msg.len <= pooled.size()) {
+            memcpy(pooled.data() + sizeof(MessageHead), msg.data, msg.len);
+            msg.buf = std::move(pooled);
         }
-
-        UniqueLock lock(m_mutex);
-        if (!m_serving) {
-            is_alive = false;
-            continue;
+    }
+    if (!stream && msg.buf) {
+        MessageHead* head = (MessageHead*)msg.buf.data();
+        head->info = peer.addr_info();
+        memcpy(&head->addr, head->info.ai_addr, head->info.ai_addrlen);
+        head->info.ai_addr = (sockaddr*)&head->addr;
+        head->len = msg.len;
+        uint32_t index = msg.buf.release();
+        ok = m_pool->submit([this, index]() {
+            PooledBuffer buf = m_buffers->adopt(index);
+            MessageHead* head = (MessageHead*)buf.data();
+            SocketPeer peer(this, head->info, INVALID_SOCKET);
+            Message msg{buf.data() + sizeof(MessageHead), head->len, std::move(buf)};
+            dispatch(msg, peer);
+        });
+        if (!ok) msg.buf = m_buffers->adopt(index);  // returned with the message
+    } else {
+        // streams, or the buffers are exhausted
+        struct Copy {
+            std::string data;
+            sockaddr_storage addr;
+            addrcoll info;
         };
-        char* buf = new char[size];
-        memcpy(buf, buf_cache, size);
-        err = message_thread(buf, size, peer);
+        auto copy = std::make_shared<Copy>();
+        copy->data.assign(msg.data, msg.len);
+        if (!stream) {
+            copy->info = peer.addr_info();
+            memcpy(&copy->addr, copy->info.ai_addr, copy->info.ai_addrlen);
+            copy->info.ai_addr = (sockaddr*)&copy->addr;
+        }
+        auto task = [this, copy, stream]() {
+            Message msg{copy->data.data(), (int)copy->data.size(), PooledBuffer()};
+            if (stream) return (void)dispatch(msg, stream->peer);
+            SocketPeer peer(this, copy->info, INVALID_SOCKET);
+            dispatch(msg, peer);
+        };
+        // a stream is never dropped since nothing would be resent, the loop stops reading it
+        // instead and the transport pushes back on the peer
+        ok = stream ? m_pool->submit(task, QueuePolicy::BLOCK) : m_pool->submit(task);
     }
-    // after the process, close the peer
-    peer.close();
-    return err;
+    if (ok) return 0;
+
+    // dropped
+    for (auto& pHandler : m_pDropHandlers) {
+        if (pHandler(msg, peer, *(BasicSocket*)this) != HANDLE_NEXT) break;
+    }
+    return HANDLE_ERROR;
 }
 
-int SocketServer::serve(int buf_size) {
-    {
-        UniqueLock lock(m_mutex);
-        if (m_serving) return ALREADY_SERVING;
-        m_serving = true;
+// join the threads of stream handlers which have finished, `m_mutex` is locked
+void SocketServer::reap_threads() const {
+    for (auto it = m_threads.begin(); it != m_threads.end();) {
+        if (m_finished.erase(it->get_id())) {
+            it->join();
+            it = m_threads.erase(it);
+        } else {
+            ++it;
+        }
     }
+}
 
-    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+int SocketServer::on_accept(int buf_size) {
+    SOCKET client_s = ::accept(socket(), nullptr, nullptr);
+    if (client_s == INVALID_SOCKET) return WATCH_NEXT;
 
-#define noloop_continue \
-    {                   \
-        loop = false;   \
-        continue;       \
-    }
+    addrcoll c_addrcoll = m_addrcoll;
+    c_addrcoll.ai_canonname = nullptr;
+    c_addrcoll.ai_next = nullptr;
+    sockaddr_storage addr_st;
+    socklen_t adr_st_len = sizeof(addr_st);
+    int err = getpeername(client_s, (sockaddr*)&addr_st, &adr_st_len);
+    if (err != 0) return closesocket(client_s), WATCH_NEXT;
+    c_addrcoll.ai_addr = (sockaddr*)&addr_st;
+    c_addrcoll.ai_addrlen = adr_st_len;
 
-    if (m_addrcoll.ai_socktype == SOCK_STREAM) {
-        // serve for stream socket
-        bool loop = true;
-        while (loop) {
-            UniqueLock lock(m_mutex);
-            if (!m_serving) noloop_continue;
+    UniqueLock lock(m_mutex);
+    if (!m_serving || m_loop == nullptr) return closesocket(client_s), WATCH_END;
+    if (buf_size > 0) {
+        // message receiving, on the event loop
+        auto stream = std::make_shared<PeerStream>(this, c_addrcoll, client_s);
+        if (!stream->peer.ensure()) return closesocket(client_s), WATCH_NEXT;
+        stream->limit = peer_limit(stream->peer);
+        m_streams[client_s] = stream;
+        err = m_loop->add(client_s, [this, stream, buf_size](SOCKET) {
+            return on_stream(stream, buf_size);
+        });
+        if (err != 0) m_streams.erase(client_s), closesocket(client_s);
+    } else {
+        // new thread for each client
+        reap_threads();
+        SocketPeer peer(this, &c_addrcoll, client_s);
+        if (!peer.ensure()) return closesocket(client_s), WATCH_NEXT;
+        if (m_pool) {
+            // the stream occupies a worker until its handlers return
             lock.unlock();
-
-            SOCKET client_s = ::accept(socket(), nullptr, nullptr);
-            if (client_s == INVALID_SOCKET) continue;
-
-            addrcoll c_addrcoll = copy_addrinfo(&m_addrcoll);
-            sockaddr_storage addr_st;
-            int adr_st_len = sizeof(addr_st);
-            int err = getpeername(client_s, (sockaddr*)&addr_st, &adr_st_len);
-            if (err != 0) continue;
-            c_addrcoll.ai_addr = (sockaddr*)&addr_st;
-            c_addrcoll.ai_addrlen = adr_st_len;
-            SocketPeer peer(this, &c_addrcoll, client_s);
-            if (!peer.ensure()) continue;
-
-            if (buf_size > 0) {
-                // message receiving
-                lock.lock();
-                if (!m_serving) noloop_continue;
-                lock.unlock();
-
-                m_threads.emplace_back(&SocketServer::message_stream_thread, this, buf_size,
-                                       std::ref(peer));
-            } else {
-                // new thread for each client
-                lock.lock();
-                if (!m_serving) noloop_continue;
-                m_threads.emplace_back(&SocketServer::stream_serve_thread, this, std::ref(peer));
-            }
-            // unlock automatically
+            if (!m_pool->submit([this, peer]() { stream_serve_thread(peer); })) peer.close();
+        } else {
+            m_threads.emplace_back([this, peer]() {
+                stream_serve_thread(peer);
+                LockGuard lock(m_mutex);
+                m_finished.insert(std::this_thread::get_id());
+            });
         }
-    } else if (buf_size > 0) {
-        // serve not for stream socket
-        // message receiving
+    }
+    return WATCH_NEXT;
+}
 
-        char* buf_cache = new char[buf_size];
-        // ZeroMemory(buf_cache, buf_size);
+int SocketServer::on_stream(const std::shared_ptr<PeerStream>& shared_stream, int buf_size) {
+    PeerStream& stream = *shared_stream;
+    char data[16384];
+    int size = ::recv(stream.peer.socket(), data, sizeof(data), 0);
+    if (size <= 0) return close_stream(stream), WATCH_END;
 
-        bool loop = true;
-        sockaddr_storage* addr_cache = new sockaddr_storage;
-        while (loop) {
-            UniqueLock lock(m_mutex);
-            if (!m_serving) noloop_continue;
-            lock.unlock();
+    // rate limits, what is received is handled, and the stream is held back while a bucket is
+    // in debt, the sender will be slowed down by flow control
+    if (stream.limit) stream.limit->consume(size);
+    if (m_total_limit) m_total_limit->consume(size);
+    pause(stream.peer.socket(), limit_delay(stream.limit));
 
-            // receive
-            int addrlen = m_addrcoll.ai_addrlen;
-            ZeroMemory(addr_cache, sizeof(sockaddr_storage));
-            int size =
-                ::recvfrom(m_sockfd, buf_cache, buf_size, 0, (sockaddr*)addr_cache, &addrlen);
-            if (size <= 0) continue;
-            // get peer addrcoll
-            addrcoll c_addrcoll = copy_addrinfo(&m_addrcoll, false);
-            c_addrcoll.ai_addr = (sockaddr*)addr_cache;
-            c_addrcoll.ai_addrlen = addrlen;
-            // create peer
-            SocketPeer peer(this, &c_addrcoll);
-            if (!peer.ensure_addr()) continue;
-
-            lock.lock();
-            if (!m_serving) noloop_continue;
-            char* buf = new char[size];
-            memcpy(buf, buf_cache, size);
-            m_threads.emplace_back(&SocketServer::message_thread, this, buf, size, peer);
-            // unlock automatically
+    if (!stream.peer.framed()) {
+        {
+            LockGuard lock(m_mutex);
+            if (!m_serving) return close_stream(stream), WATCH_END;
         }
+        Message msg{data, std::min(size, buf_size), PooledBuffer()};
+        submit(msg, stream.peer, shared_stream);
+        return WATCH_NEXT;
+    }
 
-        delete[] buf_cache;
+    int skip = std::min((size_t)size, stream.skip);
+    stream.skip -= skip;
+    stream.buf.insert(stream.buf.end(), data + skip, data + size);
+
+    size_t pos = 0;
+    while (stream.buf.size() - pos >= sizeof(uint32_t)) {
+        uint32_t len_net;
+        memcpy(&len_net, stream.buf.data() + pos, sizeof(len_net));
+        size_t len = ntohl(len_net);
+        size_t keep = std::min(len, (size_t)buf_size);
+        if (stream.buf.size() - pos - sizeof(len_net) < keep) break;
+        {
+            LockGuard lock(m_mutex);
+            if (!m_serving) return close_stream(stream), WATCH_END;
+        }
+        Message msg{stream.buf.data() + pos + sizeof(len_net), (int)keep, PooledBuffer()};
+        submit(msg, stream.peer, shared_stream);
+        pos += sizeof(len_net) + keep;
+        // discard the part exceeding the buffer size
+        size_t discard = std::min(len - keep, stream.buf.size() - pos);
+        pos += discard;
+        stream.skip = len - keep - discard;
     }
+    stream.buf.erase(stream.buf.begin(), stream.buf.begin() + pos);
+    return WATCH_NEXT;
+}
 
-#undef noloop_continue
+// Microseconds `limit` or the total limit is in debt for, the larger
+int64_t SocketServer::limit_delay(const std::shared_ptr<TokenBucket>& limit) const {
+    return std::max(limit ? limit->delay() : 0, m_total_limit ? m_total_limit->delay() : 0);
+}
+
+// Stop watching `s` of the handler running for `delay` microseconds, rather than waiting on the
+// loop, so that its threads go on with the other sockets
+void SocketServer::pause(SOCKET s, int64_t delay) const {
+    if (delay <= 0) return;
+    LockGuard lock(m_mutex);
+    if (m_loop) m_loop->pause(s, delay);
+}
 
+void SocketServer::close_stream(PeerStream& stream) const {
+    SOCKET s = stream.peer.socket();
+    {
+        LockGuard lock(m_mutex);
+        // stop watching before the socket is closed, its handle may be reused
+        if (m_loop) m_loop->remove(s);
+        if (m_streams.erase(s) == 0) return;  // closed already
+    }
+    stream.peer.close();
+}
+
+// handle slot i of a batch received, `delay` is raised to the microseconds the total limit is in
+// debt for
+int SocketServer::on_datagram(DatagramBatch& batch, int i, int buf_size, int64_t& delay) {
+    if (batch.lens[i] <= 0) return WATCH_NEXT;
+    // peer, valid while handling
+    addrcoll c_addrcoll = m_addrcoll;
+    c_addrcoll.ai_canonname = nullptr;
+    c_addrcoll.ai_next = nullptr;
+    c_addrcoll.ai_addr = (sockaddr*)&batch.addrs[i];
+    c_addrcoll.ai_addrlen = batch.addrlens[i];
+    SocketPeer peer(this, c_addrcoll, INVALID_SOCKET);
+    if (!peer.ensure_addr()) return WATCH_NEXT;
+    auto limit = peer_limit(peer);
+
+    // split the datagrams coalesced by the kernel, each is a message
+    int seg = batch.segs[i] > 0 ? batch.segs[i] : batch.lens[i];
+    for (int offset = 0; offset < batch.lens[i]; offset += seg) {
+        int size = std::min(seg, batch.lens[i] - offset);
+        if (size > buf_size) size = buf_size;
+
+        // rate limits, a datagram over the limit of its peer is dropped and resent as if lost,
+        // so that the peer holds up no others. The socket is shared, it is paused only while
+        // the total limit is in debt, the datagrams queue up in the kernel meanwhile
+        if (limit && !limit->try_consume(size)) continue;
+        if (m_total_limit) m_total_limit->consume(size);
+
+        {
+            LockGuard lock(m_mutex);
+            if (!m_serving) return WATCH_END;
+        }
+        // a datagram alone in its pooled buffer is handed over with it, the buffer is kept for
+        // the next receive unless taken
+        Message msg{batch.buf(i) + offset, size, PooledBuffer()};
+        if (seg == batch.lens[i]) msg.buf = std::move(batch.owned[i]);
+        submit(msg, peer, nullptr);
+        if (msg.buf) batch.owned[i] = std::move(msg.buf);
+    }
+    delay = std::max(delay, limit_delay(nullptr));
+    return WATCH_NEXT;
+}
+
+int SocketServer::on_datagrams(DatagramBatch& batch, int buf_size) {
+    // receive
+    if (batch.recv(m_sockfd) == SOCKET_ERROR) return WATCH_NEXT;
+    int64_t delay = 0;
+    for (int i = 0; i < batch.count; ++i) {
+        if (on_datagram(batch, i, buf_size, delay) == WATCH_END) return WATCH_END;
+    }
+    pause(m_sockfd, delay);
+    return WATCH_NEXT;
+}
+
+// The ring is readable, handle the receives completed and queue them again, all of them are
+// submitted by one call
+int SocketServer::on_ring(RecvRing& recv_ring, int buf_size) {
+#ifdef __linux__
+    DatagramBatch& batch = recv_ring.batch;
+    std::vector<int>& done = recv_ring.done;
+    done.clear();
+    recv_ring.ring.reap([&batch, &done](uint64_t i, int res) {
+        batch.received(i, res);
+        done.push_back(i);
+    });
+    int64_t delay = 0;
+    for (int i : done) {
+        if (on_datagram(batch, i, buf_size, delay) == WATCH_END) return WATCH_END;
+        batch.arm(i);
+        if (recv_ring.ring.recvmsg(m_sockfd, &batch.msgs[i].msg_hdr, i) != 0)
+            return WATCH_END;
+    }
+    pause(recv_ring.ring.fd(), delay);
+    return recv_ring.ring.submit() == 0 ? WATCH_NEXT : WATCH_END;
+#else
+    return WATCH_END;
+#endif
+}
+
+// The pool for batches to receive into, none if datagrams are coalesced (GRO) or do not fit
+std::shared_ptr<BufferPool> SocketServer::receive_pool(int buf_size) const {
+    if (m_gro || !m_buffers || m_buffers->size() < sizeof(MessageHead) + buf_size) return nullptr;
+    return m_buffers;
+}
+
+// Receive datagrams through a ring, which is watched by the loop instead of the socket
+int SocketServer::serve_ring(EventLoop& loop, int buf_size) {
+#ifdef __linux__
+    // `m_mutex` is locked
+    auto recv_ring = std::make_shared<RecvRing>(m_batch_size, m_gro ? GRO_BUF_SIZE : buf_size,
+                                                receive_pool(buf_size));
+    if (!recv_ring->ring.valid()) return METHOD_NOT_IMPLEMENTED;
+    DatagramBatch& batch = recv_ring->batch;
+    for (int i = 0; i < batch.size; ++i) {
+        batch.arm(i);
+        if (recv_ring->ring.recvmsg(m_sockfd, &batch.msgs[i].msg_hdr, i) != 0)
+            return METHOD_NOT_IMPLEMENTED;
+    }
+    if (recv_ring->ring.submit() != 0) return METHOD_NOT_IMPLEMENTED;
+    int err = loop.add(recv_ring->ring.fd(), [this, recv_ring, buf_size](SOCKET) {
+        return on_ring(*recv_ring, buf_size);
+    });
+    if (err != 0) return err;
+    m_ring = recv_ring;
+    m_loop = &loop;
+    m_serving = true;
+    return 0;
+#else
+    return METHOD_NOT_IMPLEMENTED;
+#endif
+}
+
+int SocketServer::serve(int buf_size) {
     {
         UniqueLock lock(m_mutex);
-        if (m_serving) m_serving = false;
+        if (m_serving) return ALREADY_SERVING;
+        m_own_loop = std::make_unique<EventLoop>();
     }
+    int err = serve(*m_own_loop, buf_size);
+    if (err != 0) return err;
+    return m_own_loop->run();
+}
 
+int SocketServer::serve(EventLoop& loop, int buf_size) {
+    if (!ensure_socket()) return SOCKET_NOT_PREPARED;
+    if (!loop.valid()) return SOCKET_NOT_PREPARED;
+
+    UniqueLock lock(m_mutex);
+    if (m_serving) return ALREADY_SERVING;
+
+    int err = 0;
+    if (m_addrcoll.ai_socktype == SOCK_STREAM) {
+        // serve for stream socket, accept when the listening socket is readable
+        err = loop.add(m_sockfd, [this, buf_size](SOCKET) { return on_accept(buf_size); });
+    } else if (buf_size > 0) {
+        // serve not for stream socket
+        // message receiving, in batches
+        // buffers receiving datagrams and carrying them to the workers, enough for the slots
+        // of the batches and a full queue
+        if (!m_buffers) {
+            uint32_t count = 2 * m_batch_size;
+            if (m_pool) count += m_pool->capacity() + m_pool->workers();
+            m_buffers = std::make_shared<BufferPool>(sizeof(MessageHead) + buf_size, count);
+        }
+        if (m_uring) return serve_ring(loop, buf_size);
+        auto batch = std::make_shared<DatagramBatch>(m_batch_size,
+                                                     m_gro ? GRO_BUF_SIZE : buf_size,
+                                                     receive_pool(buf_size));
+        err = loop.add(m_sockfd, [this, batch, buf_size](SOCKET) {
+            return on_datagrams(*batch, buf_size);
+        });
+    } else {
+        return METHOD_NOT_IMPLEMENTED;
+    }
+    if (err != 0) return err;
+
+    m_loop = &loop;
+    m_serving = true;
     return 0;
 }
 
+// Stop serving, the streams being served are closed
+void SocketServer::unserve() const {
+    std::map<SOCKET, std::shared_ptr<PeerStream>> streams;
+    {
+        LockGuard lock(m_mutex);
+        m_serving = false;
+        if (m_loop) {
+            m_loop->remove(m_sockfd);
+            if (m_ring) m_loop->remove(m_ring->ring.fd());
+            for (auto& [s, stream] : m_streams) m_loop->remove(s);
+            if (m_own_loop) m_own_loop->stop();
+            m_loop = nullptr;
+        }
+        streams.swap(m_streams);
+    }
+    for (auto& [s, stream] : streams) stream->peer.close();
+}
+
 int SocketServer::onmessage(const MessageHandler& pHandler) {
     // if (pHandler == nullptr) return 1;
     m_pMessageHandlers.push_back(pHandler);
     return 0;
 }
 
+int SocketServer::ondrop(const MessageHandler& pHandler) {
+    m_pDropHandlers.push_back(pHandler);
+    return 0;
+}
+
+int SocketServer::use_workers(std::shared_ptr<WorkerPool> pool) {
+    m_pool = pool;
+    return 0;
+}
+
 int SocketServer::onclose(const ServerCloseHandler& pHandler) const {
     // if (pHandler == nullptr) return 1;
     m_pCloseHandlers.push_back(pHandler);
@@ -728,6 +1703,8 @@ int SocketServer::onclose(const ServerCloseHandler& pHandler) const {
 
 int SocketServer::close() const {
     if (!ensure_addr()) return ADDR_NOT_INIT;
+    // cancel serving, before the socket is closed
+    unserve();
     bool is_stream = m_addrcoll.ai_socktype == SOCK_STREAM;
     if (!is_stream) return 0;
     int err = METHOD_NOT_IMPLEMENTED;
@@ -747,11 +1724,6 @@ int SocketServer::close() const {
         err = SOCKET_NOT_PREPARED;
     }
 
-    // closed, cancel serving
-    UniqueLock lock(m_mutex);
-    m_serving = false;  // TODO: use StreamStatus
-    lock.unlock();
-
     return err;
 }
 
@@ -770,9 +1742,7 @@ int SocketServer::end() const {
 }
 
 int SocketServer::destroy() const {
-    UniqueLock lock(m_mutex);
-    m_serving = false;
-    lock.unlock();
+    unserve();
     return BasicSocket::destroy();
 }
 
@@ -858,7 +1828,7 @@ int bind_to_socket(SOCKET s, addrcoll* info) {
 
 bool is_sock_bound(SOCKET s) {
     sockaddr_storage addr;
-    int len = sizeof(addr);
+    socklen_t len = sizeof(addr);
     int err = getsockname(s, (sockaddr*)&addr, &len);
     if (err != 0) return false;
     if (addr.ss_family == AF_INET) {
@@ -871,7 +1841,7 @@ bool is_sock_bound(SOCKET s) {
 
 bool is_peer_bound(SOCKET s) {
     sockaddr_storage addr;
-    int len = sizeof(addr);
+    socklen_t len = sizeof(addr);
     int err = getpeername(s, (sockaddr*)&addr, &len);
     if (err != 0) return false;
     if (addr.ss_family == AF_INET) {
@@ -0,0 +1,93 @@
+#include "protocol.h"
+
+#include <algorithm>
+
+//===--------------------------------------------------===//
+// Binary format
+//===--------------------------------------------------===//
+
+bool is_frame(const char* buf, int len) { return len > 0 && (uint8_t)buf[0] == FRAME_MAGIC; }
+
+int encode_head(char* out, Opcode op, uint64_t session, uint64_t offset, uint32_t length) {
+    out[0] = (char)FRAME_MAGIC;
+    out[1] = (char)op;
+    put_u64(out + 2, session);
+    put_u64(out + 10, offset);
+    put_u32(out + 18, length);
+    return FRAME_HEAD_LEN;
+}
+
+bool decode_head(const char* buf, int len, FrameHead& head) {
+    if (len < FRAME_HEAD_LEN || !is_frame(buf, len)) return false;
+    head.op = (Opcode)buf[1];
+    head.session = get_u64(buf + 2);
+    head.offset = get_u64(buf + 10);
+    head.length = get_u32(buf + 18);
+    return head.length <= (uint32_t)(len - FRAME_HEAD_LEN);
+}
+
+void put_u32(char* out, uint32_t v) {
+    for (int i = 3; i >= 0; --i, v >>= 8) out[i] = (char)(v & 0xff);
+}
+
+uint32_t get_u32(const char* buf) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v = v << 8 | (uint8_t)buf[i];
+    return v;
+}
+
+void put_u64(char* out, uint64_t v) {
+    for (int i = 7; i >= 0; --i, v >>= 8) out[i] = (char)(v & 0xff);
+}
+
+uint64_t get_u64(const char* buf) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = v << 8 | (uint8_t)buf[i];
+    return v;
+}
+
+//===--------------------------------------------------===//
+// Streams
+//===--------------------------------------------------===//
+
+uint64_t range_first(uint64_t chunks, unsigned streams, unsigned i) {
+    // the first `chunks % streams` ranges have a chunk more
+    uint64_t size = chunks / streams, extra = chunks % streams;
+    return i * size + std::min<uint64_t>(i, extra) + 1;
+}
+
+//===--------------------------------------------------===//
+// Resuming
+//===--------------------------------------------------===//
+
+uint64_t file_identity(uint64_t size, int64_t mtime) {
+    // FNV-1a over the bytes of both
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint64_t v : {size, (uint64_t)mtime}) {
+        for (int i = 0; i < 8; ++i, v >>= 8) hash = (hash ^ (v & 0xff)) * 0x100000001b3ull;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+//===--------------------------------------------------===//
+// Sessions
+//===--------------------------------------------------===//
+
+uint64_t session_of_uuid(const char* uuid) {
+    // xxxxxxxx-xxxx-xxxx-CCCC-NNNNNNNNNNNN, the clock sequence and the node
+    uint64_t session = 0;
+    for (int i = 19; i < UUID_LEN; ++i) {
+        if (i == 23) {
+            if (uuid[i] != '-') return 0;
+            continue;
+        }
+        char c = uuid[i];
+        int digit = c >= '0' && c <= '9'   ? c - '0'
+                    : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                    : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                           : -1;
+        if (digit < 0) return 0;
+        session = session << 4 | digit;
+    }
+    return session;
+}
@@ -0,0 +1,43 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+
+//===--------------------------------------------------===//
+// class TokenBucket
+//===--------------------------------------------------===//
+
+TokenBucket::TokenBucket(double rate, double burst) noexcept
+    : m_rate(rate), m_capacity(rate * burst), m_tokens(rate * burst), m_last(clock::now()) {}
+
+void TokenBucket::refill() {
+    auto now = clock::now();
+    double elapsed = std::chrono::duration<double>(now - m_last).count();
+    m_last = now;
+    m_tokens = std::min(m_tokens + elapsed * m_rate, m_capacity);
+}
+
+int64_t TokenBucket::delay() {
+    if (!limited()) return 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    refill();
+    return m_tokens >= 0 ? 0 : (int64_t)(-m_tokens / m_rate * 1000000) + 1;
+}
+
+void TokenBucket::consume(size_t bytes) {
+    if (!limited()) return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    refill();
+    m_tokens -= bytes;
+}
+
+bool TokenBucket::try_consume(size_t bytes) {
+    if (!limited()) return true;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    refill();
+    if (m_tokens < 0) return false;
+    m_tokens -= bytes;
+    return true;
+}
+
+bool TokenBucket::limited() const { return m_rate > 0; }
+double TokenBucket::rate() const { return m_rate; }
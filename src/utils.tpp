@@ -1,4 +1,5 @@
 #include <chrono>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
 #include <random>
@@ -15,10 +16,10 @@ std::string join_string(T first, Args... args) {
     return oss.str();
 }
 
-std::string fmt_size(u_long size) {
+std::string fmt_size(uint64_t size) {
     std::string unit[] = {"B", "KB", "MB", "GB", "TB"};
     int i = 0;
-    u_long s = size;
+    uint64_t s = size;
     int p = 0;
     while (s >= 1024 && i < 4) {
         p = s % 1024 * 100 / 1024 % 100;
@@ -32,6 +33,35 @@ std::string fmt_size(u_long size) {
     return num_str + " " + unit[i];
 }
 
+// Parse a size like "512", "64K", "10M" or "1GB" (in 1024), returns -1 if invalid
+long long parse_size(const std::string& str) {
+    size_t pos = 0;
+    long long num;
+    try {
+        num = std::stoll(str, &pos);
+    } catch (...) {
+        return -1;
+    }
+    if (num < 0) return -1;
+    std::string unit = str.substr(pos);
+    if (!unit.empty() && (unit.back() == 'B' || unit.back() == 'b')) unit.pop_back();
+    if (unit.size() > 1) return -1;
+    if (unit.empty()) return num;
+    switch (unit[0]) {
+        case 'k':
+        case 'K':
+            return num << 10;
+        case 'm':
+        case 'M':
+            return num << 20;
+        case 'g':
+        case 'G':
+            return num << 30;
+        default:
+            return -1;
+    }
+}
+
 std::string uuid_v1() {
     static std::mt19937_64 rng(std::random_device{}());
     static std::uniform_int_distribution<uint64_t> dist(0, (1ULL << 48) - 1);
@@ -75,6 +105,9 @@ class Timer {
     static int duration(time_point_highclock start, time_point_highclock end) {
         return std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
     }
+    static long long duration_us(time_point_highclock start, time_point_highclock end) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    }
     static int sleep(int milliseconds);
 };
 
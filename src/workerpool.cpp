@@ -0,0 +1,99 @@
+#include "workerpool.h"
+
+#include <algorithm>
+
+typedef std::unique_lock<std::mutex> UniqueLock;
+
+//===--------------------------------------------------===//
+// class WorkerPool
+//===--------------------------------------------------===//
+
+WorkerPool::WorkerPool(int workers, size_t capacity, QueuePolicy policy) noexcept
+    : m_capacity(std::max(capacity, (size_t)1)), m_policy(policy), m_queue(m_capacity) {
+    for (int i = 0; i < std::max(workers, 1); ++i) m_threads.emplace_back(&WorkerPool::work, this);
+}
+
+WorkerPool::~WorkerPool() { stop(); }
+
+void WorkerPool::work() {
+    UniqueLock lock(m_mutex);
+    while (true) {
+        m_cv_task.wait(lock, [this] { return m_depth > 0 || !m_running; });
+        if (m_depth == 0) break;  // stopped
+        Item item = std::move(m_queue[m_front]);
+        m_queue[m_front].task = nullptr;
+        m_front = (m_front + 1) % m_capacity;
+        --m_depth;
+        int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() -
+                                                                             item.time)
+                           .count();
+        ++m_waited;
+        m_tot_wait += wait;
+        m_stats.max_wait = std::max(m_stats.max_wait, wait);
+        m_cv_space.notify_one();
+        lock.unlock();
+        item.task();
+        lock.lock();
+    }
+}
+
+bool WorkerPool::submit(Task task) { return submit(std::move(task), m_policy); }
+
+bool WorkerPool::submit(Task task, QueuePolicy policy) {
+    UniqueLock lock(m_mutex);
+    if (policy == QueuePolicy::BLOCK) {
+        m_cv_space.wait(lock, [this] { return m_depth < m_capacity || !m_running; });
+    }
+    if (!m_running || m_depth >= m_capacity) {
+        ++m_stats.dropped;
+        return false;
+    }
+    m_queue[(m_front + m_depth) % m_capacity] = {std::move(task), clock::now()};
+    ++m_depth;
+    ++m_stats.submitted;
+    m_stats.max_depth = std::max(m_stats.max_depth, m_depth);
+    m_cv_task.notify_one();
+    return true;
+}
+
+int WorkerPool::stop() {
+    {
+        UniqueLock lock(m_mutex);
+        m_running = false;
+    }
+    m_cv_task.notify_all();
+    m_cv_space.notify_all();
+    for (auto& t : m_threads) {
+        if (t.joinable() && t.get_id() != std::this_thread::get_id()) t.join();
+    }
+    return 0;
+}
+
+size_t WorkerPool::workers() const { return m_threads.size(); }
+size_t WorkerPool::capacity() const { return m_capacity; }
+QueuePolicy WorkerPool::policy() const { return m_policy; }
+
+WorkerStats WorkerPool::stats(bool reset) {
+    UniqueLock lock(m_mutex);
+    WorkerStats stats = m_stats;
+    stats.depth = m_depth;
+    stats.avg_wait = m_waited > 0 ? m_tot_wait / (int64_t)m_waited : 0;
+    if (reset) {
+        m_stats.max_depth = m_depth;
+        m_stats.max_wait = 0;
+        m_waited = 0;
+        m_tot_wait = 0;
+    }
+    return stats;
+}
+
+const char* queue_policy_name(QueuePolicy policy) {
+    switch (policy) {
+        case QueuePolicy::DROP:
+            return "drop";
+        case QueuePolicy::BLOCK:
+            return "block";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,186 @@
+#include "platform.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <new>
+#include <thread>
+
+// the handlers of the server, as they run in it, without its entry
+#define main transf_server_main
+#include "../transf_server.cpp"
+#undef main
+
+// Heap allocations of the server while it receives a file, none is expected per chunk, either
+// handled on the loop or on the workers, and either received by calls or through a ring. Every
+// chunk goes through the handlers of the server, which write it and acknowledge it
+// Usage: make test
+
+#define PORT 3091
+#define CHUNK_SIZE 1024
+#define WARMUP 4096
+#define CHUNKS 16384
+#define ROUND 16    // chunks sent before waiting for their replies
+#define WINDOW 32   // of the transfer, a round fits in
+#define RETRIES 8   // rounds sent again before giving up
+#define FILE_NAME "alloc-test.bin"
+
+std::atomic<uint64_t> allocations{0};
+
+// the operators below pair malloc and free, which gcc takes for a mismatch once they are inlined
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// Start a transfer of `size` bytes in frames, returns false if it is not accepted
+bool handshake(SOCKET s, uint64_t size, uint64_t& session) {
+    const int LEN_FIELDS = 3 * sizeof(uint32_t) + sizeof(uint64_t);
+    const int LEN_NAME = strlen(FILE_NAME);
+    char buf[FRAME_HEAD_LEN + LEN_FIELDS + sizeof(FILE_NAME)];
+    encode_head(buf, Opcode::HS, 0, size, LEN_FIELDS + LEN_NAME);
+    char* body = buf + FRAME_HEAD_LEN;
+    put_u32(body, WINDOW);
+    put_u32(body + sizeof(uint32_t), CHUNK_SIZE);
+    put_u32(body + 2 * sizeof(uint32_t), 1);  // stream
+    put_u64(body + 3 * sizeof(uint32_t), 0);  // identity, not resumed
+    memcpy(body + LEN_FIELDS, FILE_NAME, LEN_NAME);
+    for (int i = 0; i < RETRIES; ++i) {
+        ::send(s, buf, FRAME_HEAD_LEN + LEN_FIELDS + LEN_NAME, 0);
+        char reply[256];
+        int n = ::recv(s, reply, sizeof(reply), 0);
+        FrameHead frame;
+        if (n <= 0 || !decode_head(reply, n, frame)) continue;
+        if (frame.op != Opcode::OK) return false;
+        session = frame.session;
+        return true;
+    }
+    return false;
+}
+
+// Send chunks [first, last] in rounds, each waited for until the server has received it
+// A round is sent again from the first chunk missing if its replies do not come in time
+bool send_chunks(SOCKET s, uint64_t session, uint64_t first, uint64_t last) {
+    char buf[FRAME_HEAD_LEN + CHUNK_SIZE] = {0};
+    uint64_t next = first;  // the next chunk expected by the server
+    for (int retries = 0; next <= last;) {
+        uint64_t end = std::min<uint64_t>(next + ROUND - 1, last);
+        for (uint64_t chunk = next; chunk <= end; ++chunk) {
+            encode_head(buf, Opcode::TRANSFER, session, (chunk - 1) * CHUNK_SIZE, CHUNK_SIZE);
+            ::send(s, buf, sizeof(buf), 0);
+        }
+        // the replies name the next chunk expected
+        while (next <= end) {
+            char reply[256];
+            int n = ::recv(s, reply, sizeof(reply), 0);
+            if (n <= 0) break;
+            FrameHead frame;
+            if (!decode_head(reply, n, frame) || frame.session != session) continue;
+            if (frame.op != Opcode::RECEIVED && frame.op != Opcode::DONE) return false;
+            next = std::max<uint64_t>(next, frame.offset / CHUNK_SIZE + 1);
+        }
+        if (next <= end && ++retries > RETRIES) return false;
+    }
+    return true;
+}
+
+// Returns the allocations per chunk, -1 if the file is not received, or -2 if the ring is not
+// available
+double run(int port, int workers, bool uring) {
+    addrhint hints = udp_hints(4);
+    addrcoll* paddr = nullptr;
+    if (ip_addrcoll("127.0.0.1", port, &hints, &paddr) != 0) return -1;
+    SocketServer server{BasicSocket(paddr)};
+    FreeAddrInfo(paddr);
+    if (server.init_socket() != 0 || server.bind_address() != 0) return -1;
+    if (uring && server.use_uring() != 0) return -2;
+    server.onmessage(&handle_hello);
+    server.onmessage(&handle_file_transfer);
+    worker_pool = nullptr;
+    if (workers > 0) {
+        worker_pool = std::make_shared<WorkerPool>(workers, 1024, QueuePolicy::BLOCK);
+        server.use_workers(worker_pool);
+    }
+    EventLoop loop;
+    if (server.serve(loop, FRAME_HEAD_LEN + CHUNK_SIZE) != 0) return -1;
+    std::thread thread(&EventLoop::run, &loop);
+
+    SOCKET s = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr;
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    ::connect(s, (const sockaddr*)&addr, sizeof(addr));
+    set_socket_timeout(s, SO_RCVTIMEO, 1000);
+
+    // buffers, queues and the transfer grow to their working size first, and the last round
+    // completes the file
+    const uint64_t LAST = WARMUP + CHUNKS + ROUND;
+    double result = -1;
+    uint64_t session = 0;
+    if (handshake(s, LAST * CHUNK_SIZE, session) && send_chunks(s, session, 1, WARMUP)) {
+        uint64_t before = allocations;
+        bool ok = send_chunks(s, session, WARMUP + 1, WARMUP + CHUNKS);
+        uint64_t after = allocations;
+        if (ok && send_chunks(s, session, WARMUP + CHUNKS + 1, LAST))
+            result = double(after - before) / CHUNKS;
+    }
+
+    closesocket(s);
+    server.destroy();
+    loop.stop();
+    thread.join();
+    if (worker_pool != nullptr) worker_pool->stop();
+    worker_pool = nullptr;
+    std::error_code ec;
+    auto fp = std::filesystem::path(opt_abs_save_path) / FILE_NAME;
+    if (std::filesystem::file_size(fp, ec) != LAST * CHUNK_SIZE) result = -1;
+    std::filesystem::remove(fp, ec);
+    return result;
+}
+
+int main() {
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) return 1;
+    logger.set_level(Logger::Level::WARN);
+    opt_abs_save_path = (std::filesystem::temp_directory_path() / "transf-alloc-test").string();
+    int failed = 0;
+    // a port for each run, the socket of a ring is released by the kernel in background
+    int port = PORT;
+    for (bool uring : {false, true}) {
+        for (int workers : {0, 2}) {
+            const char* engine = uring ? "uring" : "poll";
+            double per_chunk = run(port++, workers, uring);
+            if (per_chunk == -2) {
+                printf("%s, workers %d: not available\n", engine, workers);
+            } else if (per_chunk < 0) {
+                printf("%s, workers %d: file not received\n", engine, workers);
+                ++failed;
+            } else {
+                printf("%s, workers %d: %.4f allocations per chunk\n", engine, workers,
+                       per_chunk);
+                if (per_chunk > 0) ++failed;
+            }
+        }
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(opt_abs_save_path, ec);
+    WSACleanup();
+    printf(failed == 0 ? "PASS\n" : "FAIL\n");
+    return failed == 0 ? 0 : 1;
+}
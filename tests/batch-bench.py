@@ -0,0 +1,82 @@
+import filecmp
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+# Loopback benchmark of batched datagram sending and receiving
+# Usage: python batch-bench.py [size_mb] [batch sizes...]
+# e.g.   python batch-bench.py 64 1 16 64
+
+host = "127.0.0.1"
+port = 3081
+CHUNK = 2048
+FRAME_HEAD_LEN = 22  # see protocol.h
+LEN_CHECKSUMS = 2 * 4
+TIMEOUT = 120
+
+size_mb = 32
+batches = [1, 16, 64]
+
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+ext = ".exe" if os.name == "nt" else ""
+server_bin = os.path.join(root, "transf_server" + ext)
+client_bin = os.path.join(root, "transf_client" + ext)
+
+
+def parse_args():
+    global size_mb, batches
+    if len(sys.argv) >= 2:
+        size_mb = int(sys.argv[1])
+    if len(sys.argv) >= 3:
+        batches = [int(b) for b in sys.argv[2:]]
+
+
+def run(workdir, src, batch):
+    save_dir = os.path.join(workdir, "received-" + str(batch))
+    server = subprocess.Popen(
+        [server_bin, host, str(port), "-d", save_dir, "--chunk", str(CHUNK), "--batch", str(batch)],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+    try:
+        time.sleep(0.5)
+        start = time.perf_counter()
+        subprocess.run(
+            [client_bin, host, str(port), "--chunk", str(CHUNK), "--batch", str(batch)],
+            input=(src + "\n@exit\n").encode(),
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            timeout=TIMEOUT,
+        )
+        elapsed = time.perf_counter() - start
+    finally:
+        server.kill()
+        server.wait()
+    ok = filecmp.cmp(src, os.path.join(save_dir, os.path.basename(src)), shallow=False)
+    return elapsed, ok
+
+
+if __name__ == "__main__":
+
+    parse_args()
+
+    with tempfile.TemporaryDirectory() as workdir:
+        src = os.path.join(workdir, "bench.bin")
+        with open(src, "wb") as f:
+            # a megabyte at a time, randbytes takes no more than 2^31 bits at once
+            for _ in range(size_mb):
+                f.write(random.randbytes(1 << 20))
+        # chunks carry a frame head, and the CRCs of the chunk and of its range
+        payload = CHUNK - FRAME_HEAD_LEN - LEN_CHECKSUMS
+        chunks = ((size_mb << 20) + payload - 1) // payload
+
+        print("%8s %10s %12s %10s" % ("batch", "time (s)", "packets/s", "MB/s"))
+        for batch in batches:
+            elapsed, ok = run(workdir, src, batch)
+            print(
+                "%8d %10.3f %12.0f %10.2f%s"
+                % (batch, elapsed, chunks / elapsed, size_mb / elapsed, "" if ok else "  (mismatch)")
+            )
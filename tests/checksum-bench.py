@@ -0,0 +1,95 @@
+import filecmp
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+# Loopback benchmark of the chunk checksums, the same file sent with and without them
+# Usage: python checksum-bench.py [size_mb] [rounds] [protocol]
+# e.g.   python checksum-bench.py 256 5 tcp
+# The best time of the rounds is taken, the checksums shall cost less than 5% of the throughput
+
+host = "127.0.0.1"
+# a port for each run from here, that of a stream socket closed lingers for a while
+port = random.randrange(20000, 40000, 100)
+CHUNK = 8192
+TIMEOUT = 120
+LIMIT = 5.0  # percent
+
+size_mb = 64
+rounds = 3
+protocol = "udp"
+
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+ext = ".exe" if os.name == "nt" else ""
+server_bin = os.path.join(root, "transf_server" + ext)
+client_bin = os.path.join(root, "transf_client" + ext)
+
+
+def parse_args():
+    global size_mb, rounds, protocol
+    if len(sys.argv) >= 2:
+        size_mb = int(sys.argv[1])
+    if len(sys.argv) >= 3:
+        rounds = int(sys.argv[2])
+    if len(sys.argv) >= 4:
+        protocol = sys.argv[3]
+
+
+def run(workdir, src, options, port):
+    save_dir = os.path.join(workdir, "received")
+    server = subprocess.Popen(
+        [server_bin, host, str(port), "-d", save_dir, "--protocol", protocol, "--chunk",
+         str(CHUNK)],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+    try:
+        time.sleep(0.5)
+        start = time.perf_counter()
+        subprocess.run(
+            [client_bin, host, str(port), "--protocol", protocol, "--chunk", str(CHUNK)] + options,
+            input=(src + "\n@exit\n").encode(),
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            timeout=TIMEOUT,
+        )
+        elapsed = time.perf_counter() - start
+    finally:
+        server.kill()
+        server.wait()
+    dst = os.path.join(save_dir, os.path.basename(src))
+    ok = os.path.exists(dst) and filecmp.cmp(src, dst, shallow=False)
+    if os.path.exists(dst):
+        os.remove(dst)
+    return elapsed, ok
+
+
+if __name__ == "__main__":
+
+    parse_args()
+
+    with tempfile.TemporaryDirectory() as workdir:
+        src = os.path.join(workdir, "bench.bin")
+        with open(src, "wb") as f:
+            for _ in range(size_mb):
+                f.write(random.randbytes(1 << 20))
+
+        modes = [("off", ["--no-checksum"]), ("crc32c", [])]
+        best = {}
+        print("%8s %10s %10s" % ("checksum", "time (s)", "MB/s"))
+        # the modes take turns, so that both see the same state of the host
+        for i in range(rounds):
+            for j, (name, options) in enumerate(modes):
+                elapsed, ok = run(workdir, src, options, port + i * len(modes) + j)
+                if not ok:
+                    print("%8s  (mismatch)" % name)
+                    sys.exit(1)
+                best[name] = min(best.get(name, elapsed), elapsed)
+        for name, _ in modes:
+            print("%8s %10.3f %10.2f" % (name, best[name], size_mb / best[name]))
+        cost = (best["crc32c"] - best["off"]) / best["off"] * 100
+        print("cost %.2f%% of the throughput (limit %.0f%%)" % (cost, LIMIT))
+        sys.exit(0 if cost < LIMIT else 1)
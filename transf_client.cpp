@@ -1,12 +1,15 @@
-#include <WS2tcpip.h>
-#include <psdk_inc/_socket_types.h>
-#include <winsock2.h>
-#include <ws2ipdef.h>
+#include "platform.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
-#include <fstream>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 // wingdi.h has defined `ERROR` macro, which is conflicting with enum `Level::ERROR`
 #ifdef ERROR
@@ -14,12 +17,20 @@
 #endif
 #include "ansi.h"
 #include "arguments.h"
+#include "checksum.h"
+#include "chunkindex.h"
+#include "compress.h"
+#include "congestion.h"
+#include "delta.h"
+#include "fec.h"
 #include "logger.h"
 #include "network.h"
+#include "protocol.h"
 #include "utils.h"
 
 #ifdef _MSC_VER
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
 #endif
 
 Logger logger("Tranf Client");
@@ -38,28 +49,74 @@ std::string trim(const std::string& str) {
     return str.substr(first, (last - first + 1));
 }
 
-int opt_chunk_size = 2048;
+int opt_chunk_size = 0;  // fits the path MTU if 0
+int opt_window_size = 16;
+int opt_batch_size = 16;
+int opt_timeout_recv = 10000;
+int opt_timeout_send = 10000;
+int opt_streams = 1;
+CongestionMode opt_congestion = CongestionMode::AIMD;
+long long opt_rate = 0;
+bool opt_sendfile = false;
+bool opt_gso = false;
+bool opt_zerocopy = false;
+bool opt_delta = false;
+bool opt_dedup = false;
+bool opt_compress = false;
+bool opt_checksum = true;
+int opt_fec_data = 0;  // chunks of a group with parities, 0 if there are none
+int opt_fec_parity = 0;
+ReadMode opt_read_mode = ReadMode::AHEAD;
+uint32_t opt_caps = CAPS_SUPPORTED;
 
-#define UUID_LEN 36
-
-#define HEAD_HELLO "\013HELLO"
-#define HEAD_HS "\013HS"
-#define HEAD_TRANSFER "\013TRANSFER"
-#define HEAD_OK "\013OK"
-#define HEAD_RECEIVED "\013RECEIVED"
-#define HEAD_DONE "\013DONE"
-#define HEAD_REJECT "\013REJECT"
-#define HEAD_DROP "\013DROP"
-
-#define headcmp(buf, head) (memcmp(buf, head, strlen(head)) == 0)
+// capabilities supported by both, told by the server on hello
+uint32_t server_caps = 0;
+// the largest message the server receives, told on hello, 0 if it is not told
+int server_max_chunk = 0;
+// milliseconds the last hello has taken to be replied
+int hello_rtt = 0;
 
 int handle_hello(SocketClient& remote, char* buf, int buf_size) {
-    // Hello
-    int err = remote.send(HEAD_HELLO);
+    // Hello, with the capabilities we support
+    int LEN_HEAD = strlen(HEAD_HELLO);
+    memcpy(buf, HEAD_HELLO, LEN_HEAD);
+    put_u32(buf + LEN_HEAD, opt_caps);
+    auto start = Timer::point();
+    int err = remote.send(buf, LEN_HEAD + sizeof(uint32_t));
     if (err == SOCKET_ERROR) return -1;
     logger.debug("Hello sent");
-    int size = remote.recv(buf, buf_size);
+    // replies to a previous transfer may be left, e.g. when another stream has seen it done
+    // first, they are all frames while the hello is replied in text
+    int size = 0;
+    do {
+        size = remote.recv(buf, buf_size);
+    } while (size > 0 && is_frame(buf, size));
     if (size <= 0) return -1;
+    hello_rtt = Timer::duration(start, Timer::point());
+    // a server knowing the text format only replies a bare hello
+    server_caps = 0;
+    server_max_chunk = 0;
+    if (size >= LEN_HEAD + (int)sizeof(uint32_t) && headcmp(buf, HEAD_HELLO))
+        server_caps = get_u32(buf + LEN_HEAD) & opt_caps;
+    if (size >= LEN_HEAD + 2 * (int)sizeof(uint32_t) && headcmp(buf, HEAD_HELLO))
+        server_max_chunk = get_u32(buf + LEN_HEAD + sizeof(uint32_t));
+    // the server frames the stream from the message after the reply
+    if (server_caps & CAP_FRAMING) remote.set_framed();
+    return 0;
+}
+
+// Frame the socket of another stream as the first one, which a hello of its own tells the server
+// Returns nonzero if failed
+int frame_stream(SocketClient& stream) {
+    char buf[64];
+    int LEN_HEAD = strlen(HEAD_HELLO);
+    memcpy(buf, HEAD_HELLO, LEN_HEAD);
+    put_u32(buf + LEN_HEAD, server_caps);
+    if (stream.send(buf, LEN_HEAD + sizeof(uint32_t)) == SOCKET_ERROR) return 1;
+    int size = stream.recv(buf, sizeof(buf));
+    if (size < LEN_HEAD + (int)sizeof(uint32_t) || !headcmp(buf, HEAD_HELLO)) return 1;
+    if (!(get_u32(buf + LEN_HEAD) & CAP_FRAMING)) return 1;
+    stream.set_framed();
     return 0;
 }
 
@@ -67,7 +124,7 @@ bool check_alive(SocketClient& remote, char* buf, int buf_size, int retry = 1,
                  bool do_print = false) {
     for (int i = 0; i <= retry; i++) {
         auto level = logger.get_level();
-        std::string progress = "(" + std::to_string(i) + "/" + std::to_string(retry) + ")";
+        std::string progress = join_string("(", i, "/", retry, ")");
         if (do_print && level > Logger::Level::DEBUG && i > 0) {
             std::string tip = "Reconnecting " + progress;
             if (i > 1) tip = ansi::cursor_prev_line(1) + ansi::clear_line + tip;
@@ -78,7 +135,7 @@ bool check_alive(SocketClient& remote, char* buf, int buf_size, int retry = 1,
 
         if (i > 0) remote.reconnect();
 
-        int err = handle_hello(remote, buf, opt_chunk_size);
+        int err = handle_hello(remote, buf, buf_size);
         if (err == 0) {
             if (do_print && level > Logger::Level::DEBUG && i > 0) {
                 logger.instant(ansi::cursor_prev_line(1) + ansi::clear_line);
@@ -94,117 +151,957 @@ bool check_alive(SocketClient& remote, char* buf, int buf_size, int retry = 1,
     return false;
 }
 
+#define CHUNK_DEFAULT 2048  // the chunk size of stream sockets, and of a server not telling its own
+#define PROBE_TRIES 2
+#define PROBE_TIMEOUT_MIN 50       // ms
+#define PROBE_RAISE_INTERVAL 600   // s, sizes above the one found are probed again after it
+#define LEN_UDP_HEAD 8
+
+// MTUs common on the way, the chunk sizes probed are the datagrams of them (RFC 1191)
+const int COMMON_MTUS[] = {9000, 4352, 1500, 1492, 1480, 1460, 1400, 1280, 576};
+
+// the chunk size found by probing the path
+struct PathProbe {
+    int chunk_size = 0;  // 0 if the path is not probed yet
+    int ceiling = 0;     // the largest size it is probed up to
+    time_point_highclock raised;  // when sizes above the one found were probed
+} path_probe;
+
+// Send a hello padded to `size` bytes which must not be fragmented
+// Returns 1 if it is replied within `timeout` (ms), 0 if not, or -1 if the kernel refuses it
+int probe_size(SocketClient& remote, char* buf, int buf_size, int size, int timeout) {
+    int LEN_HEAD = strlen(HEAD_HELLO);
+    for (int i = 0; i < PROBE_TRIES; ++i) {
+        memcpy(buf, HEAD_HELLO, LEN_HEAD);
+        put_u32(buf + LEN_HEAD, opt_caps);
+        memset(buf + LEN_HEAD + sizeof(uint32_t), 0, size - LEN_HEAD - sizeof(uint32_t));
+        if (remote.send(buf, size) == SOCKET_ERROR) return -1;
+        auto start = Timer::point();
+        int left = timeout;
+        while (left > 0 && remote.readable(left) > 0) {
+            int len = remote.recv(buf, buf_size);
+            if (len <= 0) return -1;
+            // replies to a previous transfer are frames, and those of larger probes are fine too
+            if (!is_frame(buf, len) && headcmp(buf, HEAD_HELLO)) return 1;
+            left = timeout - Timer::duration(start, Timer::point());
+        }
+    }
+    return 0;
+}
+
+// The chunk size of the next file on `remote`, as given by --chunk, or otherwise the largest
+// datagram that reaches the server unfragmented, up to the largest message the server receives.
+// It is probed before each file from the size found last, which follows the path as it shrinks,
+// and from the largest size once in a while, as the path may have grown (RFC 8899)
+int chunk_size_of(SocketClient& remote, char* buf, int buf_size) {
+    if (opt_chunk_size > 0) return opt_chunk_size;
+    int ceiling = std::min(server_max_chunk > 0 ? server_max_chunk : CHUNK_DEFAULT, buf_size);
+    auto info = remote.addr_info();
+    if (info.ai_socktype != SOCK_DGRAM) return std::min(ceiling, CHUNK_DEFAULT);
+
+    // the headers of IP and UDP take the rest of the MTU, and every path carries the minimum
+    int LEN_IP_HEAD = (info.ai_family == AF_INET6 ? 40 : 20) + LEN_UDP_HEAD;
+    int MIN_MTU = info.ai_family == AF_INET6 ? 1280 : 576;
+    int least = std::min(MIN_MTU - LEN_IP_HEAD, ceiling);
+    std::vector<int> sizes{ceiling};
+    for (int mtu : COMMON_MTUS) {
+        if (mtu - LEN_IP_HEAD < ceiling && mtu - LEN_IP_HEAD > least)
+            sizes.push_back(mtu - LEN_IP_HEAD);
+    }
+    if (remote.set_dont_fragment(true) != 0) {
+        // the kernel fragments the probes, the MTU of Ethernet is likely
+        return std::min(ceiling, std::max(1500 - LEN_IP_HEAD, least));
+    }
+
+    auto now = Timer::point();
+    size_t i = 0;
+    if (path_probe.chunk_size > 0 && path_probe.ceiling == ceiling &&
+        Timer::duration(path_probe.raised, now) < PROBE_RAISE_INTERVAL * 1000) {
+        while (i < sizes.size() && sizes[i] > path_probe.chunk_size) ++i;
+    } else {
+        path_probe.raised = now;
+    }
+    int timeout = std::clamp(4 * hello_rtt, PROBE_TIMEOUT_MIN, opt_timeout_recv);
+    int found = least;
+    bool unreplied = false;
+    for (; i < sizes.size(); ++i) {
+        int probed = probe_size(remote, buf, buf_size, sizes[i], timeout);
+        if (probed > 0) {
+            found = sizes[i];
+            break;
+        }
+        unreplied = unreplied || probed == 0;
+    }
+    remote.set_dont_fragment(false);
+    // a reply late to a probe is taken for that of the handshake otherwise
+    while (unreplied && remote.readable(timeout) > 0 && remote.recv(buf, buf_size) > 0) continue;
+
+    if (found != path_probe.chunk_size) logger.debug("Chunk size fitting the path: ", found);
+    path_probe.chunk_size = found;
+    path_probe.ceiling = ceiling;
+    return found;
+}
+
+// A file being sent, as negotiated with the server. Its chunks are split into a range for each
+// stream, and each stream sends its range on a socket of its own
+struct Transfer {
+    std::string fp;
+    uint64_t file_size = 0;
+    bool is_frame = false;
+    bool compress = false;  // chunks are compressed if they shrink
+    bool checksum = false;  // chunks carry CRCs, see CAP_CHECKSUM
+    // groups of chunks are followed by parities, see CAP_FEC, 0 if there are none
+    int fec_data = 0;
+    int fec_parity = 0;
+    std::string uuid;      // names the transfer in text messages
+    uint64_t session = 0;  // in frames
+    uint32_t window = 1;
+    unsigned streams = 1;
+    int buf_size = 0;
+    int len_chunk_head = 0;
+    int len_parity_head = 0;
+    uint32_t send_buf_size = 0;  // data of a full chunk
+    uint64_t tot_chunk = 0;          // to send
+    std::vector<ChunkRange> ranges;  // to send, listed by the server on handshake
+    // progress of all the streams
+    std::atomic<uint64_t> acked{0};
+    std::atomic<bool> done{false};    // the server has received the whole file
+    std::atomic<bool> failed{false};  // a stream has failed, the others give up
+    // data of the chunks read, and their bodies as sent, retransmissions aside
+    std::atomic<uint64_t> raw_bytes{0};
+    std::atomic<uint64_t> wire_bytes{0};
+    uint64_t last_rate = 0;
+    std::mutex print_mutex;
+};
+
+// Print the progress of all the streams, once it changes
+void print_progress(Transfer& t) {
+    LockGuard lock(t.print_mutex);
+    const std::string ANSI_PREV_LINE =
+        ansi::clear_line + ansi::cursor_prev_line(1) + ansi::clear_line;
+    uint64_t acked = t.acked;
+    uint64_t rate = acked >= t.tot_chunk ? 100 : acked * 100 / t.tot_chunk;
+    if (acked != 0 && t.last_rate == rate) return;
+    t.last_rate = rate;
+    logger.print(acked == 0 ? "" : ANSI_PREV_LINE, ansi::rgb_fg(0, 0, 139), "  Sending (", rate,
+                 "%)", ansi::reset);
+}
+
+void print_fail(const std::string& fp) {
+    const bool IS_DEBUG = logger.get_level() <= Logger::Level::DEBUG;
+    logger.print(IS_DEBUG ? ""
+                          : ansi::clear_line + ansi::cursor_prev_line(1) +
+                                ansi::cursor_pos_x(fp.size() + 6),
+                 ansi::rgb_fg(139, 0, 0), "  (Failed)", ansi::reset);
+}
+
+void print_success(const std::string& fp) {
+    const bool IS_DEBUG = logger.get_level() <= Logger::Level::DEBUG;
+    logger.print(IS_DEBUG ? ""
+                          : ansi::clear_line + ansi::cursor_prev_line(1) + ansi::clear_line +
+                                ansi::cursor_prev_line(1) + ansi::cursor_pos_x(fp.size() + 6),
+                 ansi::rgb_fg(0, 139, 0), "  (Sent)", ansi::reset);
+}
+
+// Send the chunks [first, last] of a transfer on `remote`, reading them from `source`
+// Returns 0 once the server has received all of them, or nonzero if failed
+int send_range(SocketClient& remote, Transfer& t, FileSource& source, unsigned stream,
+               uint64_t first, uint64_t last, char* buf) {
+    int size = 0;
+    const int buf_size = t.buf_size;
+    const bool IS_FRAME = t.is_frame;
+    const int LEN_CHUNK_HEAD = t.len_chunk_head;
+    const uint32_t window = t.window, send_buf_size = t.send_buf_size;
+    const uint64_t file_size = t.file_size;
+    const std::string& uuid = t.uuid;
+    const uint64_t session = t.session;
+    auto fail = [&t]() { return t.failed = true, 1; };
+
+    const bool IS_DEBUG = logger.get_level() <= Logger::Level::DEBUG;
+    uint64_t base = first;  // the first chunk not acknowledged yet
+    uint64_t next = first;  // the next chunk to send
+
+    // Chunks in flight are tracked by rings indexed by `chunk % window`
+    // Only datagram sockets retransmit, a chunk is resent when the server reports later chunks
+    // sent after it (the gap is a loss), or when no reply comes within the retransmission timeout
+    const bool IS_DGRAM = remote.addr_info().ai_socktype == SOCK_DGRAM;
+    std::vector<uint64_t> send_seq(window, 0);  // order of the latest transmission
+    std::vector<time_point_highclock> send_time(window);
+    std::vector<bool> resent(window, false);
+    std::vector<bool> sacked(window, false);  // received by server out of order
+    uint64_t seq = 0, max_sacked_seq = 0, tot_resent = 0;
+    const uint64_t REORDER_THRESHOLD = 3;
+    auto last_reply = Timer::point();
+    // congestion control applies to datagram sockets, stream sockets have their own
+    // the negotiated window is the upper limit of the congestion window
+    CongestionControl cc(opt_congestion, window, (int64_t)opt_timeout_recv * 1000);
+    auto cwnd = [&]() -> uint32_t { return IS_DGRAM ? cc.window() : window; };
+    // bandwidth cap, counts every byte sent including retransmissions
+    TokenBucket limiter(opt_rate / t.streams);
+    // chunks are queued and sent in batches, the queue is flushed once the window is filled
+    std::vector<char> batch_buf((size_t)opt_batch_size * buf_size);
+    std::vector<int> batch_lens(opt_batch_size);
+    int batched = 0;
+    // with zero copy, a chunk is built in a buffer the kernel sends it from, a slot falls back
+    // to the batch buffer if there is none
+    std::vector<PooledBuffer> owned(IS_DGRAM ? 0 : opt_batch_size);
+    auto slot = [&](int i) -> char* {
+        if (owned.empty()) return batch_buf.data() + (size_t)i * buf_size;
+        if (!owned[i]) owned[i] = remote.zerocopy_buffer(buf_size);
+        return owned[i] ? owned[i].data() : batch_buf.data() + (size_t)i * buf_size;
+    };
+    // chunks of stream sockets may be sent from the file by the kernel, only the headers are
+    // built here, it falls back to reading the file if the platform does not support it
+    FileHandle file;
+    if (opt_sendfile && !IS_DGRAM && !t.compress && !t.checksum) file.open(t.fp);
+    // the CRC of the range up to each chunk in flight, a chunk resent carries the same one
+    std::vector<uint32_t> range_crcs(t.checksum ? window : 0);
+    uint32_t range_crc = 0;
+    // a chunk that does not shrink is sent as it is, and so are the next ones, more of them each
+    // time, since data of a kind comes together, e.g. an archive in a tarball
+    std::vector<char> packed(t.compress ? send_buf_size : 0);
+    unsigned skip = 0, backoff = 1;
+    // parities of the group being sent, the chunks are added as they are sent first, and the
+    // parities follow the last one; the range cuts the groups at its ends
+    const uint64_t FEC_K = t.fec_data;
+    std::vector<std::vector<char>> parities(t.fec_parity, std::vector<char>(send_buf_size));
+    int parity_len = 0;  // of the longest chunk of the group
+    auto group_first = [&](uint64_t chunk) {
+        return std::max((chunk - 1) / FEC_K * FEC_K + 1, first);
+    };
+    auto group_last = [&](uint64_t chunk) {
+        return std::min((chunk - 1) / FEC_K * FEC_K + FEC_K, last);
+    };
+
+    // a reply of either format, it names a chunk, the one dropped or the next one expected
+    struct Reply {
+        Opcode op;
+        bool ours;  // of this transfer
+        uint64_t chunk;
+        const char* sack;  // selective acknowledgement
+        int sack_len;
+    };
+    auto parse_reply = [&](int size, Reply& r) -> bool {
+        if (IS_FRAME) {
+            FrameHead frame;
+            if (!decode_head(buf, size, frame)) return false;
+            r = {frame.op, frame.session == session, frame.offset / send_buf_size + 1,
+                 buf + FRAME_HEAD_LEN, (int)frame.length};
+            return true;
+        }
+        Opcode op = headcmp(buf, HEAD_DROP)       ? Opcode::DROP
+                    : headcmp(buf, HEAD_DONE)     ? Opcode::DONE
+                    : headcmp(buf, HEAD_RECEIVED) ? Opcode::RECEIVED
+                                                  : Opcode::REJECT;
+        if (op == Opcode::REJECT) return false;
+        int LEN_HEAD = strlen(op == Opcode::DROP   ? HEAD_DROP
+                              : op == Opcode::DONE ? HEAD_DONE
+                                                   : HEAD_RECEIVED);
+        int LEN_ACK = LEN_HEAD + UUID_LEN + sizeof(uint32_t);
+        // a bare DROP means the transfer is given up
+        if (size < LEN_ACK && op == Opcode::DROP)
+            return r = {Opcode::ABORT, true, 0, nullptr, 0}, true;
+        if (size < LEN_ACK) return false;
+        uint32_t chunk_net;
+        memcpy(&chunk_net, buf + LEN_HEAD + UUID_LEN, sizeof(uint32_t));
+        r = {op, memcmp(buf + LEN_HEAD, uuid.data(), UUID_LEN) == 0, ntohl(chunk_net),
+             buf + LEN_ACK, size - LEN_ACK};
+        return true;
+    };
+
+    // output, the details of each stream in debug mode
+    auto print_stream = [&]() {
+        if (!IS_DEBUG) return print_progress(t);
+        uint64_t acked = base - first, chunks = last - first + 1;
+        uint64_t rate = acked >= chunks ? 100 : acked * 100 / chunks;
+        std::string name = t.streams > 1 ? "stream " + std::to_string(stream) + ", " : "";
+        if (IS_DGRAM) {
+            logger.print(ansi::rgb_fg(0, 0, 139), "  Sending (", name, rate, "%, chunk ", acked,
+                         "/", chunks, ", window ", next - base, "/", cwnd(), ", rtt ",
+                         cc.rtt().srtt(), " us, rate ", fmt_size(cc.rate(buf_size)), "/s)",
+                         ansi::reset);
+        } else {
+            logger.print(ansi::rgb_fg(0, 0, 139), "  Sending (", name, rate, "%, chunk ", acked,
+                         "/", chunks, ", window ", next - base, "/", window, ")", ansi::reset);
+        }
+    };
+
+    auto flush = [&]() -> bool {
+        if (batched == 0) return true;
+        int n = batched;
+        batched = 0;
+        PooledBuffer* bufs = owned.empty() ? nullptr : owned.data();
+        return remote.send_batch(batch_buf.data(), buf_size, batch_lens.data(), n, bufs) == n;
+    };
+    // the header of a chunk, a frame tells the length of the body
+    auto put_chunk_head = [&](char* out, Opcode op, uint64_t chunk, uint64_t file_offset,
+                              int body_len) {
+        if (IS_FRAME) {
+            // checksums, if any, start the body
+            encode_head(out, op, session, file_offset,
+                        LEN_CHUNK_HEAD - FRAME_HEAD_LEN + body_len);
+            return;
+        }
+        uint32_t chunk_net = htonl((uint32_t)chunk);
+        memcpy(out, HEAD_TRANSFER, strlen(HEAD_TRANSFER));
+        memcpy(out + strlen(HEAD_TRANSFER), uuid.c_str(), UUID_LEN);
+        memcpy(out + strlen(HEAD_TRANSFER) + UUID_LEN, &chunk_net, sizeof(uint32_t));
+    };
+    // queue the parities of the group of `chunk`
+    auto send_parities = [&](uint64_t chunk) -> bool {
+        const int LEN_PARITY_HEAD = t.len_parity_head;
+        for (int j = 0; j < t.fec_parity; ++j) {
+            if (batched == opt_batch_size && !flush()) return false;
+            char* out = slot(batched);
+            encode_head(out, Opcode::PARITY, session, (group_first(chunk) - 1) * send_buf_size,
+                        LEN_PARITY_HEAD - FRAME_HEAD_LEN + parity_len);
+            put_u32(out + FRAME_HEAD_LEN, j);
+            memcpy(out + LEN_PARITY_HEAD, parities[j].data(), parity_len);
+            if (t.checksum) {
+                // the parities follow the last chunk of the group, whose range CRC is the last
+                put_u32(out + FRAME_HEAD_LEN + sizeof(uint32_t),
+                        crc32c(out + LEN_PARITY_HEAD, parity_len));
+                put_u32(out + FRAME_HEAD_LEN + 2 * sizeof(uint32_t), range_crc);
+            }
+            batch_lens[batched++] = LEN_PARITY_HEAD + parity_len;
+            limiter.consume(LEN_PARITY_HEAD + parity_len);
+        }
+        return true;
+    };
+    auto send_chunk = [&](uint64_t chunk) -> bool {
+        char* out = slot(batched);
+        send_seq[chunk % window] = ++seq;
+        send_time[chunk % window] = Timer::point();
+        if (IS_DGRAM) cc.on_sent();
+        uint64_t file_offset = (chunk - 1) * send_buf_size;
+        if (file.is_open()) {
+            // nothing is batched in this mode, the header goes with the body read by the kernel
+            int body_len = std::min<uint64_t>(file_size - file_offset, send_buf_size);
+            put_chunk_head(out, Opcode::TRANSFER, chunk, file_offset, body_len);
+            int err = remote.send_file(out, LEN_CHUNK_HEAD, file, file_offset, body_len);
+            if (err != METHOD_NOT_IMPLEMENTED) {
+                limiter.consume(LEN_CHUNK_HEAD + body_len);
+                return err == LEN_CHUNK_HEAD + body_len;
+            }
+            logger.debug("Sending from file is not supported, fall back to reading");
+            file.close();
+        }
+        int read_size = source.read(out + LEN_CHUNK_HEAD, send_buf_size, file_offset);
+        if (read_size < 0) return logger.error("Failed to read file: ", t.fp), false;
+        if (t.checksum) {
+            // chunks are sent in order first, so the CRC of the range goes on from the last one
+            uint32_t crc = crc32c(out + LEN_CHUNK_HEAD, read_size);
+            if (!resent[chunk % window])
+                range_crcs[chunk % window] = range_crc = crc32c_combine(range_crc, crc, read_size);
+            put_u32(out + FRAME_HEAD_LEN, crc);
+            put_u32(out + FRAME_HEAD_LEN + sizeof(uint32_t), range_crcs[chunk % window]);
+        }
+        // a chunk shorter than the others counts as padded with zeros
+        const bool ADD_PARITY = FEC_K > 0 && !resent[chunk % window];
+        if (ADD_PARITY) {
+            if (chunk == group_first(chunk)) parity_len = 0;
+            for (int j = 0; j < t.fec_parity; ++j) {
+                char* parity = parities[j].data();
+                if (read_size > parity_len) memset(parity + parity_len, 0, read_size - parity_len);
+                fec_mul_add(parity, out + LEN_CHUNK_HEAD, read_size,
+                            fec_coef(FEC_K, j, (chunk - 1) % FEC_K));
+            }
+            parity_len = std::max(parity_len, read_size);
+        }
+        Opcode op = Opcode::TRANSFER;
+        int body_len = read_size;
+        if (t.compress && skip > 0) {
+            --skip;
+        } else if (t.compress) {
+            // the chunk size goes first, and it is worth it only if a sixteenth is saved
+            const int LEN_RAW = sizeof(uint32_t);
+            int cap = read_size - read_size / 16 - LEN_RAW;
+            int packed_len =
+                cap > 0 ? lz_compress(out + LEN_CHUNK_HEAD, read_size, packed.data(), cap) : 0;
+            if (packed_len > 0) {
+                put_u32(out + LEN_CHUNK_HEAD, read_size);
+                memcpy(out + LEN_CHUNK_HEAD + LEN_RAW, packed.data(), packed_len);
+                op = Opcode::PACKED;
+                body_len = LEN_RAW + packed_len;
+                backoff = 1;
+            } else {
+                skip = backoff;
+                backoff = std::min(backoff * 2, 64u);
+            }
+        }
+        if (!resent[chunk % window]) {
+            t.raw_bytes += read_size;
+            t.wire_bytes += body_len;
+        }
+        put_chunk_head(out, op, chunk, file_offset, body_len);
+        batch_lens[batched++] = LEN_CHUNK_HEAD + body_len;
+        limiter.consume(LEN_CHUNK_HEAD + body_len);
+        if (ADD_PARITY && chunk == group_last(chunk) && !send_parities(chunk)) return false;
+        return batched < opt_batch_size || flush();
+    };
+    // a chunk lost of a group with parities may be rebuilt by the server, so it is resent only
+    // once the parities have had a round trip, or if the window keeps them from being sent
+    // Returns the microseconds to hold it still, or 0 if it is resent now
+    auto rebuild_wait = [&](uint64_t chunk) -> long long {
+        if (FEC_K == 0) return 0;
+        const long long HOLD = cc.rtt().srtt() + cc.rtt().srtt() / 4;
+        uint64_t end = group_last(chunk);
+        if (end >= next) return end < base + cwnd() ? HOLD : 0;
+        return std::max(HOLD - Timer::duration_us(send_time[end % window], Timer::point()), 0LL);
+    };
+    // the retransmission timeout of a chunk counts from the parities of its group as well
+    auto timed_from = [&](uint64_t chunk) {
+        if (FEC_K == 0 || resent[chunk % window]) return send_time[chunk % window];
+        uint64_t end = group_last(chunk);
+        if (end >= next) return end < base + cwnd() ? Timer::point() : send_time[chunk % window];
+        return std::max(send_time[chunk % window], send_time[end % window]);
+    };
+    auto resend_chunk = [&](uint64_t chunk) -> bool {
+        logger.debug("Resending chunk ", chunk);
+        resent[chunk % window] = true;
+        ++tot_resent;
+        return send_chunk(chunk);
+    };
+
+    // a chunk is lost if the server has got chunks transmitted well after it, a few chunks later
+    // are tolerated as the datagrams may be reordered
+    long long held = -1;  // microseconds until a chunk held for its parities is resent, or -1
+    auto resend_lost = [&]() -> bool {
+        held = -1;
+        for (uint64_t c = base; c < next && IS_DGRAM; ++c) {
+            if (sacked[c % window] || send_seq[c % window] + REORDER_THRESHOLD > max_sacked_seq)
+                continue;
+            if (long long hold = rebuild_wait(c); hold > 0) {
+                held = held < 0 ? hold : std::min(held, hold);
+                continue;
+            }
+            cc.on_loss(send_seq[c % window], seq);
+            if (!resend_chunk(c)) return false;
+        }
+        return true;
+    };
+
+    if (IS_DEBUG) print_stream();
+    // another stream may get DONE while replies of this one are lost, then all is received
+    while (!t.failed && !t.done) {
+        // keep the congestion window full, datagrams are paced, and so is everything when the
+        // bandwidth is capped
+        long long pace = 0;
+        for (; next <= last && next < base + cwnd(); ++next) {
+            pace = std::max<long long>(IS_DGRAM ? cc.pacing_delay() : 0, limiter.delay());
+            if (pace > 0) break;
+            resent[next % window] = sacked[next % window] = false;
+            if (!send_chunk(next)) return fail();
+        }
+        // resent chunks are queued as well, every path comes back here
+        if (!flush()) return fail();
+
+        if (IS_DGRAM || pace > 0) {
+            // wait for replies until the next paced chunk, or the oldest chunk times out
+            long long wait = pace;
+            if (IS_DGRAM && next > base) {
+                long long waited = Timer::duration_us(timed_from(base), Timer::point());
+                wait = std::max(cc.rtt().rto() - waited, 0LL);
+                if (held >= 0) wait = std::min(wait, held);
+                if (pace > 0) wait = std::min(wait, pace);
+            }
+            int ready = remote.readable((wait + 999) / 1000);
+            if (ready == SOCKET_ERROR) return fail();
+            if (ready == 0) {
+                // nothing in flight, nothing to wait for
+                if (next == base) {
+                    last_reply = Timer::point();
+                    continue;
+                }
+                // no reply at all, give up after the receive timeout
+                if (Timer::duration(last_reply, Timer::point()) >= opt_timeout_recv) return fail();
+                // chunks held for their parities and not rebuilt in time
+                if (held >= 0 && !resend_lost()) return fail();
+                if (!IS_DGRAM ||
+                    Timer::duration_us(timed_from(base), Timer::point()) < cc.rtt().rto())
+                    continue;
+                // retransmission timeout, resend what the server has not reported
+                logger.debug("Retransmission timeout, rto ", cc.rtt().rto(), " us");
+                cc.on_timeout(seq);
+                uint32_t n = 0;
+                for (uint64_t c = base; c < next && n < cc.window(); ++c) {
+                    if (sacked[c % window]) continue;
+                    if (!resend_chunk(c)) return fail();
+                    ++n;
+                }
+                continue;
+            }
+        }
+
+        // receive status, the server acknowledges cumulatively (the next chunk it expects)
+        size = remote.recv(buf, buf_size);
+        if (size <= 0) return fail();
+        Reply reply;
+        if (!parse_reply(size, reply)) return fail();
+        if (reply.op == Opcode::DROP) {
+            // the server is overloaded and dropped a chunk, back off and resend it
+            if (!reply.ours) continue;
+            uint64_t c = reply.chunk;
+            last_reply = Timer::point();
+            if (c < base || c >= next || sacked[c % window]) continue;
+            logger.debug("Chunk ", c, " dropped by server");
+            if (IS_DGRAM) cc.on_loss(send_seq[c % window], seq);
+            if (!resend_chunk(c)) return fail();
+            continue;
+        }
+        bool is_done = reply.op == Opcode::DONE;
+        if (!is_done && reply.op != Opcode::RECEIVED) return fail();
+        if (!reply.ours) continue;  // late reply from a previous transfer
+        uint64_t chunk_recv = reply.chunk;
+        // acknowledged a chunk that has never been sent
+        if (chunk_recv > next) return fail();
+        last_reply = Timer::point();
+        if (chunk_recv > base) {
+            // sample round-trip time, except for retransmitted chunks (Karn's algorithm)
+            uint64_t newest = chunk_recv - 1;
+            long long rtt = -1;
+            if (!resent[newest % window])
+                rtt = Timer::duration_us(send_time[newest % window], last_reply);
+            cc.on_ack(chunk_recv - base, rtt);
+            // chunks in flight sent before a resent chunk that is received are lost as well, they
+            // are found at once instead of by a timeout each
+            max_sacked_seq = std::max(max_sacked_seq, send_seq[newest % window]);
+            t.acked += chunk_recv - base;
+            base = chunk_recv;
+            print_stream();
+        }
+        if (is_done) {
+            if (base != last + 1) return fail();
+            t.done = true;
+            break;
+        }
+        // the range is received, the server tells DONE once every range is
+        if (base > last) break;
+
+        // selective acknowledgement, bit i is set if chunk `chunk_recv + 1 + i` is received
+        for (int i = 0; i / 8 < reply.sack_len; ++i) {
+            uint64_t c = chunk_recv + 1 + i;
+            if (c >= next) break;
+            if (c < base || !(reply.sack[i / 8] >> (i % 8) & 1)) continue;
+            sacked[c % window] = true;
+            max_sacked_seq = std::max(max_sacked_seq, send_seq[c % window]);
+        }
+        if (!resend_lost()) return fail();
+    }
+
+    if (tot_resent > 0) logger.debug("Resent ", tot_resent, " chunk(s)");
+    return t.failed ? 1 : 0;
+}
+
+// Send the ranges of stream `stream`, every `t.streams`-th range of the transfer
+// Returns 0 once the server has received all of them, or nonzero if failed
+int send_ranges(SocketClient& remote, Transfer& t, FileSource& source, unsigned stream,
+                char* buf) {
+    for (size_t i = stream; i < t.ranges.size(); i += t.streams) {
+        int err = send_range(remote, t, source, stream, t.ranges[i].first, t.ranges[i].last, buf);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+// Open the socket of a stream, set up as the options tell
+// Returns nonzero if failed
+int open_stream(SocketClient& stream) {
+    if (stream.init_socket() != 0) return 1;
+    int e1, e2;
+    e1 = set_socket_timeout(stream.socket(), SO_SNDTIMEO, opt_timeout_send);
+    e2 = set_socket_timeout(stream.socket(), SO_RCVTIMEO, opt_timeout_recv);
+    if (e1 == SOCKET_ERROR || e2 == SOCKET_ERROR) return 1;
+    if (opt_gso) stream.enable_gso();
+    if (opt_zerocopy) stream.enable_zerocopy();
+    // datagram sockets are not connected
+    int err = stream.connect();
+    if (err == METHOD_NOT_IMPLEMENTED) return 0;
+    if (err != 0) return err;
+    return (server_caps & CAP_FRAMING) ? frame_stream(stream) : 0;
+}
+
+// Send a request of `len` bytes in `buf` and wait for its reply of `op` at `offset`, into `buf`.
+// The request is sent again if no reply comes in time, replies of other requests are stale
+// Returns the size of the reply, or -1 if failed or refused
+int request(SocketClient& remote, char* buf, int buf_size, int len, Opcode op, uint64_t offset,
+            FrameHead& reply) {
+    const int RETRY = 3;
+    const int TIMEOUT = opt_timeout_recv / (RETRY + 1);
+    std::string req(buf, len);
+    for (int i = 0; i <= RETRY; ++i) {
+        if (remote.send(req.data(), req.size()) == SOCKET_ERROR) return -1;
+        auto start = Timer::point();
+        while (Timer::duration(start, Timer::point()) < TIMEOUT) {
+            int ready = remote.readable(TIMEOUT);
+            if (ready == SOCKET_ERROR) return -1;
+            if (ready == 0) break;
+            int size = remote.recv(buf, buf_size);
+            if (size <= 0) return -1;
+            if (!decode_head(buf, size, reply)) continue;
+            if (reply.op == Opcode::REJECT) return -1;
+            if (reply.op == op && reply.offset == offset) return size;
+        }
+    }
+    return -1;
+}
+
+// Fetch the signatures of the file of the same name on the server, a request for each bufferful
+// Returns nonzero if the server has none, or failed
+int fetch_signatures(SocketClient& remote, const std::string& fn, char* buf, int buf_size,
+                     Signatures& sigs) {
+    const int LEN_FIELDS = sizeof(uint32_t);
+    const int LEN_REPLY_HEAD = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+    const int LEN_SIGNATURE = sizeof(uint32_t) + sizeof(uint64_t);
+    if (buf_size < FRAME_HEAD_LEN + LEN_FIELDS + (int)fn.size() ||
+        buf_size < FRAME_HEAD_LEN + LEN_REPLY_HEAD + LEN_SIGNATURE)
+        return 1;
+    sigs = Signatures();
+    uint64_t blocks = 1;  // known from the first reply
+    for (uint64_t first = 0; first < blocks;) {
+        FrameHead frame;
+        int len = encode_head(buf, Opcode::SIGNATURES, 0, first, LEN_FIELDS + fn.size());
+        put_u32(buf + len, buf_size - FRAME_HEAD_LEN);
+        memcpy(buf + len + LEN_FIELDS, fn.c_str(), fn.size());
+        len += LEN_FIELDS + fn.size();
+        if (request(remote, buf, buf_size, len, Opcode::SIGNATURES, first, frame) < 0 ||
+            frame.length < (uint32_t)LEN_REPLY_HEAD)
+            return 1;
+        const char* body = buf + FRAME_HEAD_LEN;
+        uint64_t identity = get_u64(body), file_size = get_u64(body + sizeof(uint64_t));
+        uint32_t block_size = get_u32(body + 2 * sizeof(uint64_t));
+        if (block_size == 0) return 1;
+        if (first == 0) {
+            sigs.identity = identity;
+            sigs.size = file_size;
+            sigs.block_size = block_size;
+            blocks = file_size / block_size + (file_size % block_size != 0);
+        } else if (identity != sigs.identity || file_size != sigs.size ||
+                   block_size != sigs.block_size) {
+            return 1;  // the file has changed meanwhile
+        }
+        uint32_t count = (frame.length - LEN_REPLY_HEAD) / LEN_SIGNATURE;
+        if (count == 0 && first < blocks) return 1;
+        for (uint32_t i = 0; i < count && first < blocks; ++i, ++first) {
+            const char* p = body + LEN_REPLY_HEAD + i * LEN_SIGNATURE;
+            sigs.blocks.push_back({get_u32(p), get_u64(p + sizeof(uint32_t))});
+        }
+    }
+    return 0;
+}
+
+// Ask the server which of the chunks it has, a request for each bufferful
+// Returns nonzero if the server keeps no chunks, or failed
+int query_chunks(SocketClient& remote, const std::vector<ContentChunk>& chunks, char* buf,
+                 int buf_size, std::vector<bool>& stored) {
+    const int LEN_HASH = 2 * sizeof(uint64_t);
+    const size_t PER_REQUEST = (buf_size - FRAME_HEAD_LEN) / LEN_HASH;
+    if (PER_REQUEST == 0) return 1;
+    stored.assign(chunks.size(), false);
+    // an empty file is asked about as well, the server tells if it keeps chunks
+    size_t first = 0;
+    do {
+        FrameHead frame;
+        size_t count = std::min(PER_REQUEST, chunks.size() - first);
+        int len = encode_head(buf, Opcode::CHUNKS, 0, first, count * LEN_HASH);
+        for (size_t i = 0; i < count; ++i) {
+            put_u64(buf + len, chunks[first + i].hash.hi);
+            put_u64(buf + len + sizeof(uint64_t), chunks[first + i].hash.lo);
+            len += LEN_HASH;
+        }
+        if (request(remote, buf, buf_size, len, Opcode::CHUNKS, first, frame) < 0 ||
+            frame.length < (count + 7) / 8)
+            return 1;
+        const char* body = buf + FRAME_HEAD_LEN;
+        for (size_t i = 0; i < count; ++i)
+            stored[first + i] = (uint8_t)body[i / 8] & (0x80 >> (i % 8));
+        first += count;
+    } while (first < chunks.size());
+    return 0;
+}
+
 int send_file(SocketClient& remote, const std::string& fp, char* buf, int buf_size) {
     int size = 0, err = 0;
+    auto start = Timer::point();
 
     // Prepare file
     std::string fn = extract_fn(fp);
-    std::ifstream fs(fp, std::ios::binary);
+    // chunks are read from the source as they are sent, it may read ahead in background
+    std::unique_ptr<FileSource> source = make_file_source(opt_read_mode);
     // check if file exists
-    if (!fs.is_open()) return logger.error("File not found: ", ansi::gray, fp, ansi::reset), -1;
+    if (source->open(fp) != 0)
+        return logger.error("File not found: ", ansi::gray, fp, ansi::reset), -1;
 
     // Handshake
     logger.debug("[START] Handshake");
 
-    fs.seekg(0, std::ios::end);
-    std::streamsize file_size = fs.tellg();
-    u_long file_size_net = htonl(file_size);  // convert to network byte order
-    memcpy(buf, HEAD_HS, strlen(HEAD_HS));
-    memcpy(buf + strlen(HEAD_HS), &file_size_net, sizeof(u_long));
-    memcpy(buf + strlen(HEAD_HS) + sizeof(u_long), fn.c_str(), fn.size());
-    err = remote.send(buf, strlen(HEAD_HS) + sizeof(u_long) + fn.size());
-    if (err == SOCKET_ERROR) return logger.error("Cannot connect to server"), fs.close(), -1;
+    Transfer t;
+    t.fp = fp;
+    t.buf_size = buf_size;
+    t.file_size = source->size();
+    // messages are framed in binary if the server supports it, or tagged in text
+    t.is_frame = (server_caps & CAP_BINARY) != 0;
+    t.compress = t.is_frame && (server_caps & CAP_COMPRESS) != 0;
+    t.checksum = t.is_frame && (server_caps & CAP_CHECKSUM) != 0;
+    // parities go with datagrams only, a stream socket loses nothing
+    if (t.is_frame && (server_caps & CAP_FEC) && remote.addr_info().ai_socktype == SOCK_DGRAM) {
+        t.fec_data = opt_fec_data;
+        t.fec_parity = opt_fec_parity;
+    }
+    t.len_chunk_head = !t.is_frame ? strlen(HEAD_TRANSFER) + UUID_LEN + sizeof(uint32_t)
+                       : t.checksum ? FRAME_HEAD_LEN + 2 * sizeof(uint32_t)
+                                    : FRAME_HEAD_LEN;
+    // a parity is as long as a chunk, and its head shall fit as well
+    t.len_parity_head = FRAME_HEAD_LEN + (t.checksum ? 3 : 1) * sizeof(uint32_t);
+    t.send_buf_size = buf_size - std::max(t.len_chunk_head, t.fec_data > 0 ? t.len_parity_head : 0);
+
+    // a delta against the file the server has is sent instead, or a recipe of the chunks the
+    // server has, if it is smaller than the file
+    Signatures sigs;
+    std::string delta_fp;
+    Opcode hs_op = Opcode::HS;
+    const uint64_t target_size = t.file_size;
+    // sent if it is made in a temporary file and smaller, `make` returns its size
+    auto send_instead = [&](Opcode op, const char* name, const char* suffix, auto make) {
+        std::error_code ec;
+        auto tmp_dir = std::filesystem::temp_directory_path(ec);
+        if (!ec) delta_fp = (tmp_dir / ("transf-" + uuid_v1() + suffix)).string();
+        long long delta_size = delta_fp.empty() ? -1 : make(delta_fp);
+        logger.debug(name, ": ", delta_size < 0 ? "failed" : fmt_size(delta_size), " of ",
+                     fmt_size(target_size));
+        // the file is still sent if the delta can not be opened
+        std::unique_ptr<FileSource> delta_source;
+        if (delta_size >= 0 && (uint64_t)delta_size < target_size) {
+            delta_source = make_file_source(opt_read_mode);
+            if (delta_source->open(delta_fp) != 0) delta_source = nullptr;
+        }
+        if (delta_source != nullptr) {
+            source->close();
+            source = std::move(delta_source);
+            t.fp = delta_fp;
+            t.file_size = delta_size;
+            hs_op = op;
+        } else if (!delta_fp.empty()) {
+            std::filesystem::remove(delta_fp, ec);
+            delta_fp.clear();
+        }
+    };
+    if (opt_delta && t.is_frame && fetch_signatures(remote, fn, buf, buf_size, sigs) == 0) {
+        send_instead(Opcode::DELTA, "Delta", DELTA_SUFFIX, [&](const std::string& out) {
+            return make_delta(*source, sigs, out);
+        });
+    }
+    std::vector<ContentChunk> content_chunks;
+    std::vector<bool> stored;
+    const bool IS_DEDUP = opt_dedup && t.is_frame && hs_op == Opcode::HS;
+    if (IS_DEDUP && cdc_split(*source, content_chunks) == 0 &&
+        query_chunks(remote, content_chunks, buf, buf_size, stored) == 0) {
+        logger.debug("Chunks: ", std::count(stored.begin(), stored.end(), true), "/",
+                     content_chunks.size(), " stored");
+        send_instead(Opcode::DEDUP, "Recipe", RECIPE_SUFFIX, [&](const std::string& out) {
+            return make_recipe(*source, content_chunks, stored, out);
+        });
+    }
+    // the delta is a temporary file, removed however the transfer ends
+    struct TempFile {
+        std::string& fp;
+        ~TempFile() {
+            std::error_code ec;
+            if (!fp.empty()) std::filesystem::remove(fp, ec);
+        }
+    } delta_file{delta_fp};
+    // the file is sent instead if the server refuses the delta, e.g. its file has changed
+    auto fall_back = [&]() {
+        logger.debug(hs_op == Opcode::DEDUP ? "Recipe" : "Delta",
+                     " refused, sending the whole file");
+        hs_op = Opcode::HS;
+        source->close();
+        std::error_code ec;
+        std::filesystem::remove(delta_fp, ec);
+        delta_fp.clear();
+        t.fp = fp;
+        t.file_size = target_size;
+        return source->open(fp);
+    };
+
+    auto send_hs = [&]() {
+        // the size of a full chunk is told, chunks are then named by their offsets
+        // the identity of the file lets the server resume a previous transfer of it, or tells
+        // the file a delta is made against
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(fp, ec);
+        uint64_t identity = ec ? 0 : file_identity(t.file_size, mtime.time_since_epoch().count());
+        const bool IS_DELTA = hs_op != Opcode::HS;
+        if (IS_DELTA) identity = hs_op == Opcode::DELTA ? sigs.identity : 0;
+        int LEN_FIELDS = 3 * sizeof(uint32_t) + (IS_DELTA ? 2 : 1) * sizeof(uint64_t);
+        // the capabilities the chunks use follow the name, and the size of a group with parities
+        uint32_t caps = (t.checksum ? CAP_CHECKSUM : 0) | (t.fec_data > 0 ? CAP_FEC : 0);
+        int LEN_CAPS = caps == 0        ? 0
+                       : t.fec_data > 0 ? 1 + 3 * sizeof(uint32_t)
+                                        : 1 + sizeof(uint32_t);
+        int LEN_HS_HEAD =
+            encode_head(buf, hs_op, 0, t.file_size, LEN_FIELDS + fn.size() + LEN_CAPS);
+        put_u32(buf + LEN_HS_HEAD, opt_window_size);
+        put_u32(buf + LEN_HS_HEAD + sizeof(uint32_t), t.send_buf_size);
+        put_u32(buf + LEN_HS_HEAD + 2 * sizeof(uint32_t), opt_streams);
+        put_u64(buf + LEN_HS_HEAD + 3 * sizeof(uint32_t), identity);
+        if (IS_DELTA) {
+            put_u64(buf + LEN_HS_HEAD + 3 * sizeof(uint32_t) + sizeof(uint64_t), target_size);
+        }
+        memcpy(buf + LEN_HS_HEAD + LEN_FIELDS, fn.c_str(), fn.size());
+        if (LEN_CAPS > 0) {
+            char* p = buf + LEN_HS_HEAD + LEN_FIELDS + fn.size();
+            p[0] = '\0';
+            put_u32(p + 1, caps);
+            if (t.fec_data > 0) {
+                put_u32(p + 1 + sizeof(uint32_t), t.fec_data);
+                put_u32(p + 1 + 2 * sizeof(uint32_t), t.fec_parity);
+            }
+        }
+        return remote.send(buf, LEN_HS_HEAD + LEN_FIELDS + fn.size() + LEN_CAPS);
+    };
+
+    if (t.is_frame) {
+        err = send_hs();
+    } else {
+        // the size is 32-bit in text messages
+        if (t.file_size > UINT32_MAX)
+            return logger.error("Files over 4 GB need the binary format"), source->close(), 1;
+        uint32_t file_size_net = htonl((uint32_t)t.file_size);  // convert to network byte order
+        int LEN_HS_HEAD = strlen(HEAD_HS) + sizeof(uint32_t);
+        memcpy(buf, HEAD_HS, strlen(HEAD_HS));
+        memcpy(buf + strlen(HEAD_HS), &file_size_net, sizeof(uint32_t));
+        memcpy(buf + LEN_HS_HEAD, fn.c_str(), fn.size());
+        // the window follows the name, if the server knows it
+        int LEN_WINDOW = (server_caps & CAP_WINDOW) ? 1 + sizeof(uint32_t) : 0;
+        if (LEN_WINDOW > 0) {
+            buf[LEN_HS_HEAD + fn.size()] = '\0';
+            put_u32(buf + LEN_HS_HEAD + fn.size() + 1, opt_window_size);
+        }
+        err = remote.send(buf, LEN_HS_HEAD + fn.size() + LEN_WINDOW);
+    }
+    if (err == SOCKET_ERROR) return logger.error("Cannot connect to server"), source->close(), -1;
     // response
     size = remote.recv(buf, buf_size);
-    if (size <= 0) return logger.error("Cannot connect to server"), fs.close(), -1;
-    if (!headcmp(buf, HEAD_OK)) return logger.error("Handshake failed"), fs.close(), 1;
-    const std::string uuid = std::string(buf + strlen(HEAD_OK), UUID_LEN);
+    if (size <= 0) return logger.error("Cannot connect to server"), source->close(), -1;
+    FrameHead reply;
+    if (!delta_fp.empty() && decode_head(buf, size, reply) && reply.op == Opcode::REJECT) {
+        if (fall_back() != 0) return logger.error("File not found: ", fp), -1;
+        if (send_hs() == SOCKET_ERROR)
+            return logger.error("Cannot connect to server"), source->close(), -1;
+        size = remote.recv(buf, buf_size);
+        if (size <= 0) return logger.error("Cannot connect to server"), source->close(), -1;
+    }
+    // negotiated window size and streams, the server may lower them
+    if (t.is_frame) {
+        FrameHead frame;
+        if (!decode_head(buf, size, frame) || frame.op != Opcode::OK)
+            return logger.error("Handshake failed"), source->close(), 1;
+        t.session = frame.session;
+        const char* body = buf + FRAME_HEAD_LEN;
+        if (frame.length >= sizeof(uint32_t)) t.window = get_u32(body);
+        if (frame.length >= 2 * sizeof(uint32_t)) t.streams = get_u32(body + sizeof(uint32_t));
+        // the chunks to send, only the missing ones if the transfer is resumed
+        for (uint32_t i = 2 * sizeof(uint32_t); i + 2 * sizeof(uint64_t) <= frame.length;
+             i += 2 * sizeof(uint64_t)) {
+            t.ranges.push_back({get_u64(body + i), get_u64(body + i + sizeof(uint64_t))});
+        }
+    } else {
+        if (!headcmp(buf, HEAD_OK)) return logger.error("Handshake failed"), source->close(), 1;
+        t.uuid = std::string(buf + strlen(HEAD_OK), UUID_LEN);
+        if (size >= (int)(strlen(HEAD_OK) + UUID_LEN + sizeof(uint32_t))) {
+            memcpy(&t.window, buf + strlen(HEAD_OK) + UUID_LEN, sizeof(uint32_t));
+            t.window = ntohl(t.window);
+        }
+    }
+    if (t.window == 0 || t.window > (uint32_t)opt_window_size) t.window = opt_window_size;
+    t.streams = std::clamp<unsigned>(t.streams, 1, opt_streams);
+    logger.debug("Window size: ", t.window);
+    logger.debug("Format: ", t.is_frame ? "binary" : "text");
+    if (opt_compress) logger.debug("Compression: ", t.compress ? "ON" : "OFF");
+    if (opt_checksum) logger.debug("Checksums: ", t.checksum ? "ON" : "OFF");
+    if (opt_fec_data > 0) {
+        logger.debug("Parities: ", t.fec_data > 0 ? std::to_string(t.fec_parity) + " of " +
+                                                        std::to_string(t.fec_data) + " chunks"
+                                                  : "OFF");
+    }
+    if (opt_streams > 1) logger.debug("Streams: ", t.streams);
 
     // Transfer
     logger.debug("[START] Transfer");
 
-    u_long chunk = 0;
-    u_long send_buf_size = buf_size - strlen(HEAD_TRANSFER) - UUID_LEN - sizeof(u_long);
-    u_long tot_chunk = file_size / send_buf_size + (file_size % send_buf_size != 0);
-    u_long last_rate = 0;
-    fs.seekg(0, std::ios::beg);
-
-    while (!fs.eof()) {
-        ++chunk;
-        const bool IS_DEBUG = logger.get_level() <= Logger::Level::DEBUG;
-        // output
-        const std::string ANSI_PREV_LINE =
-            ansi::clear_line + ansi::cursor_prev_line(1) + ansi::clear_line;
-        u_long rate = chunk == tot_chunk ? 100 : chunk * 100 / tot_chunk;
-        if (IS_DEBUG) {
-            logger.print(ansi::rgb_fg(0, 0, 139), "  Sending (", rate, "%, chunk ", chunk, "/",
-                         tot_chunk, ")", ansi::reset);
-        } else if (chunk == 1 || chunk == tot_chunk || last_rate != rate) {
-            last_rate = rate;
-            logger.print(chunk == 1 ? "" : ANSI_PREV_LINE, ansi::rgb_fg(0, 0, 139), "  Sending (",
-                         rate, "%)", ansi::reset);
-        }
-
-        auto print_fail = [&fp, &IS_DEBUG]() {
-            logger.print(IS_DEBUG ? ""
-                                  : ansi::clear_line + ansi::cursor_prev_line(1) +
-                                        ansi::cursor_pos_x(fp.size() + 6),
-                         ansi::rgb_fg(139, 0, 0), "  (Failed)", ansi::reset);
-        };
-        auto print_success = [&fp, &IS_DEBUG]() {
-            logger.print(IS_DEBUG
-                             ? ""
-                             : ansi::clear_line + ansi::cursor_prev_line(1) + ansi::clear_line +
-                                   ansi::cursor_prev_line(1) + ansi::cursor_pos_x(fp.size() + 6),
-                         ansi::rgb_fg(0, 139, 0), "  (Sent)", ansi::reset);
-        };
-
-        // send file content
-        int chunk_net = htonl(chunk);
-        memcpy(buf, HEAD_TRANSFER, strlen(HEAD_TRANSFER));
-        memcpy(buf + strlen(HEAD_TRANSFER), uuid.c_str(), UUID_LEN);
-        int chunk_offset = strlen(HEAD_TRANSFER) + UUID_LEN;
-        memcpy(buf + chunk_offset, &chunk_net, sizeof(chunk_net));
-        fs.read(buf + chunk_offset + sizeof(chunk_net), send_buf_size);
-        int read_size = fs.gcount();
-        err = remote.send(buf, chunk_offset + sizeof(chunk_net) + read_size);
-        if (err == SOCKET_ERROR) return print_fail(), fs.close(), 1;
-
-        // receive status (chunk)
-        size = remote.recv(buf, buf_size);
-        if (size <= 0) return print_fail(), fs.close(), 1;
-        if (headcmp(buf, HEAD_RECEIVED)) {
-            auto _uuid = std::string(buf + strlen(HEAD_RECEIVED), UUID_LEN);
-            if (uuid != _uuid) return print_fail(), fs.close(), 1;
-            u_long chunk_recv;
-            memcpy(&chunk_recv, buf + strlen(HEAD_RECEIVED) + UUID_LEN, sizeof(u_long));
-            chunk_recv = ntohl(chunk_recv);
-            if (chunk_recv != chunk + 1) return print_fail(), fs.close(), 1;
-        } else if (headcmp(buf, HEAD_DONE)) {
-            auto _uuid = std::string(buf + strlen(HEAD_DONE), UUID_LEN);
-            if (uuid != _uuid) return print_fail(), fs.close(), 1;
-            u_long chunk_recv;
-            memcpy(&chunk_recv, buf + strlen(HEAD_DONE) + UUID_LEN, sizeof(u_long));
-            chunk_recv = ntohl(chunk_recv);
-            if (chunk_recv != chunk + 1) return print_fail(), fs.close(), 1;
-            print_success();
-            break;
-        } else {
-            return print_fail(), fs.close(), 1;
-        }
+    uint64_t chunks = t.file_size / t.send_buf_size + (t.file_size % t.send_buf_size != 0);
+    if (chunks == 0) chunks = 1;  // an empty file is sent as an empty chunk
+    // all the chunks if the server lists none, as a text one does
+    if (t.ranges.empty()) {
+        for (unsigned i = 0; i < t.streams; ++i)
+            t.ranges.push_back({range_first(chunks, t.streams, i),
+                                range_first(chunks, t.streams, i + 1) - 1});
     }
+    for (auto& r : t.ranges) t.tot_chunk += r.last - r.first + 1;
+    if (t.tot_chunk < chunks) logger.debug("Resumed, ", t.tot_chunk, "/", chunks, " chunk(s) left");
+    if (logger.get_level() > Logger::Level::DEBUG) print_progress(t);
 
-    fs.close();
+    // the ranges of the first stream are sent here, the others are sent by threads on sockets of
+    // their own, each reading the file by itself
+    std::vector<int> results(t.streams, 1);
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < t.streams; ++i) {
+        threads.emplace_back([&t, &remote, &results, i]() {
+            addrcoll info = remote.addr_info();
+            SocketClient stream((BasicSocket(&info)));
+            std::unique_ptr<FileSource> source = make_file_source(opt_read_mode);
+            std::vector<char> buf(t.buf_size);
+            if (open_stream(stream) != 0 || source->open(t.fp) != 0) {
+                logger.error("Failed to open stream ", i);
+                t.failed = true;
+            } else {
+                results[i] = send_ranges(stream, t, *source, i, buf.data());
+            }
+            source->close();
+            stream.close();
+            stream.destroy();
+        });
+    }
+    results[0] = send_ranges(remote, t, *source, 0, buf);
+    for (auto& thread : threads) thread.join();
+    source->close();
+
+    bool ok = t.done && std::all_of(results.begin(), results.end(), [](int r) { return r == 0; });
+    if (!ok) return print_fail(fp), 1;
+    print_success(fp);
+    if (t.compress) {
+        // the ratio of the chunks sent, and the rate of the file as it is on disk
+        uint64_t ratio = t.wire_bytes > 0 ? t.raw_bytes * 10 / t.wire_bytes : 10;
+        long long ms = std::max(Timer::duration(start, Timer::point()), 1);
+        logger.print(ansi::gray, "  Compressed ", ratio / 10, ".", ratio % 10, "x, ",
+                     fmt_size(target_size * 1000 / ms), "/s", ansi::reset);
+    }
     return 0;
 }
-#undef headcmp
 
 struct CLIOptions {
     std::string ip;
     int port;
     ip_version ip_ver = IPv4 | IPv6;
     SockType socktype = SockType::TYPE_DGRAM;
-    int chunk_size = 2048;
+    int chunk_size = 0;  // fits the path MTU if 0
+    int window_size = 16;
+    int batch_size = 16;
+    int streams = 1;
+    CongestionMode congestion = CongestionMode::AIMD;
+    long long rate = 0;
+    bool gso = false;
+    bool sendfile = false;
+    bool zerocopy = false;
+    bool delta = false;
+    bool dedup = false;
+    bool compress = false;
+    bool checksum = true;
+    int fec_data = 0;
+    int fec_parity = 0;
+    ReadMode read_mode = ReadMode::AHEAD;
+    bool binary = true;
     int timeout_recv = 10000;
     int timeout_send = 10000;
     bool ping = false;
@@ -220,7 +1117,26 @@ inline void cli_usage() {
         "  --protocol <protocol>    Specify the protocol to use (default: udp)\n"
         "  --tcp                    Equivalent to --protocol tcp\n"
         "  --udp                    Equivalent to --protocol udp\n"
-        "  --chunk <chunk_size>     Set chunk size for file transfer (default: 2048)\n"
+        "  --chunk <chunk_size>     Set chunk size for file transfer (default: probed before each\n"
+        "                           file to fit the path MTU on UDP, 2048 on TCP)\n"
+        "  --window <size>          Set the number of chunks in flight (default: 16)\n"
+        "  --batch <size>           Set the number of chunks sent per call (default: 16)\n"
+        "  --streams <n>            Send a file over n sockets at once, a range each (default: 1)\n"
+        "  --gso                    Let the kernel split batches into datagrams (UDP only)\n"
+        "  --sendfile               Let the kernel send chunks from the file (TCP, --no-checksum)\n"
+        "  --zerocopy               Send chunks of 64 KiB or more in place (TCP, Linux only)\n"
+        "  --delta                  Send only what differs from the file the server has\n"
+        "  --dedup                  Send only the chunks the server has in none of its files\n"
+        "  --compress               Compress the chunks that shrink, e.g. of text files (if the\n"
+        "                           server has --workers)\n"
+        "  --no-checksum            Send chunks without CRCs, the server checks none of them\n"
+        "  --fec <k>[:<m>]          Add m parities to every k chunks, the server rebuilds up to m\n"
+        "                           chunks lost of them (UDP only, default m: 1)\n"
+        "  --reader <mode>          Read the file by read, mmap or ahead (default: ahead)\n"
+        "  --wire <format>          Frame messages in binary or text, binary falls back to text\n"
+        "                           if the server lacks it (default: binary)\n"
+        "  --congestion <mode>      Congestion control for UDP, aimd or delay (default: aimd)\n"
+        "  --rate <bytes/s>         Limit the sending rate, e.g. 512K or 10M (default: no limit)\n"
         "  --timeout <timeout>      Set timeout for sending and receiving data (default: 10000)\n"
         "  --debug                  Enable debug mode\n"
         "\n"
@@ -290,6 +1206,160 @@ int main(int argc, char* argv[]) {
             } catch (...) {
                 return logger.error("Invalid chunk size: ", next), 1;
             }
+        } else if (arg_match(cur_argstr, "--window")) {
+            // opt: --window
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --window"), 1;
+            }
+            try {
+                int window_size = std::stoi(next);
+                if (window_size <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "window size must be a positive integer: ",
+                               next),
+                           1;
+                options.window_size = window_size;
+            } catch (...) {
+                return logger.error("Invalid window size: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--congestion")) {
+            // opt: --congestion
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --congestion"), 1;
+            }
+            if (strcmp(next, "aimd") == 0) {
+                options.congestion = CongestionMode::AIMD;
+            } else if (strcmp(next, "delay") == 0) {
+                options.congestion = CongestionMode::DELAY;
+            } else {
+                return logger.error("Invalid congestion control: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--reader")) {
+            // opt: --reader
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --reader"), 1;
+            }
+            if (strcmp(next, "read") == 0) {
+                options.read_mode = ReadMode::READ;
+            } else if (strcmp(next, "mmap") == 0) {
+                options.read_mode = ReadMode::MAP;
+            } else if (strcmp(next, "ahead") == 0) {
+                options.read_mode = ReadMode::AHEAD;
+            } else {
+                return logger.error("Invalid file reader: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--wire")) {
+            // opt: --wire
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --wire"), 1;
+            }
+            if (strcmp(next, "binary") == 0) {
+                options.binary = true;
+            } else if (strcmp(next, "text") == 0) {
+                options.binary = false;
+            } else {
+                return logger.error("Invalid wire format: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--rate")) {
+            // opt: --rate
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --rate"), 1;
+            }
+            options.rate = parse_size(next);
+            if (options.rate < 0) return logger.error("Invalid rate: ", next), 1;
+        } else if (arg_match(cur_argstr, "--batch")) {
+            // opt: --batch
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --batch"), 1;
+            }
+            try {
+                int batch_size = std::stoi(next);
+                if (batch_size <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "batch size must be a positive integer: ",
+                               next),
+                           1;
+                options.batch_size = batch_size;
+            } catch (...) {
+                return logger.error("Invalid batch size: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--streams")) {
+            // opt: --streams
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --streams"), 1;
+            }
+            try {
+                int streams = std::stoi(next);
+                if (streams <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "streams must be a positive integer: ",
+                               next),
+                           1;
+                options.streams = streams;
+            } catch (...) {
+                return logger.error("Invalid streams: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--gso")) {
+            // opt: --gso
+            options.gso = true;
+        } else if (arg_match(cur_argstr, "--sendfile")) {
+            // opt: --sendfile
+            options.sendfile = true;
+        } else if (arg_match(cur_argstr, "--zerocopy")) {
+            // opt: --zerocopy
+            options.zerocopy = true;
+        } else if (arg_match(cur_argstr, "--delta")) {
+            // opt: --delta
+            options.delta = true;
+        } else if (arg_match(cur_argstr, "--dedup")) {
+            // opt: --dedup
+            options.dedup = true;
+        } else if (arg_match(cur_argstr, "--compress")) {
+            // opt: --compress
+            options.compress = true;
+        } else if (arg_match(cur_argstr, "--no-checksum")) {
+            // opt: --no-checksum
+            options.checksum = false;
+        } else if (arg_match(cur_argstr, "--fec")) {
+            // opt: --fec
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --fec"), 1;
+            }
+            try {
+                std::string arg = next;
+                size_t colon = arg.find(':');
+                size_t pos = 0;
+                int fec_data = std::stoi(arg.substr(0, colon), &pos);
+                int fec_parity = 1;
+                if (pos != (colon == std::string::npos ? arg.size() : colon))
+                    throw std::invalid_argument(arg);
+                if (colon != std::string::npos) {
+                    fec_parity = std::stoi(arg.substr(colon + 1), &pos);
+                    if (pos != arg.size() - colon - 1) throw std::invalid_argument(arg);
+                }
+                if (fec_data <= 0 || fec_data > FEC_MAX_DATA || fec_parity <= 0 ||
+                    fec_parity > FEC_MAX_PARITY)
+                    return logger.error("Invalid argument: "
+                                        "parities must be 1 to ",
+                                        FEC_MAX_PARITY, " of 1 to ", FEC_MAX_DATA,
+                                        " chunks: ", next),
+                           1;
+                options.fec_data = fec_data;
+                options.fec_parity = fec_parity;
+            } catch (...) {
+                return logger.error("Invalid parities: ", next), 1;
+            }
         } else if (arg_match(cur_argstr, "--timeout")) {
             // opt: --timeout
             auto next = args.next();
@@ -329,6 +1399,27 @@ int main(int argc, char* argv[]) {
     }
 
     opt_chunk_size = options.chunk_size;
+    opt_window_size = options.window_size;
+    opt_batch_size = options.batch_size;
+    opt_timeout_recv = options.timeout_recv;
+    opt_timeout_send = options.timeout_send;
+    opt_streams = options.streams;
+    opt_congestion = options.congestion;
+    opt_rate = options.rate;
+    opt_sendfile = options.sendfile;
+    opt_gso = options.gso;
+    opt_zerocopy = options.zerocopy;
+    opt_delta = options.delta;
+    opt_dedup = options.dedup;
+    opt_compress = options.compress;
+    opt_checksum = options.checksum;
+    opt_fec_data = options.fec_data;
+    opt_fec_parity = options.fec_parity;
+    opt_read_mode = options.read_mode;
+    opt_caps = options.binary ? CAPS_SUPPORTED : CAPS_SUPPORTED & ~CAP_BINARY;
+    if (!options.compress) opt_caps &= ~CAP_COMPRESS;
+    if (!options.checksum) opt_caps &= ~CAP_CHECKSUM;
+    if (options.fec_data == 0) opt_caps &= ~CAP_FEC;
 
     // End processing arguments
 
@@ -359,7 +1450,28 @@ int main(int argc, char* argv[]) {
         logger.print(" - IP Version: ", options.ip_ver == IPv6   ? "IPv6"
                                         : options.ip_ver == IPv4 ? "IPv4"
                                                                  : "IPv4, IPv6");
-        logger.print(" - Chunk Size: ", options.chunk_size, " Bytes");
+        logger.print(" - Chunk Size: ", options.chunk_size > 0
+                                            ? std::to_string(options.chunk_size) + " Bytes"
+                                            : "Auto");
+        logger.print(" - Window Size: ", options.window_size, " Chunks");
+        logger.print(" - Batch Size: ", options.batch_size, " Datagrams");
+        logger.print(" - Streams: ", options.streams);
+        logger.print(" - Segmentation Offload: ", options.gso ? "ON" : "OFF");
+        logger.print(" - Send From File: ", options.sendfile ? "ON" : "OFF");
+        logger.print(" - Zero Copy: ", options.zerocopy ? "ON" : "OFF");
+        logger.print(" - Delta: ", options.delta ? "ON" : "OFF");
+        logger.print(" - Deduplication: ", options.dedup ? "ON" : "OFF");
+        logger.print(" - Compression: ", options.compress ? "ON" : "OFF");
+        logger.print(" - Checksums: ", options.checksum ? "ON" : "OFF");
+        logger.print(" - Parities: ", options.fec_data > 0
+                                          ? std::to_string(options.fec_parity) + " of " +
+                                                std::to_string(options.fec_data) + " chunks"
+                                          : "OFF");
+        logger.print(" - File Reader: ", read_mode_name(options.read_mode));
+        logger.print(" - Wire Format: ", options.binary ? "binary" : "text");
+        logger.print(" - Congestion Control: ", congestion_mode_name(options.congestion));
+        logger.print(" - Rate Limit: ",
+                     options.rate > 0 ? fmt_size(options.rate) + "/s" : "(unlimited)");
         logger.print(" - Timeout (Recv): ", options.timeout_recv);
         logger.print(" - Timeout (Send): ", options.timeout_send);
     }
@@ -392,35 +1504,39 @@ int main(int argc, char* argv[]) {
     if (err != 0)
         return logger.error("Failed to create socket (", err, ")"), BasicSocket::terminate(), 1;
     // set opt
-    const int SND_TIMEOUT = options.timeout_send;
-    const int RCV_TIMEOUT = options.timeout_recv;
     int e1, e2;
-    e1 = setsockopt(client.socket(), SOL_SOCKET, SO_SNDTIMEO, (const char*)&SND_TIMEOUT,
-                    sizeof(SND_TIMEOUT));
-    e2 = setsockopt(client.socket(), SOL_SOCKET, SO_RCVTIMEO, (const char*)&RCV_TIMEOUT,
-                    sizeof(RCV_TIMEOUT));
+    e1 = set_socket_timeout(client.socket(), SO_SNDTIMEO, options.timeout_send);
+    e2 = set_socket_timeout(client.socket(), SO_RCVTIMEO, options.timeout_recv);
     if (e1 == SOCKET_ERROR || e2 == SOCKET_ERROR) {
         return logger.error("Failed to set socket options"), BasicSocket::terminate(), 1;
     }
     // check once more
     if (!client.ensure_socket())
         return logger.error("Socket is not active"), BasicSocket::terminate(), 1;
+    // segmentation offload
+    if (options.gso && client.enable_gso() != 0)
+        logger.warn("Segmentation offload is not available, datagrams are sent one by one");
+    // zero copy
+    if (options.zerocopy && client.enable_zerocopy() != 0)
+        logger.warn("Zero copy is not available, chunks are copied by the kernel");
 
     // cache
-    char* buf = new char[opt_chunk_size];
-    // ZeroMemory(buf, opt_chunk_size);
+    // large enough for any chunk size the server may take, unless it is given
+    int buf_size = opt_chunk_size > 0 ? opt_chunk_size : MAX_FRAME_LEN;
+    char* buf = new char[buf_size];
+    // ZeroMemory(buf, buf_size);
 
     if (options.ping) {
         // ping, only send hello
         auto conn = client.conn_info();
         std::string address = conn.to_string();
-        std::string type = conn.type == TYPE_STREAM ? "TCP" : TYPE_DGRAM ? "UDP" : "IP";
+        std::string type = conn.type == TYPE_STREAM ? "TCP" : conn.type == TYPE_DGRAM ? "UDP" : "IP";
         logger.print("PING ", address, " ", type, " ...");
         int maxtry = 4;
         for (int i = 0; i < maxtry; i++) {
             client.connect();
             auto start = Timer::point();
-            bool alive = check_alive(client, buf, opt_chunk_size, 0, false);
+            bool alive = check_alive(client, buf, buf_size, 0, false);
             auto end = Timer::point();
             std::string ms = std::to_string(Timer::duration(start, end));
             if (alive) {
@@ -441,7 +1557,7 @@ int main(int argc, char* argv[]) {
 
     // everything goes well
     client.connect();
-    if (!check_alive(client, buf, opt_chunk_size, 3, true)) {
+    if (!check_alive(client, buf, buf_size, 3, true)) {
         return logger.error("Cannot connect to server"), 1;
     } else {
         logger.debug("Connceted");
@@ -460,12 +1576,12 @@ int main(int argc, char* argv[]) {
             std::string fore_str = join_string(ansi::bright_cyan, "> ", ansi::reset, input);
             std::string fp = input;
 
-            if (!check_alive(client, buf, opt_chunk_size, 3, false)) {
+            if (!check_alive(client, buf, buf_size, 3, false)) {
                 logger.error("Cannot connect to server");
                 continue;
             }
 
-            err = send_file(client, fp, buf, opt_chunk_size);
+            err = send_file(client, fp, buf, chunk_size_of(client, buf, buf_size));
 
         } else if (input.size() > 0 && input.starts_with("@")) {
             if (input == "@exit" || input == "@quit" || input == "@q") {
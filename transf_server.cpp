@@ -1,14 +1,15 @@
-#include <winsock2.h>
-#include <ws2ipdef.h>
-#include <ws2tcpip.h>
+#include "platform.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstring>
 #include <filesystem>
-#include <fstream>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "ansi.h"
@@ -18,8 +19,15 @@
 #undef ERROR
 #endif
 #include "arguments.h"
+#include "checksum.h"
+#include "chunkindex.h"
+#include "compress.h"
+#include "delta.h"
+#include "fec.h"
+#include "journal.h"
 #include "logger.h"
 #include "network.h"
+#include "protocol.h"
 
 #ifdef _MSC_VER
 #pragma comment(lib, "ws2_32.lib")
@@ -27,17 +35,6 @@
 
 Logger logger("Tranf Server");
 
-#define UUID_LEN 36
-
-#define HEAD_HELLO "\013HELLO"
-#define HEAD_HS "\013HS"
-#define HEAD_TRANSFER "\013TRANSFER"
-#define HEAD_OK "\013OK"
-#define HEAD_RECEIVED "\013RECEIVED"
-#define HEAD_DONE "\013DONE"
-#define HEAD_REJECT "\013REJECT"
-#define HEAD_DROP "\013DROP"
-
 enum struct TransferStatus {
     HANDSHAKE,
     TRANSFERING,
@@ -45,22 +42,83 @@ enum struct TransferStatus {
 };
 
 std::string opt_abs_save_path = "";
+uint32_t opt_max_window = 64;
+int opt_keep = 0;  // seconds a partial file is kept for resuming, removed at once if 0
+int opt_chunk_size = 2048;  // the largest message received
+// files are written through a ring by the io_uring engine
+std::shared_ptr<RingWriter> file_writer = nullptr;
+// chunks of the files received, recipes of later files refer to them
+std::shared_ptr<ChunkIndex> chunk_index = nullptr;
+// files received are indexed on a thread of its own, the threads handling chunks never wait
+std::shared_ptr<WorkerPool> chunk_indexer = nullptr;
+
+// Chunks [first, last] of a transfer, sent by a stream of the client and acknowledged on their own
+struct TransferRange {
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t chunk = 0;  // the next chunk expected
+    // chunks received ahead of `chunk`, they will be written once the gap is filled
+    std::map<uint64_t, std::string> pending{};
+    // chunks written ahead of `chunk` at their offsets, by their sizes and CRCs
+    // chunks are placed once the size of a full chunk is known from the first one
+    // none is beyond the window, so they are kept by `chunk % window`, allocated on handshake
+    struct Placed {
+        uint64_t chunk = 0;  // 0 if the slot is empty
+        uint64_t size = 0;
+        uint32_t crc = 0;
+        uint32_t range_crc = 0;     // told by the client, of the range up to the chunk
+        bool has_range_crc = true;  // none is told of a chunk rebuilt inside its group
+    };
+    std::vector<Placed> placed{};
+    uint32_t n_placed = 0;
+    uint32_t crc = 0;  // of the chunks before `chunk`
+    // chunks of a group with parities are kept until the group is whole, the lost ones are
+    // rebuilt from the others and the parities, see `fec_rebuild`
+    struct Group {
+        std::vector<std::string> chunks;  // by index in the group
+        std::vector<bool> received;
+        std::map<uint32_t, std::string> parities;  // by index
+        uint32_t range_crc = 0;  // told by the parities, of the range up to the last chunk
+        bool whole = false;      // every chunk is received, nothing is kept
+    };
+    std::map<uint64_t, Group> groups{};  // by number, of chunks numbered from 0
+};
 
 struct TransferInfo {
     TransferStatus status;
     std::string filename;
-    u_long filesize;
+    uint64_t filesize;
     std::string abs_fp;
-    u_long written;
-    std::ofstream* fs;
-    u_long chunk;
+    uint64_t written;  // of all the ranges, up to their `chunk`
+    OutputFile* file;
+    uint32_t window;  // of each range
     int last_update_time;
-    std::mutex* mutex;
+    std::shared_ptr<std::mutex> mutex;
+    int fd = -1;  // written by `file_writer` instead of `file`
+    uint64_t chunk_size = 0;
+    std::vector<TransferRange> ranges;  // the chunks to receive, in order
+    std::string uuid;                   // the name of the transfer in text messages
+    uint64_t identity = 0;              // of the file, see `file_identity`, 0 if not resumable
+    // a delta is received instead, the file at `old_fp` is rebuilt from it in the end
+    std::string old_fp;  // empty if the file itself is received
+    uint64_t target_size = 0;
+    uint32_t block_size = 0;
+    bool recipe = false;  // a recipe of the chunks indexed instead of a delta
+    bool checksum = false;  // chunks carry CRCs, see CAP_CHECKSUM
+    // chunks and parities of a group, see CAP_FEC, 0 if there are no parities
+    uint32_t fec_data = 0;
+    uint32_t fec_parity = 0;
+    // The range of a chunk, a chunk beyond every range belongs to the nearest one
+    TransferRange& range_of(uint64_t chunk) {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), chunk,
+                                   [](uint64_t c, const TransferRange& r) { return c < r.first; });
+        return it == ranges.begin() ? ranges.front() : *(it - 1);
+    }
     int update_time() { return last_update_time = Timer::timestamp(); }
     bool use() {
-        bool is_lock = mutex->try_lock();
+        mutex->lock();
         update_time();
-        return is_lock;
+        return true;
     }
     bool unuse() {
         update_time();
@@ -69,267 +127,1031 @@ struct TransferInfo {
     }
 };
 
-std::map<std::string, TransferInfo> file_transfer_info;
+// transfers by session, see `session_of_uuid`
+std::unordered_map<uint64_t, TransferInfo> file_transfer_info;
 
 std::mutex file_transfer_info_mutex;
 
+// Close the file of a transfer, returns false if any write has failed
+bool close_transfer_file(TransferInfo& info) {
+    bool ok = true;
+    if (info.file != nullptr) {
+        ok = info.file->close() == 0;
+        delete info.file;
+        info.file = nullptr;
+    }
+    if (info.fd >= 0) {
+        ok = file_writer->close(info.fd) == 0;
+        info.fd = -1;
+    }
+    return ok;
+}
+
+// Remove the partially received file of a transfer, the caller shall own the transfer's mutex
+void remove_transfer_file(TransferInfo& info, const std::string& log_prefix = "") {
+    close_transfer_file(info);
+    // remove file object if exists
+    if (std::filesystem::exists(info.abs_fp)) {
+        bool success_remove = false;
+        try {
+            success_remove = std::filesystem::remove(info.abs_fp.c_str());
+        } catch (std::filesystem::filesystem_error& e) {
+            int prefixlen =
+                ansi::remove_ansi(logger.get_colored_prefix(Logger::Level::ERROR)).size();
+            logger.error(log_prefix, "Failed to remove file: ", ansi::gray, info.abs_fp,
+                         ansi::reset);
+            logger.level_print(Logger::Level::ERROR, std::string(prefixlen, ' '), e.what());
+        }
+        if (!success_remove) {
+            logger.error(log_prefix, "Failed to remove file: ", ansi::gray, info.abs_fp,
+                         ansi::reset);
+        } else {
+            logger.debug(log_prefix, "File removed: ", ansi::gray, info.abs_fp, ansi::reset);
+        }
+    }
+}
+
+// partial files kept for resuming, by path, to the time they are kept
+std::map<std::string, time_point_highclock> kept_files;
+std::mutex kept_files_mutex;
+
+// Stop a transfer before it completes, the caller shall own the transfer's mutex
+// Its partial file is kept with a journal of the chunks received if it may be resumed, or removed
+void stop_transfer(TransferInfo& info, const std::string& log_prefix = "") {
+    if (opt_keep <= 0 || info.identity == 0) return remove_transfer_file(info, log_prefix);
+    // the journal tells the chunks written only, so the writes in background finish first
+    if (!close_transfer_file(info)) return remove_transfer_file(info, log_prefix);
+    // the chunks missing of each range, the ones placed ahead are received
+    std::vector<ChunkRange> missing;
+    for (auto& r : info.ranges) {
+        uint64_t next = r.chunk;
+        for (uint64_t chunk = r.chunk; chunk < r.chunk + r.placed.size(); ++chunk) {
+            if (r.placed[chunk % r.placed.size()].chunk != chunk) continue;
+            if (chunk > next) missing.push_back({next, chunk - 1});
+            next = chunk + 1;
+        }
+        if (next <= r.last) missing.push_back({next, r.last});
+    }
+    uint64_t chunks = (info.filesize + info.chunk_size - 1) / info.chunk_size;
+    if (chunks == 0) chunks = 1;  // an empty file is sent as an empty chunk
+    Journal journal{info.filesize, info.chunk_size, info.identity,
+                    complement_ranges(missing, chunks)};
+    if (save_journal(info.abs_fp, journal) != 0) {
+        logger.error(log_prefix, "Failed to write journal: ", ansi::gray, info.abs_fp, ansi::reset);
+        return remove_transfer_file(info, log_prefix);
+    }
+    LockGuard lock(kept_files_mutex);
+    kept_files[info.abs_fp] = Timer::point();
+    logger.info(log_prefix, "Partial file kept for resuming (",
+                fmt_size(info.filesize - ranges_size(missing, info.filesize, info.chunk_size)),
+                " received): ", ansi::gray, info.abs_fp, ansi::reset);
+}
+
+// Take a partial file kept for resuming, returns false if it is not kept
+bool take_kept_file(const std::string& path) {
+    LockGuard lock(kept_files_mutex);
+    return kept_files.erase(path) > 0;
+}
+
 bool need_cleanup = false;
+std::shared_ptr<WorkerPool> worker_pool = nullptr;
+
+void log_worker_stats() {
+    if (worker_pool == nullptr || logger.get_level() > Logger::Level::DEBUG) return;
+    auto stats = worker_pool->stats(true);
+    logger.debug("[Workers] Queue depth ", stats.depth, " (max ", stats.max_depth, "/",
+                 worker_pool->capacity(), "), wait ", stats.avg_wait, " us (max ",
+                 stats.max_wait, " us), queued ", stats.submitted, ", dropped ", stats.dropped);
+}
 
 void cleanup_expired_file_transfer_info(int live_time, int check_interval) {
     while (need_cleanup) {
         logger.debug(("[Cleanup] Check start"));
         UniqueLock lockmap(file_transfer_info_mutex);
         int curtime = Timer::timestamp();
+        // the map stays locked, a transfer in use is skipped since we only try its mutex
         for (auto it = file_transfer_info.begin(); it != file_transfer_info.end();) {
-            lockmap.unlock();
-            std::string uuid = it->first;
             TransferInfo& info = it->second;
             auto pmutex = info.mutex;
             UniqueLock lock(*pmutex, std::try_to_lock);
             // still alive
-            if (!lock.owns_lock() && info.last_update_time + live_time > curtime) {
-                lockmap.lock();
+            if (!lock.owns_lock() || info.last_update_time + live_time > curtime) {
                 ++it;
                 continue;
             }
-            // not alive
-            logger.debug("[Cleanup] Cleaning expired file transfer: ", uuid);
-            if (info.fs != nullptr) {
-                info.fs->close();
-                delete info.fs;
-                info.fs = nullptr;
-            }
-            // remove file object if exists
-            if (std::filesystem::exists(info.abs_fp)) {
-                bool success_remove = false;
-                try {
-                    success_remove = std::filesystem::remove(info.abs_fp.c_str());
-                } catch (std::filesystem::filesystem_error& e) {
-                    int prefixlen =
-                        ansi::remove_ansi(logger.get_colored_prefix(Logger::Level::ERROR)).size();
-                    logger.error("[Cleanup] Failed to remove file: ", ansi::gray, info.abs_fp,
-                                 ansi::reset);
-                    logger.level_print(Logger::Level::ERROR, std::string(prefixlen, ' '), e.what());
-                }
-                if (!success_remove) {
-                    logger.error("[Cleanup] Failed to remove file: ", ansi::gray, info.abs_fp,
-                                 ansi::reset);
-                } else {
-                    logger.debug("[Cleanup] File removed: ", ansi::gray, info.abs_fp, ansi::reset);
-                }
-            }
+            // not alive, the file is kept if it has been received completely
+            logger.debug("[Cleanup] Cleaning expired file transfer: ", info.uuid);
+            if (info.status != TransferStatus::DONE) stop_transfer(info, "[Cleanup] ");
             // remove from map
-            lockmap.lock();
             it = file_transfer_info.erase(it);
             lock.unlock();
-            delete pmutex;
         }
         lockmap.unlock();
+        // partial files kept for too long
+        {
+            LockGuard lock(kept_files_mutex);
+            auto now = Timer::point();
+            for (auto it = kept_files.begin(); it != kept_files.end();) {
+                if (Timer::duration_us(it->second, now) / 1000000 < opt_keep) {
+                    ++it;
+                    continue;
+                }
+                logger.debug("[Cleanup] Removing partial file: ", ansi::gray, it->first,
+                             ansi::reset);
+                std::error_code ec;
+                std::filesystem::remove(it->first, ec);
+                remove_journal(it->first);
+                it = kept_files.erase(it);
+            }
+        }
+        log_worker_stats();
         logger.debug("[Cleanup] Check sleep");
         Timer::sleep(check_interval);
     }
 }
 
-#define headcmp(buf, head) memcmp(buf, head, strlen(head)) == 0
+// The address of a peer in log messages, formatted only if a message is printed
+struct PeerAddress {
+    const SocketPeer& peer;
+};
+
+std::ostream& operator<<(std::ostream& os, const PeerAddress& address) {
+    return os << address.peer.conn_info().to_string(true);
+}
 
-int handle_hello(const char* buf, int len, const SocketPeer& peer, const BasicSocket& server) {
-    auto address = peer.conn_info().to_string(true);
+int handle_hello(Message& msg, const SocketPeer& peer, const BasicSocket&) {
+    const char* buf = msg.data;
+    const int len = msg.len;
+    const PeerAddress address{peer};
 
     if (headcmp(buf, HEAD_HELLO)) {
         logger.debug(address, " - ", "Hello");
-        peer.send(HEAD_HELLO);
+        // the capabilities both support and the largest message received, a bare hello is
+        // answered with a bare one
+        int LEN_HEAD = strlen(HEAD_HELLO);
+        if (len < LEN_HEAD + (int)sizeof(uint32_t)) return peer.send(HEAD_HELLO), HANDLE_END;
+        uint32_t caps = get_u32(buf + LEN_HEAD) & CAPS_SUPPORTED;
+        // chunks are decompressed on the workers only, the loop threads would be kept from
+        // receiving for as long, e.g. 0.3 ms for a 64K chunk of text
+        if (worker_pool == nullptr) caps &= ~CAP_COMPRESS;
+        char reply[sizeof(HEAD_HELLO) + 2 * sizeof(uint32_t)];
+        memcpy(reply, HEAD_HELLO, LEN_HEAD);
+        put_u32(reply + LEN_HEAD, caps);
+        put_u32(reply + LEN_HEAD + sizeof(uint32_t), opt_chunk_size);
+        // the reply goes as the hello has come, a stream is framed from the message after it
+        if ((caps & CAP_FRAMING) && !peer.framed())
+            peer.send_framing(reply, LEN_HEAD + 2 * sizeof(uint32_t));
+        else
+            peer.send(reply, LEN_HEAD + 2 * sizeof(uint32_t));
         return HANDLE_END;
     }
 
     return HANDLE_NEXT;
 }
 
-int handle_file_transfer(const char* buf, int len, const SocketPeer& peer,
-                         const BasicSocket& server) {
-    auto address = peer.conn_info().to_string(true);
+// Replies are built on the stack, except for the long ones (e.g. signatures)
+#define REPLY_STACK_LEN 512
+
+struct ReplyBuffer {
+    char stack[REPLY_STACK_LEN];
+    std::vector<char> heap;
+
+    char* get(size_t size) {
+        if (size <= sizeof(stack)) return stack;
+        heap.resize(size);
+        return heap.data();
+    }
+};
+
+// Send a frame of the binary format
+void send_frame(const SocketPeer& peer, Opcode op, uint64_t session, uint64_t offset = 0,
+                const char* body = nullptr, uint32_t length = 0) {
+    ReplyBuffer reply;
+    char* msg = reply.get(FRAME_HEAD_LEN + length);
+    encode_head(msg, op, session, offset, length);
+    if (length > 0) memcpy(msg + FRAME_HEAD_LEN, body, length);
+    peer.send(msg, FRAME_HEAD_LEN + length);
+}
+
+// Find the transfer by session and lock it, `lock` owns the transfer's mutex if found.
+// Chunks of a window may be handled by several threads at the same time, so we wait for the
+// mutex instead of rejecting the chunk. The map is not locked while waiting, hence we have to
+// look up the transfer again, it may be removed in the meantime.
+// `pmutex` keeps the mutex alive even if the transfer is removed, declare it before `lock`.
+TransferInfo* lock_transfer_info(uint64_t session, std::shared_ptr<std::mutex>& pmutex,
+                                 UniqueLock& lock) {
+    {
+        UniqueLock lockmap(file_transfer_info_mutex);
+        auto it = file_transfer_info.find(session);
+        if (it == file_transfer_info.end()) return nullptr;
+        pmutex = it->second.mutex;
+    }
+    lock = UniqueLock(*pmutex);
+    UniqueLock lockmap(file_transfer_info_mutex);
+    auto it = file_transfer_info.find(session);
+    if (it == file_transfer_info.end() || it->second.mutex != pmutex) {
+        lock.unlock();
+        return nullptr;
+    }
+    return &it->second;
+}
+
+// How the chunks of a transfer are sent, which is told on handshake
+struct ChunkFormat {
+    bool checksum = false;    // the chunks carry CRCs
+    uint64_t chunk_size = 0;  // the size of a full chunk, 0 if the transfer is unknown
+};
+
+ChunkFormat chunk_format_of(uint64_t session) {
+    // a thread handles chunks of the same transfer mostly, and a session is never reused
+    thread_local uint64_t last_session = 0;
+    thread_local ChunkFormat last_format;
+    if (session != 0 && session == last_session) return last_format;
+    LockGuard lockmap(file_transfer_info_mutex);
+    auto it = file_transfer_info.find(session);
+    if (it == file_transfer_info.end()) return {};
+    last_session = session;
+    last_format = {.checksum = it->second.checksum, .chunk_size = it->second.chunk_size};
+    return last_format;
+}
+
+// The identity of a file the server has, 0 if there is none
+uint64_t identity_of(const std::string& fp) {
+    std::error_code ec1, ec2;
+    uint64_t size = std::filesystem::file_size(fp, ec1);
+    auto mtime = std::filesystem::last_write_time(fp, ec2);
+    return ec1 || ec2 ? 0 : file_identity(size, mtime.time_since_epoch().count());
+}
+
+// Returns true if the file is being received or kept partial, it is no base of a delta then
+bool is_partial_file(const std::string& fp) {
+    {
+        LockGuard lock(kept_files_mutex);
+        if (kept_files.count(fp) > 0) return true;
+    }
+    UniqueLock lockmap(file_transfer_info_mutex);
+    for (auto& [_, info] : file_transfer_info) {
+        if (info.abs_fp != fp && info.old_fp != fp) continue;
+        // a transfer in use is still receiving
+        UniqueLock lock(*info.mutex, std::try_to_lock);
+        if (!lock.owns_lock() || info.status != TransferStatus::DONE) return true;
+    }
+    return false;
+}
+
+// Rebuild the file of a delta transfer from the old one, or from the chunks indexed if a recipe is
+// received, which is removed either way. `chunks` are those of the file assembled from a recipe
+// Returns false if failed, the old file is kept then
+bool rebuild_from_delta(TransferInfo& info, std::vector<ContentChunk>& chunks) {
+    std::string tmp_fp = info.old_fp + ".tmp";
+    std::error_code ec;
+    bool ok = info.recipe ? chunk_index != nullptr &&
+                                chunk_index->assemble(info.abs_fp, tmp_fp, info.target_size,
+                                                      chunks) == 0
+                          : apply_delta(info.abs_fp, info.old_fp, info.block_size, tmp_fp,
+                                        info.target_size) == 0;
+    // the old file is replaced at once
+    if (ok) std::filesystem::rename(tmp_fp, info.old_fp, ec);
+    if (!ok || ec) std::filesystem::remove(tmp_fp, ec);
+    std::filesystem::remove(info.abs_fp, ec);
+    return ok && std::filesystem::exists(info.old_fp) && !std::filesystem::exists(tmp_fp);
+}
+
+// Index the chunks of a file received, they are split from the file if unknown
+// Returns false if failed
+bool index_chunks(const std::string& fp, std::vector<ContentChunk>& chunks) {
+    if (chunks.empty()) {
+        FileSource source;
+        int err = source.open(fp) != 0 || cdc_split(source, chunks) != 0;
+        source.close();
+        if (err) return false;
+    }
+    return chunk_index->add(fp, chunks) == 0;
+}
+
+int handle_file_transfer(Message& msg, const SocketPeer& peer, const BasicSocket&) {
+    const char* buf = msg.data;
+    const int len = msg.len;
+    const PeerAddress address{peer};
 
     const bool IS_DEBUG = logger.get_level() <= Logger::Level::DEBUG;
 
+    // a message is either a frame or a text message, it is answered in the same format
+    FrameHead frame;
+    const bool IS_FRAME = decode_head(buf, len, frame);
+    if (!IS_FRAME && is_frame(buf, len)) return send_frame(peer, Opcode::REJECT, 0), HANDLE_END;
+    // refuse the request, or give up the transfer
+    auto reject = [&peer, IS_FRAME](uint64_t session) {
+        IS_FRAME ? send_frame(peer, Opcode::REJECT, session) : (void)peer.send(HEAD_REJECT);
+    };
+    auto give_up = [&peer, IS_FRAME](uint64_t session) {
+        IS_FRAME ? send_frame(peer, Opcode::ABORT, session) : (void)peer.send(HEAD_DROP);
+    };
+
     // Handshake
-    if (headcmp(buf, HEAD_HS)) {
+    // a delta or a recipe is sent instead of the file with a handshake of its own
+    const bool IS_DELTA = IS_FRAME && frame.op == Opcode::DELTA;
+    const bool IS_DEDUP = IS_FRAME && frame.op == Opcode::DEDUP;
+    if (IS_FRAME ? frame.op == Opcode::HS || IS_DELTA || IS_DEDUP : headcmp(buf, HEAD_HS)) {
         logger.debug(address, " - ", "Handshake");
-        int LEN_HEAD = strlen(HEAD_HS);
+        uint64_t file_size, target_size;
+        uint32_t window, chunk_size = 0, streams = 1;
+        uint64_t identity = 0;
+        uint32_t caps = 0;  // used by the transfer
+        uint32_t fec_data = 0, fec_parity = 0;
+        bool window_told = false;  // by a text handshake
+        std::string fn;
+        if (IS_FRAME) {
+            // chunks are named by their offsets, the size of a full chunk is told beforehand
+            const bool HAS_TARGET = IS_DELTA || IS_DEDUP;
+            int LEN_FIELDS = 3 * sizeof(uint32_t) + (HAS_TARGET ? 2 : 1) * sizeof(uint64_t);
+            if (frame.length < (uint32_t)LEN_FIELDS) return reject(0), HANDLE_END;
+            const char* body = buf + FRAME_HEAD_LEN;
+            file_size = frame.offset;
+            window = get_u32(body);
+            chunk_size = get_u32(body + sizeof(uint32_t));
+            streams = get_u32(body + 2 * sizeof(uint32_t));
+            identity = get_u64(body + 3 * sizeof(uint32_t));
+            target_size = HAS_TARGET ? get_u64(body + 3 * sizeof(uint32_t) + sizeof(uint64_t))
+                                     : file_size;
+            fn.assign(body + LEN_FIELDS, frame.length - LEN_FIELDS);
+            if (chunk_size == 0) return reject(0), HANDLE_END;
+            // the capabilities used follow the name
+            if (size_t end = fn.find('\0'); end != std::string::npos) {
+                if (fn.size() - end - 1 < sizeof(uint32_t)) return reject(0), HANDLE_END;
+                caps = get_u32(fn.data() + end + 1) & CAPS_SUPPORTED;
+                // the size of a group of chunks and its parities follow
+                const size_t LEN_FEC = 1 + 3 * sizeof(uint32_t);
+                if (caps & CAP_FEC) {
+                    if (fn.size() - end < LEN_FEC) return reject(0), HANDLE_END;
+                    fec_data = get_u32(fn.data() + end + 1 + sizeof(uint32_t));
+                    fec_parity = get_u32(fn.data() + end + 1 + 2 * sizeof(uint32_t));
+                    if (fec_data == 0 || fec_data > FEC_MAX_DATA || fec_parity == 0 ||
+                        fec_parity > FEC_MAX_PARITY)
+                        return reject(0), HANDLE_END;
+                }
+                fn.resize(end);
+            }
+        } else {
+            int LEN_HEAD = strlen(HEAD_HS);
+            int LEN_FIELDS = sizeof(uint32_t);
+            if (len < LEN_HEAD + LEN_FIELDS) return reject(0), HANDLE_END;
+
+            // the size is 32-bit in text messages
+            uint32_t file_size_net;
+            memcpy(&file_size_net, buf + LEN_HEAD, sizeof(uint32_t));
+            file_size = target_size = ntohl(file_size_net);
+            fn.assign(buf + LEN_HEAD + LEN_FIELDS, len - LEN_HEAD - LEN_FIELDS);
+            // the window follows the name with CAP_WINDOW, a client of the first version sends
+            // a chunk at a time
+            window = 1;
+            if (size_t end = fn.find('\0'); end != std::string::npos) {
+                if (fn.size() - end - 1 < sizeof(uint32_t)) return reject(0), HANDLE_END;
+                window = get_u32(fn.data() + end + 1);
+                fn.resize(end);
+                window_told = true;
+            }
+        }
 
-        u_long file_size;
-        memcpy(&file_size, buf + LEN_HEAD, sizeof(u_long));
-        file_size = ntohl(file_size);
-        std::string fn(buf + LEN_HEAD + sizeof(u_long), len - LEN_HEAD - sizeof(u_long));
+        // negotiate window size, it never exceeds the server's limit
+        if (window == 0) window = 1;
+        if (window > opt_max_window) window = opt_max_window;
 
         // check filename (starts with /, or contains .., or empty)
         if (fn.size() == 0 || fn[0] == '/' || fn.find("..") != std::string::npos) {
             logger.info(address, " - ", "Refused to receive file: ", fn);
             // send reject
-            return peer.send(HEAD_REJECT), HANDLE_END;
+            return reject(0), HANDLE_END;
         }
 
         // create directory
         std::filesystem::path save_dir_abspath(opt_abs_save_path);
-        int create_dir_err = CreateDirectory(save_dir_abspath.string().c_str(), NULL);
-        int is_already_exists = create_dir_err == 0 && GetLastError() == ERROR_ALREADY_EXISTS;
-        bool dir_err = create_dir_err == 0 && !is_already_exists;
-        // create file
+        std::error_code dir_ec;
+        std::filesystem::create_directory(save_dir_abspath, dir_ec);
+        bool dir_err = !std::filesystem::is_directory(save_dir_abspath, dir_ec);
         std::string save_fp_str = (save_dir_abspath / fn).string();
-        std::ofstream* pfs = new std::ofstream(save_fp_str, std::ios::binary);
-        if (dir_err || !pfs->is_open()) {
-            logger.error(address, " - ", "Failed to create file: ", save_fp_str);
-            // send drop
-            pfs->close();
-            delete pfs;
-            return peer.send(HEAD_DROP), HANDLE_END;
+        // a delta is received beside the file it rebuilds, which shall be the one signed
+        std::string recv_fp = save_fp_str;
+        uint32_t block_size = 0;
+        if (IS_DELTA) {
+            if (is_partial_file(save_fp_str) || identity_of(save_fp_str) != identity) {
+                logger.info(address, " - ", "Refused delta of changed file: ", fn);
+                return reject(0), HANDLE_END;
+            }
+            std::error_code ec;
+            block_size = delta_block_size(std::filesystem::file_size(save_fp_str, ec));
+            recv_fp = save_fp_str + DELTA_SUFFIX;
+            identity = 0;  // a delta is not resumed
+        } else if (IS_DEDUP) {
+            if (chunk_index == nullptr || is_partial_file(save_fp_str)) {
+                logger.info(address, " - ", "Refused recipe of file: ", fn);
+                return reject(0), HANDLE_END;
+            }
+            recv_fp = save_fp_str + RECIPE_SUFFIX;
+            identity = 0;
         }
 
-        logger.info(address, " - ", "Receiving file (", fmt_size(file_size), "): ", ansi::gray, fn,
-                    ansi::reset);
+        // the chunks to send, split into a range for each stream, every range has a chunk at least
+        // the number of chunks of a text transfer is unknown until the first chunk comes
+        std::vector<ChunkRange> to_send;
+        // a partial file kept is resumed if it is of the same file, only the chunks missing are
+        // sent, or it is replaced, it belongs to this transfer either way
+        Journal journal;
+        bool kept = take_kept_file(save_fp_str) && load_journal(save_fp_str, journal) == 0;
+        remove_journal(save_fp_str);
+        bool resumed = false;
+        if (IS_FRAME) {
+            uint64_t chunks = std::max<uint64_t>((file_size + chunk_size - 1) / chunk_size, 1);
+            streams = std::clamp<uint64_t>(std::min<uint64_t>(streams, MAX_STREAMS), 1, chunks);
+            std::error_code ec;
+            resumed = kept && identity != 0 && journal.identity == identity &&
+                      journal.size == file_size && journal.chunk_size == chunk_size &&
+                      std::filesystem::file_size(save_fp_str, ec) == file_size && !ec;
+            if (resumed) {
+                to_send = complement_ranges(journal.received, chunks);
+                // every chunk is received, the last one is sent again to complete the transfer
+                if (to_send.empty()) to_send.push_back({chunks, chunks});
+                // the ranges are listed in the reply, which fits a chunk
+                size_t max_ranges = (std::max<size_t>(chunk_size, 2 * sizeof(uint32_t)) -
+                                     2 * sizeof(uint32_t)) /
+                                    (2 * sizeof(uint64_t));
+                merge_ranges(to_send, std::clamp<size_t>(max_ranges, 1, MAX_RANGES));
+                split_ranges(to_send, streams);
+                streams = std::min<uint64_t>(streams, to_send.size());
+            } else {
+                for (uint32_t i = 0; i < streams; ++i)
+                    to_send.push_back({range_first(chunks, streams, i),
+                                       range_first(chunks, streams, i + 1) - 1});
+            }
+        } else {
+            to_send.push_back({1, UINT64_MAX});
+        }
+        std::vector<TransferRange> ranges;
+        for (auto& r : to_send)
+            ranges.push_back({.first = r.first,
+                              .last = r.last,
+                              .chunk = r.first,
+                              .placed = std::vector<TransferRange::Placed>(window)});
+        // bytes received already
+        uint64_t written = resumed ? file_size - ranges_size(to_send, file_size, chunk_size) : 0;
 
-        auto uuid = uuid_v1();
+        // create file
+        // the file is allocated at full size, chunks are placed at their offsets
+        int fd = file_writer != nullptr ? file_writer->open(recv_fp, file_size, resumed) : -1;
+        OutputFile* pfile = fd >= 0 ? nullptr : new OutputFile();
+        if (dir_err || (pfile != nullptr && pfile->open(recv_fp, file_size, resumed) != 0)) {
+            logger.error(address, " - ", "Failed to create file: ", recv_fp);
+            // send drop
+            delete pfile;
+            if (fd >= 0) file_writer->close(fd);
+            return give_up(0), HANDLE_END;
+        }
 
-        TransferInfo info{
-            TransferStatus::HANDSHAKE, fn, file_size, save_fp_str, 0, pfs, 1, Timer::timestamp(),
-            new std::mutex()};
+        if (resumed) {
+            logger.info(address, " - ", "Resuming file (", fmt_size(file_size - written), " of ",
+                        fmt_size(file_size), " left): ", ansi::gray, fn, ansi::reset);
+        } else if (IS_DELTA || IS_DEDUP) {
+            logger.info(address, " - ", "Receiving ", IS_DEDUP ? "recipe" : "delta", " (",
+                        fmt_size(file_size), " of ",
+                        fmt_size(target_size), "): ", ansi::gray, fn, ansi::reset);
+        } else {
+            logger.info(address, " - ", "Receiving file (", fmt_size(file_size), "): ", ansi::gray,
+                        fn, ansi::reset);
+        }
+        logger.debug(address, " - ", "Window size: ", window);
+        logger.debug(address, " - ", "Output: ",
+                     pfile == nullptr ? "ring" : pfile->mapped() ? "mapped" : "positional writes");
+        logger.debug(address, " - ", "Format: ", IS_FRAME ? "binary" : "text");
+        if (streams > 1) logger.debug(address, " - ", "Streams: ", streams);
+        if (caps & CAP_CHECKSUM) logger.debug(address, " - ", "Checksums: ON");
+        if (caps & CAP_FEC)
+            logger.debug(address, " - ", "Parities: ", fec_parity, " of ", fec_data, " chunks");
+
+        TransferInfo info{TransferStatus::HANDSHAKE,
+                          fn,
+                          file_size,
+                          recv_fp,
+                          written,
+                          pfile,
+                          window,
+                          Timer::timestamp(),
+                          std::make_shared<std::mutex>(),
+                          fd,
+                          chunk_size,
+                          std::move(ranges),
+                          "",
+                          identity,
+                          IS_DELTA || IS_DEDUP ? save_fp_str : "",
+                          target_size,
+                          block_size,
+                          IS_DEDUP,
+                          (caps & CAP_CHECKSUM) != 0,
+                          fec_data,
+                          fec_parity};
         // ! Do not forget to unuse() before return !! Or it will never be used again or removed !!!
         info.use();
+        uint64_t session;
         {  // insert to map, it may be deleted if info is not in use
             UniqueLock _lock(file_transfer_info_mutex);
-            file_transfer_info.insert({uuid, info});
+            do {
+                info.uuid = uuid_v1();
+                session = session_of_uuid(info.uuid.c_str());
+            } while (!file_transfer_info.try_emplace(session, info).second);
         }
+        const std::string uuid = info.uuid;
 
         // only stream socket will call this onclose
-        peer.onclose([uuid](const SocketPeer& peer) -> int {
+        peer.onclose([uuid, session](const SocketPeer& peer) -> int {
             logger.info(peer.conn_info().to_string(true), "- Connection closed - ", uuid);
+            std::shared_ptr<std::mutex> pmutex;
+            UniqueLock lock;
+            TransferInfo* pinfo = lock_transfer_info(session, pmutex, lock);
+            if (pinfo == nullptr) return 0;
+            if (pinfo->status != TransferStatus::DONE) stop_transfer(*pinfo);
             UniqueLock _lock(file_transfer_info_mutex);
-            auto it = file_transfer_info.find(uuid);
-            if (it != file_transfer_info.end()) {
-                auto pmutex = it->second.mutex;
-                TransferInfo& info = it->second;
-                if (info.fs != nullptr) {
-                    info.fs->close();
-                    delete info.fs;
-                    info.fs = nullptr;
-                }
-
-                // remove file object if exists
-                if (std::filesystem::exists(info.abs_fp)) {
-                    bool success_remove = false;
-                    try {
-                        success_remove = std::filesystem::remove(info.abs_fp.c_str());
-                    } catch (std::filesystem::filesystem_error& e) {
-                        int prefixlen =
-                            ansi::remove_ansi(logger.get_colored_prefix(Logger::Level::ERROR))
-                                .size();
-                        logger.error("Failed to remove file: ", ansi::gray, info.abs_fp,
-                                     ansi::reset);
-                        logger.level_print(Logger::Level::ERROR, std::string(prefixlen, ' '),
-                                           e.what());
-                    }
-                    if (!success_remove) {
-                        logger.error("Failed to remove file: ", ansi::gray, info.abs_fp,
-                                     ansi::reset);
-                    } else {
-                        logger.debug("File removed: ", ansi::gray, info.abs_fp, ansi::reset);
-                    }
-                }
-
-                file_transfer_info.erase(uuid);
-                pmutex->unlock();
-                delete pmutex;
-            }
+            file_transfer_info.erase(session);
             return 0;
         });
 
-        peer.send(HEAD_OK + uuid);
+        if (IS_FRAME) {
+            std::string body(2 * sizeof(uint32_t) + to_send.size() * 2 * sizeof(uint64_t), '\0');
+            put_u32(body.data(), window);
+            put_u32(body.data() + sizeof(uint32_t), streams);
+            char* p = body.data() + 2 * sizeof(uint32_t);
+            for (auto& r : to_send) {
+                put_u64(p, r.first);
+                put_u64(p + sizeof(uint64_t), r.last);
+                p += 2 * sizeof(uint64_t);
+            }
+            send_frame(peer, Opcode::OK, session, 0, body.data(), body.size());
+        } else {
+            uint32_t window_net = htonl(window);
+            std::string reply = HEAD_OK + uuid;
+            if (window_told) reply.append((const char*)&window_net, sizeof(uint32_t));
+            peer.send(reply);
+        }
         return info.unuse(), HANDLE_END;
 
     }
 
     // Transfer
-    else if (headcmp(buf, HEAD_TRANSFER)) {
+    else if (IS_FRAME ? frame.op == Opcode::TRANSFER || frame.op == Opcode::PACKED ||
+                            frame.op == Opcode::PARITY
+                      : headcmp(buf, HEAD_TRANSFER)) {
         logger.debug(address, " - ", "Transfering");
         int LEN_HEAD = strlen(HEAD_TRANSFER);
+        int LEN_CHUNK_HEAD = IS_FRAME ? FRAME_HEAD_LEN : LEN_HEAD + UUID_LEN + sizeof(uint32_t);
+        if (len < LEN_CHUNK_HEAD) return reject(0), HANDLE_END;
+        const char* data = buf + LEN_CHUNK_HEAD;
+        int data_len = IS_FRAME ? frame.length : len - LEN_CHUNK_HEAD;
+        // a parity of a group of chunks, named by the first chunk
+        const bool IS_PARITY = IS_FRAME && frame.op == Opcode::PARITY;
+        uint32_t parity_index = 0;
+        if (IS_PARITY) {
+            if (data_len < (int)sizeof(uint32_t)) return reject(frame.session), HANDLE_END;
+            parity_index = get_u32(data);
+            data += sizeof(uint32_t);
+            data_len -= sizeof(uint32_t);
+        }
+        // the CRCs of the chunk and of its range up to it, a parity has its own CRC and the one
+        // of its range up to the last chunk of the group
+        const ChunkFormat FORMAT = IS_FRAME ? chunk_format_of(frame.session) : ChunkFormat{};
+        const bool CHECKSUM = FORMAT.checksum;
+        uint32_t crc = 0, range_crc = 0;
+        if (CHECKSUM) {
+            const int LEN_CHECKSUMS = 2 * sizeof(uint32_t);
+            if (data_len < LEN_CHECKSUMS) return reject(frame.session), HANDLE_END;
+            crc = get_u32(data);
+            range_crc = get_u32(data + sizeof(uint32_t));
+            data += LEN_CHECKSUMS;
+            data_len -= LEN_CHECKSUMS;
+        }
+        // a chunk found corrupt is asked again, as if dropped
+        auto drop_corrupt = [&]() {
+            logger.debug(address, " - ", "Corrupt chunk at ", frame.offset, ", asked again");
+            send_frame(peer, Opcode::DROP, frame.session, frame.offset);
+        };
+        // a compressed chunk is decompressed on a worker before the transfer is locked, so the
+        // streams of a transfer do it at once, compression is never granted without workers
+        if (IS_FRAME && frame.op == Opcode::PACKED) {
+            if (worker_pool == nullptr) return reject(frame.session), HANDLE_END;
+            thread_local std::vector<char> unpacked;
+            const int LEN_RAW = sizeof(uint32_t);
+            // a chunk is unpacked to a full chunk at most, and a byte is decompressed to 255 bytes
+            // at most, so that no more is allocated than the transfer takes
+            uint32_t raw_len = data_len >= LEN_RAW ? get_u32(data) : 0;
+            if (data_len < LEN_RAW || raw_len > FORMAT.chunk_size ||
+                raw_len > (uint64_t)data_len * 255)
+                return reject(frame.session), HANDLE_END;
+            unpacked.resize(raw_len);
+            if (lz_decompress(data + LEN_RAW, data_len - LEN_RAW, unpacked.data(), raw_len) !=
+                (int)raw_len) {
+                if (CHECKSUM) return drop_corrupt(), HANDLE_END;
+                return reject(frame.session), HANDLE_END;
+            }
+            data = unpacked.data();
+            data_len = raw_len;
+        }
+        // checked before the transfer is locked as well, a parity is never sent again
+        if (CHECKSUM && crc32c(data, data_len) != crc) {
+            if (!IS_PARITY) return drop_corrupt(), HANDLE_END;
+            logger.debug(address, " - ", "Corrupt parity at ", frame.offset, ", ignored");
+            return HANDLE_END;
+        }
 
-        // check uuid
-        std::string uuid(buf + LEN_HEAD, UUID_LEN);
+        // check session, a text message names it by uuid
+        uint64_t session = IS_FRAME ? frame.session : session_of_uuid(buf + LEN_HEAD);
+
+        std::shared_ptr<std::mutex> pmutex;
+        UniqueLock lock;
+        TransferInfo* pinfo = lock_transfer_info(session, pmutex, lock);
+        if (pinfo == nullptr ||
+            (!IS_FRAME && memcmp(pinfo->uuid.data(), buf + LEN_HEAD, UUID_LEN) != 0))
+            return reject(session), HANDLE_END;
+        TransferInfo& info = *pinfo;
+        info.update_time();
+        const std::string& uuid = info.uuid;
         if (IS_DEBUG) logger.instant(ansi::cursor_prev_line(1) + ansi::clear_line);
         logger.debug(address, " - ", "Transfering - ", uuid);
 
-        UniqueLock lockmap(file_transfer_info_mutex);  // lock global map
-        auto it = file_transfer_info.find(uuid);
-        if (it == file_transfer_info.end()) return peer.send(HEAD_REJECT), HANDLE_END;
+        // verify chunk
+        uint64_t chunk;
+        if (IS_FRAME) {
+            if (frame.offset % info.chunk_size != 0 || (uint64_t)data_len > info.chunk_size ||
+                (IS_PARITY && parity_index >= info.fec_parity))
+                return reject(session), HANDLE_END;
+            chunk = frame.offset / info.chunk_size + 1;
+        } else {
+            uint32_t chunk_net;
+            memcpy(&chunk_net, buf + LEN_HEAD + UUID_LEN, sizeof(uint32_t));
+            chunk = ntohl(chunk_net);
+        }
+        // every range makes progress on its own
+        TransferRange& range = info.range_of(chunk);
+
+        // acknowledge cumulatively, i.e. the next chunk expected of the range
+        // replies are sent with the mutex held, so that they leave in order of progress
+        auto reply = [&peer, &info, &range, session, IS_FRAME](bool done) {
+            const char* HEAD = done ? HEAD_DONE : HEAD_RECEIVED;
+            const int LEN_HEAD = IS_FRAME ? FRAME_HEAD_LEN
+                                          : strlen(HEAD) + UUID_LEN + sizeof(uint32_t);
+            // selective acknowledgement, bit i (LSB first) is set if chunk `range.chunk + 1 + i`
+            // has been received, then the client resends the missing chunks only
+            const int LEN_SACK = done ? 0 : (info.window + 7) / 8;
+            ReplyBuffer storage;
+            char* out = storage.get(LEN_HEAD + LEN_SACK);
+            char* sack = out + LEN_HEAD;
+            memset(sack, 0, LEN_SACK);
+            auto set_sack = [&](uint64_t chunk) {
+                uint64_t i = chunk - range.chunk - 1;
+                if (i < (uint64_t)LEN_SACK * 8) sack[i / 8] |= 1 << (i % 8);
+            };
+            for (auto& [chunk, _] : range.pending) set_sack(chunk);
+            for (auto& placed : range.placed) {
+                if (placed.chunk > range.chunk) set_sack(placed.chunk);
+            }
+            if (IS_FRAME) {
+                // frames name the chunk by its offset
+                encode_head(out, done ? Opcode::DONE : Opcode::RECEIVED, session,
+                            (range.chunk - 1) * info.chunk_size, LEN_SACK);
+            } else {
+                memcpy(out, HEAD, strlen(HEAD));
+                memcpy(out + strlen(HEAD), info.uuid.data(), UUID_LEN);
+                put_u32(out + strlen(HEAD) + UUID_LEN, range.chunk);
+            }
+            peer.send(out, LEN_HEAD + LEN_SACK);
+        };
 
-        TransferInfo& info = it->second;
-        if (!info.use()) return info.unuse(), peer.send(HEAD_REJECT), HANDLE_END;
-        lockmap.unlock();
+        // the client missed the reply of the last chunk
+        if (info.status == TransferStatus::DONE) return reply(true), HANDLE_END;
+        info.status = TransferStatus::TRANSFERING;
 
-        // verify chunk
-        u_long chunk;
-        memcpy(&chunk, buf + LEN_HEAD + UUID_LEN, sizeof(u_long));
-        chunk = ntohl(chunk);
         if (IS_DEBUG) logger.instant(ansi::cursor_prev_line(1) + ansi::clear_line);
-        logger.debug(address, " - ", "Transfering - ", uuid, " - ", chunk, "/", info.chunk);
-        if (chunk != info.chunk) return info.unuse(), peer.send(HEAD_REJECT), HANDLE_END;
-
-        auto& fs = *info.fs;
-
-        int this_written = len - LEN_HEAD - UUID_LEN - sizeof(u_long);
-        if (this_written <= 0)
-            this_written = 0;
-        else if (info.filesize <= info.written)
-            this_written = 0;
-        else if (info.filesize < info.written + this_written)
-            this_written = info.filesize - info.written;
-
-        if (this_written > 0) {
-            if (!fs.is_open()) return info.unuse(), peer.send(HEAD_DROP), HANDLE_END;
-            fs.write(buf + LEN_HEAD + UUID_LEN + sizeof(u_long), this_written);
-            // info.written = fs.tellp();
+        logger.debug(address, " - ", "Transfering - ", uuid, " - ", chunk, "/", range.chunk);
+
+        // write at an offset of the file, data beyond the file size is cut off, returns the size
+        // written, or -1 if the file is unavailable
+        auto write_at = [&info](const char* data, uint64_t size, uint64_t offset) -> long long {
+            if (offset >= info.filesize) return 0;
+            if (size > info.filesize - offset) size = info.filesize - offset;
+            if (size == 0) return 0;
+            // positional writes through the ring go on in background
+            int err = info.fd >= 0 ? file_writer->write(info.fd, data, size, offset)
+                      : info.file != nullptr ? info.file->write(data, size, offset)
+                                             : 1;
+            return err != 0 ? -1 : size;
+        };
+        // write the next chunk of the range, returns false if file is unavailable
+        // every chunk but the last is full, so the offset follows from the chunk number
+        auto write_chunk = [&info, &range, &write_at](const char* data, int size) -> bool {
+            if (info.chunk_size == 0) info.chunk_size = size;
+            long long this_written = write_at(data, size, (range.chunk - 1) * info.chunk_size);
+            if (this_written < 0) return false;
             info.written += this_written;
-            if (IS_DEBUG) logger.instant(ansi::cursor_prev_line(1) + ansi::clear_line);
-            logger.debug(address, " - ", "Transfering - ", uuid, " - ", chunk, "/", info.chunk,
-                         " - add ", info.written, "/", info.filesize, " bytes");
-            ++info.chunk;
-        }
-        u_long chunk_net = htonl(info.chunk);
-        if (info.written >= info.filesize) {
-            fs.close();
-            delete info.fs;
-            info.fs = nullptr;
-            logger.info(address, " - ", "File received (", fmt_size(info.filesize),
+            ++range.chunk;
+            return true;
+        };
+
+        // the CRC of the range goes on with each chunk in order, and is checked against the one
+        // the client tells, so the whole range is checked once its last chunk is
+        // a chunk rebuilt from parities is told by them if it is the last of its group, and one
+        // rebuilt inside its group is checked with the last chunk, received or rebuilt
+        auto check_range = [&info, &range](uint64_t size, uint32_t crc, uint32_t range_crc,
+                                           bool has_range_crc) {
+            if (!info.checksum) return true;
+            range.crc = crc32c_combine(range.crc, crc, size);
+            return !has_range_crc || range.crc == range_crc;
+        };
+        // the chunks received differ from those sent, which no chunk resent mends
+        auto give_up_mismatch = [&]() {
+            logger.error(address, " - ", "Checksum mismatch of file: ", info.filename);
+            info.identity = 0;  // not kept for resuming
+            remove_transfer_file(info);
+            give_up(session);
+        };
+
+        // take a chunk of the range, returns false if the transfer is given up
+        // chunks before `range.chunk` are duplicated, and chunks beyond the window are dropped,
+        // both of them are answered with the current progress only
+        auto take_chunk = [&](uint64_t chunk, const char* data, int data_len, uint32_t crc,
+                              uint32_t range_crc, bool has_range_crc) -> bool {
+            if (chunk == range.chunk && chunk <= range.last) {
+                if (!check_range(data_len, crc, range_crc, has_range_crc))
+                    return give_up_mismatch(), false;
+                if (!write_chunk(data, data_len)) return give_up(session), false;
+                // flush the chunks received in advance, and skip the ones already placed
+                while (true) {
+                    if (auto it = range.pending.find(range.chunk); it != range.pending.end()) {
+                        if (!write_chunk(it->second.data(), it->second.size()))
+                            return give_up(session), false;
+                        range.pending.erase(it);
+                    } else if (auto& placed = range.placed[range.chunk % info.window];
+                               placed.chunk == range.chunk) {
+                        if (!check_range(placed.size, placed.crc, placed.range_crc,
+                                         placed.has_range_crc))
+                            return give_up_mismatch(), false;
+                        info.written += placed.size;
+                        ++range.chunk;
+                        placed.chunk = 0;
+                        --range.n_placed;
+                    } else {
+                        break;
+                    }
+                }
+                if (IS_DEBUG) logger.instant(ansi::cursor_prev_line(1) + ansi::clear_line);
+                logger.debug(address, " - ", "Transfering - ", uuid, " - ", chunk, "/",
+                             range.chunk, " - add ", info.written, "/", info.filesize, " bytes");
+            } else if (chunk > range.chunk && chunk < range.chunk + info.window &&
+                       chunk <= range.last) {
+                if (info.chunk_size == 0) {
+                    range.pending.try_emplace(chunk, data, data_len);
+                } else if (auto& placed = range.placed[chunk % info.window];
+                           placed.chunk != chunk) {
+                    long long size = write_at(data, data_len, (chunk - 1) * info.chunk_size);
+                    if (size < 0) return give_up(session), false;
+                    if (placed.chunk == 0) ++range.n_placed;
+                    placed = {chunk, (uint64_t)size, crc, range_crc, has_range_crc};
+                }
+            }
+            return true;
+        };
+
+        // groups of chunks with parities, numbered from 0, the range cuts them at its ends
+        const uint64_t FEC_K = info.fec_data;
+        auto group_first = [&](uint64_t g) { return std::max(g * FEC_K + 1, range.first); };
+        auto group_last = [&](uint64_t g) { return std::min(g * FEC_K + FEC_K, range.last); };
+        auto group_of = [&](uint64_t g) -> TransferRange::Group& {
+            auto [it, added] = range.groups.try_emplace(g);
+            if (added) {
+                it->second.chunks.resize(FEC_K);
+                it->second.received.resize(FEC_K);
+            }
+            return it->second;
+        };
+        // keep a chunk taken until its group is whole
+        auto keep_chunk = [&](uint64_t chunk, const char* data, int data_len) {
+            uint64_t g = (chunk - 1) / FEC_K;
+            auto& group = group_of(g);
+            size_t i = chunk - 1 - g * FEC_K;
+            if (group.whole || group.received[i]) return;
+            group.chunks[i].assign(data, data_len);
+            group.received[i] = true;
+            auto count = std::count(group.received.begin(), group.received.end(), true);
+            if ((uint64_t)count < group_last(g) - group_first(g) + 1) return;
+            group.whole = true;
+            group.chunks.clear();
+            group.parities.clear();
+        };
+        // rebuild the chunks lost of group `g` once it has as many parities, so that the client
+        // need not send them again, returns false if the transfer is given up
+        auto rebuild_group = [&](uint64_t g) -> bool {
+            auto it = range.groups.find(g);
+            if (it == range.groups.end() || it->second.whole) return true;
+            auto& group = it->second;
+            std::vector<int> lost, rows;
+            for (uint64_t c = group_first(g); c <= group_last(g); ++c) {
+                if (!group.received[c - 1 - g * FEC_K]) lost.push_back(c - 1 - g * FEC_K);
+            }
+            if (lost.empty() || lost.size() > group.parities.size()) return true;
+            // the parities are as long as the longest chunk, less the chunks received
+            const size_t LEN = group.parities.begin()->second.size();
+            std::vector<std::string> rest;
+            for (auto& [j, parity] : group.parities) {
+                if (rest.size() == lost.size()) break;
+                if (parity.size() != LEN) return true;
+                rows.push_back(j);
+                rest.push_back(parity);
+                for (size_t i = 0; i < group.chunks.size(); ++i) {
+                    if (!group.received[i]) continue;
+                    fec_mul_add(rest.back().data(), group.chunks[i].data(),
+                                std::min(LEN, group.chunks[i].size()), fec_coef(FEC_K, j, i));
+                }
+            }
+            std::vector<std::string> rebuilt(lost.size(), std::string(LEN, '\0'));
+            std::vector<const char*> in;
+            std::vector<char*> out;
+            for (size_t r = 0; r < lost.size(); ++r) {
+                in.push_back(rest[r].data());
+                out.push_back(rebuilt[r].data());
+            }
+            fec_rebuild(FEC_K, lost.data(), rows.data(), lost.size(), in.data(), out.data(), LEN);
+            const uint32_t LAST_RANGE_CRC = group.range_crc;
+            group.whole = true;
+            group.chunks.clear();
+            group.parities.clear();
+            logger.debug(address, " - ", "Rebuilt ", lost.size(), " chunk(s) from parities");
+            for (size_t r = 0; r < lost.size(); ++r) {
+                uint64_t c = g * FEC_K + 1 + lost[r];
+                // every chunk but the last of the file is full
+                uint64_t offset = std::min((c - 1) * info.chunk_size, info.filesize);
+                int size = std::min<uint64_t>(info.chunk_size, info.filesize - offset);
+                if ((size_t)size > LEN) continue;
+                uint32_t c_crc = info.checksum ? crc32c(rebuilt[r].data(), size) : 0;
+                const bool IS_LAST = c == group_last(g);
+                if (!take_chunk(c, rebuilt[r].data(), size, c_crc, LAST_RANGE_CRC, IS_LAST))
+                    return false;
+            }
+            return true;
+        };
+
+        if (IS_PARITY) {
+            // the parity of a group not received yet, named by its first chunk of the range
+            uint64_t g = (chunk - 1) / FEC_K;
+            if (chunk == group_first(g) && group_last(g) >= range.chunk &&
+                chunk < range.chunk + info.window) {
+                auto& group = group_of(g);
+                if (!group.whole) {
+                    group.parities.try_emplace(parity_index, data, data_len);
+                    group.range_crc = range_crc;
+                }
+                if (!rebuild_group(g)) return HANDLE_END;
+            }
+        } else {
+            const bool IN_WINDOW = chunk >= range.chunk && chunk < range.chunk + info.window &&
+                                   chunk <= range.last;
+            if (FEC_K > 0 && IN_WINDOW) keep_chunk(chunk, data, data_len);
+            if (!take_chunk(chunk, data, data_len, crc, range_crc, true)) return HANDLE_END;
+            if (FEC_K > 0 && !rebuild_group((chunk - 1) / FEC_K)) return HANDLE_END;
+        }
+        // groups behind the progress are whole
+        while (!range.groups.empty() && group_last(range.groups.begin()->first) < range.chunk)
+            range.groups.erase(range.groups.begin());
+
+        // every range is received
+        bool received = info.written >= info.filesize &&
+                        std::all_of(info.ranges.begin(), info.ranges.end(), [](auto& r) {
+                            return r.chunk > r.first && r.pending.empty() && r.n_placed == 0;
+                        });
+        if (received) {
+            // wait for the writes in background
+            if (!close_transfer_file(info)) {
+                logger.error(address, " - ", "Failed to write file: ", info.filename);
+                remove_transfer_file(info);
+                return give_up(session), HANDLE_END;
+            }
+            // a delta rebuilds the file from the old one
+            std::vector<ContentChunk> chunks;
+            if (!info.old_fp.empty() && !rebuild_from_delta(info, chunks)) {
+                logger.error(address, " - ", "Failed to rebuild file: ", info.filename);
+                return give_up(session), HANDLE_END;
+            }
+            info.status = TransferStatus::DONE;
+            if (info.checksum) logger.debug(address, " - ", "Checksums of every range verified");
+            logger.info(address, " - ", "File received (", fmt_size(info.target_size),
+                        info.old_fp.empty() ? ""
+                        : info.recipe       ? ", recipe " + fmt_size(info.filesize)
+                                            : ", delta " + fmt_size(info.filesize),
                         "): ", info.filename);
-            int buflen = strlen(HEAD_DONE) + UUID_LEN + sizeof(u_long);
-            char* buf = new char[buflen];
-            memcpy(buf, HEAD_DONE, strlen(HEAD_DONE));
-            memcpy(buf + strlen(HEAD_DONE), uuid.c_str(), UUID_LEN);
-            memcpy(buf + strlen(HEAD_DONE) + UUID_LEN, &chunk_net, sizeof(u_long));
-            peer.send(buf, buflen);
-            delete[] buf;
-            lockmap.lock();
-            auto pmutex = info.mutex;
-            file_transfer_info.erase(uuid);
-            pmutex->unlock();
-            delete pmutex;
-            lockmap.unlock();
+            // the transfer is kept until expired, in case the reply gets lost
+            reply(true);
             peer.end();
+            // the client need not wait for the file to be indexed, nor do other transfers
+            if (chunk_indexer != nullptr) {
+                std::string fp = info.old_fp.empty() ? info.abs_fp : info.old_fp;
+                std::string filename = info.filename;
+                std::string peer_address = join_string(address);
+                uint64_t identity = identity_of(fp);
+                lock.unlock();
+                chunk_indexer->submit([=, chunks = std::move(chunks)]() mutable {
+                    // a file replaced meanwhile is split again
+                    if (identity_of(fp) != identity) chunks.clear();
+                    if (!index_chunks(fp, chunks))
+                        logger.warn(peer_address, " - ", "Failed to index chunks of file: ",
+                                    filename);
+                });
+            }
             return HANDLE_END;
         } else {
-            int buflen = strlen(HEAD_RECEIVED) + UUID_LEN + sizeof(u_long);
-            char* buf = new char[buflen];
-            memcpy(buf, HEAD_RECEIVED, strlen(HEAD_RECEIVED));
-            memcpy(buf + strlen(HEAD_RECEIVED), uuid.c_str(), UUID_LEN);
-            memcpy(buf + strlen(HEAD_RECEIVED) + UUID_LEN, &chunk_net, sizeof(u_long));
-            peer.send(buf, buflen);
-            delete[] buf;
-            return info.unuse(), HANDLE_END;
+            reply(false);
+            return info.update_time(), HANDLE_END;
+        }
+    }
+
+    // Signatures of a file, a delta of it is sent then
+    else if (IS_FRAME && frame.op == Opcode::SIGNATURES) {
+        const int LEN_FIELDS = sizeof(uint32_t);
+        // identity (8), file size (8), block size (4), then a signature of each block
+        const int LEN_REPLY_HEAD = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+        const int LEN_SIGNATURE = sizeof(uint32_t) + sizeof(uint64_t);
+        if (frame.length < (uint32_t)LEN_FIELDS) return reject(0), HANDLE_END;
+        const char* body = buf + FRAME_HEAD_LEN;
+        // a reply fits in a datagram
+        uint32_t reply_size = std::min<uint32_t>(get_u32(body), MAX_FRAME_LEN - FRAME_HEAD_LEN);
+        std::string fn(body + LEN_FIELDS, frame.length - LEN_FIELDS);
+        if (reply_size < (uint32_t)(LEN_REPLY_HEAD + LEN_SIGNATURE) || fn.size() == 0 ||
+            fn[0] == '/' || fn.find("..") != std::string::npos)
+            return reject(0), HANDLE_END;
+        std::string fp = (std::filesystem::path(opt_abs_save_path) / fn).string();
+        FileSource source;
+        uint64_t identity = identity_of(fp);
+        if (identity == 0 || is_partial_file(fp) || source.open(fp) != 0)
+            return reject(0), HANDLE_END;
+        uint64_t file_size = source.size();
+        uint32_t block_size = delta_block_size(file_size);
+        std::vector<BlockSignature> blocks;
+        int err = sign_blocks(source, block_size, frame.offset,
+                              (reply_size - LEN_REPLY_HEAD) / LEN_SIGNATURE, blocks);
+        source.close();
+        if (err != 0) return reject(0), HANDLE_END;
+        if (frame.offset == 0) logger.debug(address, " - ", "Signing file: ", fn);
+
+        std::string reply(LEN_REPLY_HEAD + blocks.size() * LEN_SIGNATURE, '\0');
+        put_u64(reply.data(), identity);
+        put_u64(reply.data() + sizeof(uint64_t), file_size);
+        put_u32(reply.data() + 2 * sizeof(uint64_t), block_size);
+        char* p = reply.data() + LEN_REPLY_HEAD;
+        for (auto& block : blocks) {
+            put_u32(p, block.weak);
+            put_u64(p + sizeof(uint32_t), block.strong);
+            p += LEN_SIGNATURE;
+        }
+        send_frame(peer, Opcode::SIGNATURES, 0, frame.offset, reply.data(), reply.size());
+        return HANDLE_END;
+    }
+
+    // Chunks indexed, a recipe refers to them then
+    else if (IS_FRAME && frame.op == Opcode::CHUNKS) {
+        const int LEN_HASH = 2 * sizeof(uint64_t);
+        if (chunk_index == nullptr) return reject(0), HANDLE_END;
+        const char* body = buf + FRAME_HEAD_LEN;
+        uint32_t count = frame.length / LEN_HASH;
+        std::vector<ChunkHash> hashes(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            const char* p = body + i * LEN_HASH;
+            hashes[i] = {get_u64(p), get_u64(p + sizeof(uint64_t))};
         }
+        // the files of the chunks are checked once for the query
+        std::vector<bool> found;
+        chunk_index->has(hashes, found);
+        std::string reply((count + 7) / 8, '\0');
+        for (uint32_t i = 0; i < count; ++i) {
+            if (found[i]) reply[i / 8] |= (char)(0x80 >> (i % 8));
+        }
+        send_frame(peer, Opcode::CHUNKS, 0, frame.offset, reply.data(), reply.size());
+        return HANDLE_END;
     }
 
     return HANDLE_NEXT;
 }
 
-#undef headcmp
+// A message dropped by the overloaded workers, the client resends the chunk reported
+int handle_drop(Message& msg, const SocketPeer& peer, const BasicSocket&) {
+    const char* buf = msg.data;
+    const int len = msg.len;
+    FrameHead frame;
+    if (decode_head(buf, len, frame)) {
+        if (frame.op != Opcode::TRANSFER && frame.op != Opcode::PACKED) return HANDLE_NEXT;
+        send_frame(peer, Opcode::DROP, frame.session, frame.offset);
+        return HANDLE_END;
+    }
+    int LEN_TRANSFER = strlen(HEAD_TRANSFER) + UUID_LEN + sizeof(uint32_t);
+    if (len < LEN_TRANSFER || !(headcmp(buf, HEAD_TRANSFER))) return HANDLE_NEXT;
+    char reply[sizeof(HEAD_DROP) + UUID_LEN + sizeof(uint32_t)];
+    memcpy(reply, HEAD_DROP, strlen(HEAD_DROP));
+    memcpy(reply + strlen(HEAD_DROP), buf + strlen(HEAD_TRANSFER), UUID_LEN + sizeof(uint32_t));
+    peer.send(reply, strlen(HEAD_DROP) + UUID_LEN + sizeof(uint32_t));
+    return HANDLE_END;
+}
 
 struct CLIOptions {
     bool has_opt_ip = false;
@@ -339,8 +1161,22 @@ struct CLIOptions {
     SockType socktype = SockType::TYPE_DGRAM;
     std::string save_path = "./received";
     int chunk_size = 2048;
+    int window_size = 64;
+    int batch_size = 16;
+    long long rate = 0;
+    long long peer_rate = 0;
+    bool gro = false;
+    int threads = 2;
+    int shards = 1;
+    bool uring = false;
+    int workers = 0;  // handle on the loop threads
+    int queue_size = 1024;
+    QueuePolicy overflow = QueuePolicy::BLOCK;
+    bool overflow_reply = false;
     int timeout_recv = 10000;
     int timeout_send = 10000;
+    int keep = 0;
+    bool dedup = false;
     bool listen_all = false;
 };
 
@@ -355,8 +1191,26 @@ inline void cli_usage() {
         "  --tcp                    Equivalent to --protocol tcp\n"
         "  --udp                    Equivalent to --protocol udp\n"
         "  --chunk <size>           Set chunk size for file transfer (default: 2048)\n"
+        "  --window <size>          Set the maximum chunks in flight per transfer (default: 64)\n"
+        "  --batch <size>           Set the number of datagrams received per call (default: 16)\n"
+        "  --gro                    Accept datagrams coalesced by the kernel (UDP only)\n"
+        "  --threads <n>            Set the number of threads receiving messages (default: 2)\n"
+        "  --engine <engine>        Receive and write files by poll or uring (io_uring, Linux\n"
+        "                           only) (default: poll)\n"
+        "  --shards <n>             Open n sockets sharing each address, each received on a loop\n"
+        "                           of its own (default: 1)\n"
+        "  --workers <n>            Handle messages on a pool of workers, compressed chunks are\n"
+        "                           accepted only then (default: 0, on the receiving threads)\n"
+        "  --queue <size>           Set the maximum messages waiting for workers (default: 1024)\n"
+        "  --overflow <policy>      Handle a full queue, drop|block|reply (default: block)\n"
         "  --timeout <timeout>      Set timeout for sending and receiving data (default: "
         "10000)\n"
+        "  --rate <bytes/s>         Limit the total receiving rate, e.g. 10M (default: no limit)\n"
+        "  --peer-rate <bytes/s>    Limit the receiving rate of each client (default: no limit)\n"
+        "  --keep <seconds>         Keep partial files for resuming their transfers (default: 0,\n"
+        "                           removed at once)\n"
+        "  --dedup                  Keep an index of the chunks received, files sent as recipes\n"
+        "                           are assembled from them (saves transfers, not disk space)\n"
         "  --debug                  Enable debug mode\n"
         "  --listen-all             Listen on all available interfaces\n"
         "\n"
@@ -436,6 +1290,149 @@ int main(int argc, char* argv[]) {
             } catch (...) {
                 return logger.error("Invalid chunk size: ", next), 1;
             }
+        } else if (arg_match(cur_argstr, "--window")) {
+            // opt: --window
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --window"), 1;
+            }
+            try {
+                int window_size = std::stoi(next);
+                if (window_size <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "window size must be a positive integer: ",
+                               next),
+                           1;
+                options.window_size = window_size;
+            } catch (...) {
+                return logger.error("Invalid window size: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--batch")) {
+            // opt: --batch
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --batch"), 1;
+            }
+            try {
+                int batch_size = std::stoi(next);
+                if (batch_size <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "batch size must be a positive integer: ",
+                               next),
+                           1;
+                options.batch_size = batch_size;
+            } catch (...) {
+                return logger.error("Invalid batch size: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--gro")) {
+            // opt: --gro
+            options.gro = true;
+        } else if (arg_match(cur_argstr, "--threads")) {
+            // opt: --threads
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --threads"), 1;
+            }
+            try {
+                int threads = std::stoi(next);
+                if (threads <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "number of threads must be a positive integer: ",
+                               next),
+                           1;
+                options.threads = threads;
+            } catch (...) {
+                return logger.error("Invalid number of threads: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--engine")) {
+            // opt: --engine
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --engine"), 1;
+            }
+            if (strcmp(next, "poll") == 0) {
+                options.uring = false;
+            } else if (strcmp(next, "uring") == 0) {
+                options.uring = true;
+            } else {
+                return logger.error("Invalid engine: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--shards")) {
+            // opt: --shards
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --shards"), 1;
+            }
+            try {
+                int shards = std::stoi(next);
+                if (shards <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "number of shards must be a positive integer: ",
+                               next),
+                           1;
+                options.shards = shards;
+            } catch (...) {
+                return logger.error("Invalid number of shards: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--workers")) {
+            // opt: --workers
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --workers"), 1;
+            }
+            try {
+                int workers = std::stoi(next);
+                if (workers < 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "number of workers must be a non-negative integer: ",
+                               next),
+                           1;
+                options.workers = workers;
+            } catch (...) {
+                return logger.error("Invalid number of workers: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--queue")) {
+            // opt: --queue
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --queue"), 1;
+            }
+            try {
+                int queue_size = std::stoi(next);
+                if (queue_size <= 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "queue size must be a positive integer: ",
+                               next),
+                           1;
+                options.queue_size = queue_size;
+            } catch (...) {
+                return logger.error("Invalid queue size: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--overflow")) {
+            // opt: --overflow
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --overflow"), 1;
+            }
+            if (strcmp(next, "drop") == 0) {
+                options.overflow = QueuePolicy::DROP;
+                options.overflow_reply = false;
+            } else if (strcmp(next, "block") == 0) {
+                options.overflow = QueuePolicy::BLOCK;
+                options.overflow_reply = false;
+            } else if (strcmp(next, "reply") == 0) {
+                // drop and tell the client
+                options.overflow = QueuePolicy::DROP;
+                options.overflow_reply = true;
+            } else {
+                return logger.error("Invalid overflow policy: ", next), 1;
+            }
         } else if (arg_match(cur_argstr, "--timeout")) {
             // opt: --timeout
             auto next = args.next();
@@ -454,6 +1451,43 @@ int main(int argc, char* argv[]) {
             } catch (...) {
                 return logger.error("Invalid timeout: ", next), 1;
             }
+        } else if (arg_match(cur_argstr, "--keep")) {
+            // opt: --keep
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --keep"), 1;
+            }
+            try {
+                int keep = std::stoi(next);
+                if (keep < 0)
+                    return logger.error(
+                               "Invalid argument: "
+                               "keep must be a non-negative integer: ",
+                               next),
+                           1;
+                options.keep = keep;
+            } catch (...) {
+                return logger.error("Invalid keep: ", next), 1;
+            }
+        } else if (arg_match(cur_argstr, "--dedup")) {
+            // opt: --dedup
+            options.dedup = true;
+        } else if (arg_match(cur_argstr, "--rate")) {
+            // opt: --rate
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --rate"), 1;
+            }
+            options.rate = parse_size(next);
+            if (options.rate < 0) return logger.error("Invalid rate: ", next), 1;
+        } else if (arg_match(cur_argstr, "--peer-rate")) {
+            // opt: --peer-rate
+            auto next = args.next();
+            if (next == nullptr) {
+                return logger.error("Missing argument for --peer-rate"), 1;
+            }
+            options.peer_rate = parse_size(next);
+            if (options.peer_rate < 0) return logger.error("Invalid rate: ", next), 1;
         } else if (arg_match(cur_argstr, "--listen-all")) {
             options.listen_all = true;
         } else if (cur_argstr.starts_with("--")) {
@@ -508,6 +1542,10 @@ int main(int argc, char* argv[]) {
 
     p1 = p2 = nullptr;
 
+    opt_max_window = options.window_size;
+    opt_keep = options.keep;
+    opt_chunk_size = options.chunk_size;
+
     // parse absolute path
     if (options.save_path.empty()) {
         return logger.error("Undefined save path, use --dir to specify."), 1;
@@ -539,8 +1577,29 @@ int main(int argc, char* argv[]) {
                                         : options.ip_ver == IPv4 ? "IPv4"
                                                                  : "IPv4, IPv6");
         logger.print(" - Chunk Size: ", options.chunk_size, " Bytes");
+        logger.print(" - Window Size: ", options.window_size, " Chunks");
+        logger.print(" - Batch Size: ", options.batch_size, " Datagrams");
+        logger.print(" - Receive Offload: ", options.gro ? "ON" : "OFF");
+        logger.print(" - Threads: ", options.threads);
+        logger.print(" - Engine: ", options.uring ? "uring" : "poll");
+        logger.print(" - Shards: ", options.shards);
+        if (options.workers > 0) {
+            logger.print(" - Workers: ", options.workers);
+            logger.print(" - Queue Size: ", options.queue_size, " Messages");
+            logger.print(" - Overflow: ",
+                         options.overflow_reply ? "reply" : queue_policy_name(options.overflow));
+        } else {
+            logger.print(" - Workers: (on receiving threads)");
+        }
+        logger.print(" - Rate Limit: ",
+                     options.rate > 0 ? fmt_size(options.rate) + "/s" : "(unlimited)");
+        logger.print(" - Rate Limit (Peer): ",
+                     options.peer_rate > 0 ? fmt_size(options.peer_rate) + "/s" : "(unlimited)");
         logger.print(" - Timeout (Recv): ", options.timeout_recv);
         logger.print(" - Timeout (Send): ", options.timeout_send);
+        logger.print(" - Keep Partial Files: ",
+                     options.keep > 0 ? std::to_string(options.keep) + " s" : "OFF");
+        logger.print(" - Deduplication: ", options.dedup ? "ON" : "OFF");
         logger.print(" - Save path: ", options.save_path);
     }
 
@@ -584,50 +1643,64 @@ int main(int argc, char* argv[]) {
 
     // Create server socket(s)
     logger.debug("Creating server socket(s)");
+    // each shard is served on an event loop of its own, the loops shall outlive the servers
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    for (int i = 0; i < options.shards; ++i) {
+        loops.emplace_back(std::make_unique<EventLoop>());
+        if (!loops.back()->valid())
+            return logger.error("Failed to create event loop"), WSACleanup(), 1;
+    }
     std::list<SocketServer> servers;
+    std::vector<int> server_shards;  // shard of each server, in the order of `servers`
     bool err_bindport = false;
     for (addrcoll* paddr = ipinfo; paddr != nullptr; paddr = paddr->ai_next) {
-        servers.emplace_back(BasicSocket(paddr));
-        SocketServer& server = servers.back();
-        std::string address_to_bind = server.conn_info().to_string();
-
-        // init socket
-        err = server.init_socket();
-        if (err != 0) {
-            logger.debug("Failed to create socket for ", address_to_bind, " (", err, ")");
-            server.destroy(), servers.pop_back();
-            continue;
-        }
-        // set socket options
-        const int RCV_TIMEOUT = options.timeout_recv;
-        const int SND_TIMEOUT = options.timeout_send;
-        int e1, e2;
-        e1 = setsockopt(server.socket(), SOL_SOCKET, SO_RCVTIMEO,  // receive timeout
-                        (const char*)&RCV_TIMEOUT, sizeof(RCV_TIMEOUT));
-        e2 = setsockopt(server.socket(), SOL_SOCKET, SO_SNDTIMEO,  // send timeout
-                        (const char*)&SND_TIMEOUT, sizeof(SND_TIMEOUT));
-        if (e1 == SOCKET_ERROR || e2 == SOCKET_ERROR) {
-            logger.error("Failed to set socket options (", e1, ", ", e2, ")");
-            server.destroy(), servers.pop_back();
-            continue;
-        }
-        // bind address
-        err = server.bind_address();
-        if (err != 0) {
-            logger.debug("Failed to bind socket for ", address_to_bind, " (", err, ")");
-            if (err == WSAEADDRINUSE) err_bindport = true;
-            server.destroy(), servers.pop_back();
-            continue;
-        }
-
-        if (!server.ensure()) {
-            logger.debug("Socket is not ready for ", address_to_bind);
-            server.destroy(), servers.pop_back();
-            continue;
-        }
-
-        // everything goes well
-        server.listen();
+        // sockets of the shards share the address, the kernel keeps a client on one of them
+        int shards = options.shards;
+        for (int shard = 0; shard < shards; ++shard) {
+            servers.emplace_back(BasicSocket(paddr));
+            SocketServer& server = servers.back();
+            std::string address_to_bind = server.conn_info().to_string();
+
+            // init socket
+            err = server.init_socket();
+            if (err != 0) {
+                logger.debug("Failed to create socket for ", address_to_bind, " (", err, ")");
+                server.destroy(), servers.pop_back();
+                continue;
+            }
+            // set socket options
+            int e1, e2;
+            e1 = set_socket_timeout(server.socket(), SO_RCVTIMEO, options.timeout_recv);
+            e2 = set_socket_timeout(server.socket(), SO_SNDTIMEO, options.timeout_send);
+            if (e1 == SOCKET_ERROR || e2 == SOCKET_ERROR) {
+                logger.error("Failed to set socket options (", e1, ", ", e2, ")");
+                server.destroy(), servers.pop_back();
+                continue;
+            }
+            // share the port, one socket is used if it is not supported
+            if (shards > 1 && server.reuse_port() != 0) {
+                logger.warn("Sharding is not available on ", address_to_bind);
+                shards = 1;
+            }
+            // bind address
+            err = server.bind_address();
+            if (err != 0) {
+                logger.debug("Failed to bind socket for ", address_to_bind, " (", err, ")");
+                if (err == WSAEADDRINUSE) err_bindport = true;
+                server.destroy(), servers.pop_back();
+                continue;
+            }
+
+            if (!server.ensure()) {
+                logger.debug("Socket is not ready for ", address_to_bind);
+                server.destroy(), servers.pop_back();
+                continue;
+            }
+
+            // everything goes well
+            server.listen();
+            server_shards.push_back(shard);
+        }
     }
     FreeAddrInfo(ipinfo);
 
@@ -638,28 +1711,88 @@ int main(int argc, char* argv[]) {
     }
 
     logger.append_stream("Server is running, ready on:", END_LINE);
+    int n_address = 0;
+    auto it_shard = server_shards.begin();
     for (auto& server : servers) {
+        if (*it_shard++ != 0) continue;
         logger.append_stream("  ", server.conn_info().to_string(), END_LINE);
+        ++n_address;
     }
-    logger.instant("You can access this server by the above address",
-                   servers.size() > 1 ? "es" : "", END_LINE);
+    logger.instant("You can access this server by the above address", n_address > 1 ? "es" : "",
+                   END_LINE);
     logger.print("The file received will be storaged at: ", ansi::gray, opt_abs_save_path,
                  ansi::reset);
     logger.endl();
 
     std::vector<std::thread> threads;
 
+    // partial files left by a previous run are kept for as long again
+    if (opt_keep > 0) {
+        std::error_code ec;
+        for (auto& entry : std::filesystem::recursive_directory_iterator(opt_abs_save_path, ec)) {
+            std::string fp = entry.path().string();
+            if (!fp.ends_with(JOURNAL_SUFFIX)) continue;
+            fp.resize(fp.size() - strlen(JOURNAL_SUFFIX));
+            if (std::filesystem::exists(fp, ec)) kept_files[fp] = Timer::point();
+        }
+        if (!kept_files.empty())
+            logger.info("Partial files kept for resuming: ", kept_files.size());
+    }
+
+    // chunks indexed by a previous run are still found, as long as their files are unchanged
+    if (options.dedup) {
+        chunk_index = std::make_shared<ChunkIndex>();
+        auto index_fp = std::filesystem::path(opt_abs_save_path) / CHUNK_INDEX_NAME;
+        if (chunk_index->open(index_fp.string()) != 0)
+            logger.warn("Malformed chunk index, started over: ", index_fp.string());
+        if (chunk_index->size() > 0) logger.info("Chunks indexed: ", chunk_index->size());
+        chunk_indexer = std::make_shared<WorkerPool>(1, options.queue_size, QueuePolicy::BLOCK);
+    }
+
     need_cleanup = true;
     std::thread cleanup_thread(cleanup_expired_file_transfer_info,
                                int(options.timeout_send + options.timeout_recv),
                                int((options.timeout_send + options.timeout_recv) * 1.5));
 
+    // the total limit is shared by all the servers
+    auto total_limit = std::make_shared<TokenBucket>(options.rate);
+    // so are the workers
+    if (options.workers > 0)
+        worker_pool = std::make_shared<WorkerPool>(options.workers, options.queue_size,
+                                                   options.overflow);
+    // the io_uring engine, the plain calls are kept if the kernel lacks support
+    if (options.uring) {
+        file_writer = std::make_shared<RingWriter>(options.chunk_size);
+        if (!file_writer->valid()) {
+            logger.warn("io_uring is not available, fall back to poll");
+            file_writer = nullptr;
+            options.uring = false;
+        }
+    }
+
+    it_shard = server_shards.begin();
     for (auto& server : servers) {
+        EventLoop& loop = *loops[*it_shard++];
+        server.limit_rate(options.peer_rate, total_limit);
+        server.set_batch_size(options.batch_size);
+        if (options.gro && server.enable_gro() != 0)
+            logger.warn("Receive offload is not available on ", server.conn_info().to_string());
+        if (options.uring && options.socktype == SockType::TYPE_DGRAM && server.use_uring() != 0)
+            logger.warn("io_uring is not available on ", server.conn_info().to_string());
         server.onmessage(&handle_hello);
         server.onmessage(&handle_file_transfer);
-        threads.emplace_back(&SocketServer::serve, &server, options.chunk_size);
+        if (worker_pool != nullptr) server.use_workers(worker_pool);
+        if (options.overflow_reply) server.ondrop(&handle_drop);
+        err = server.serve(loop, options.chunk_size);
+        if (err != 0)
+            logger.error("Failed to serve on ", server.conn_info().to_string(), " (", err, ")");
     }
 
+    // handle messages on a few threads, every shard has at least one
+    int n_threads = std::max(options.threads, options.shards);
+    for (int i = 0; i < n_threads; ++i)
+        threads.emplace_back(&EventLoop::run, loops[i % options.shards].get());
+
     // Wait for all threads to finish
     for (auto& t : threads) {
         if (t.joinable()) t.join();
@@ -673,6 +1806,9 @@ int main(int argc, char* argv[]) {
         server.close();
         server.destroy();
     }
+    if (worker_pool != nullptr) worker_pool->stop();
+    // files received last are still indexed
+    if (chunk_indexer != nullptr) chunk_indexer->stop();
     BasicSocket::terminate();
 
     return 0;